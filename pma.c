@@ -34,7 +34,7 @@ pma can transform any correctly formatted data (not just Linux/Unix performance
 data), irrespective of what kind. See the README file for more information.
 *******************************************************************************/
 
-#define PROGVERSIONSTR	"0.0.2"
+#define PROGVERSIONSTR	"0.0.4"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -42,15 +42,38 @@ data), irrespective of what kind. See the README file for more information.
 #include <getopt.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <stdint.h>
 #include <errno.h>
 #include <locale.h>
+#include <fnmatch.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #define QUOTECHAR	'\''
 #define COMMENTCHAR	'#'
 #define STANZATERMCHAR	':'
 #define NODEVICENAME	"None"
+#define HOSTSEPARATOR	"@"		/* --fleet: metric@host */
+#define HOSTNAMEKEY	"h="		/* pmc's TIME_VALUES comment: h=hostname */
+#define IGNOREDDEVICE	-2		/* --include/--exclude: in deviceindex only */
 #define STDINFILENAME	"-"
+#define STDOUTFILENAME	"-"
 
 #define TIMEVALUES	"TIME_VALUES:"
 #define COUNTIDX	0
@@ -62,76 +85,442 @@ data), irrespective of what kind. See the README file for more information.
 #define CLASSTYPEIDX	1
 #define STARTROWIDX	2
 #define NUMMETAITEMS	3
-#define MAXNUMMETRICS	32
-#define MAXNUMMETADATA	(NUMMETAITEMS+MAXNUMMETRICS)
+#define MINNUMARGS	16		/* initial size of the input files' Token tables */
 #define ARRAYCLASS	'A'
 #define VECTORCLASS	'V'
 
-#define MAXCLSNAMELEN	32
-#define MAXMETNAMELEN	32
-#define MAXDEVNAMELEN	32
-#define MAXDATSTZLEN	32
 #define MAXFORMATSTRLEN	64
-#define MAXMETDEVNAMELEN (MAXMETNAMELEN+MAXDEVNAMELEN+32)
+#define MINDEVNAMEBUFSIZE 256		/* initial size of a stanza's device names */
 
 #define DATESTR		"DATE:"
 #define TIMESTAMPIDX	0
 #define NUMDATEARGS	1	/* Only comments after that */
+#define DATEINDEXSUFFIX	".idx"	/* --from: the DATE index (sidecar) file */
+#define INDEXSTR	"INDEX:"
+#define NUMINDEXARGS	3
+#define MINDATEENTRIES	1024
 
 #define MAXTMSTPSTRLEN	128
-#define MAXINPUTLINELEN	256
+#define MAXNUMSTRLEN	64
+#define MAXFASTDIGITS	19		/* significant digits that fit in 64 bits */
+#define MAXFASTPOWER10	22		/* 10^22 is the largest exact power of 10 */
+#define INPUTBUFSIZE	(1024*1024)	/* initial read buffer size for stdin & pipes */
+#define DECOMPPIPESIZE	(1024*1024)	/* (Linux) decompressor pipe buffer size */
+#define MAXMAGICLEN	6		/* compressed file magic numbers */
+#define MINRELEASESIZE	(1024*1024)	/* --max-memory: release mmap'ed input pages */
+#define SINGLEOUTBUFSIZE (1024*1024)	/* single output file write buffer size */
+#define MULTIOUTBUFSIZE	8192		/* each multiple output file's buffer size */
+#define OUTPUTFDRESERVE	32		/* fds not used by the open output file pool */
+#define MINOPENOUTFILES	4
+#define MAXFASTVALUE	1e14		/* larger values are formatted by snprintf */
+#define JOBQUEUELEN	8		/* parsed data sets queued per worker thread */
+#define SEGMENTSIZE	(1024*1024)	/* -j: mmap'ed input files are split into parts */
 #define MAXPARAMVALLEN	128
 #define MAXPATHNAMELEN	2048
 #define MULTIDIRMODE	0755
+#define CSVFORMAT	0		/* single file output formats */
+#define BINARYFORMAT	1
+#define JSONFORMAT	2		/* (--serve responses only) */
+#define BINARYMAGIC	"PMABIN01"
+#define BINARYVERSION	1
+#define BINARYSPARSEVERSION 2		/* --sparse: the blocks have only the changes */
+#define BINARYBYTEORDER	0x01020304
+#define BINARYNAMELEN	40		/* NUL padded names in the binary header */
+#define MEANBUCKET	0		/* --bucket aggregate functions */
+#define MAXBUCKET	1
+#define MINBUCKET	2
+#define STATESTR	"STATE:"	/* --incremental state file stanzas */
+#define METRICSSTR	"METRICS:"
+#define DEVICESSTR	"DEVICES:"
+#define NUMSTATEARGS	5
+#define NUMMETRICSTATEARGS 9
+#define NUMDEVICESTATEARGS 17
+#define FOLLOWPOLLSECS	5		/* --follow: the longest wait for more input */
+#define INITPHASE	0		/* --stats phases (of the main thread) */
+#define PARSEPHASE	1
+#define STOREPHASE	2
+#define SINGLEPHASE	3
+#define MULTIPHASE	4
+#define CLOSEPHASE	5
+#define CLOCKTICKSPHASE	6
+#define NUMPHASES	7
+#define NOSTATS		0		/* --stats output formats */
+#define TEXTSTATS	1
+#define JSONSTATS	2
+#define MINNAMEINDEXSIZE 64
+#define MINNUMDEVICES	8
+#define SKETCHACCURACY	0.01		/* relative error of the quantile sketches */
+#define SKETCHMINVALUE	1e-9		/* smaller (absolute) values count as zero */
+#define MAXSKETCHKEYS	2048		/* (more than) 1e-9 to 1e9 without collapsing */
+#define SKETCHLOGBITS	12		/* (top) mantissa bits of the log table index */
+#define MINSERVEROWS	1024		/* --serve: the initial size of the row store */
+#define MAXREQUESTLEN	4096		/* the first line of a request */
+#define MAXSERVENAMES	64		/* name= globs per request */
+#define SERVEOUTBUFSIZE	(64*1024)	/* each response's buffer */
+#define SERVETIMEOUTSECS 5		/* a client's send and receive timeout */
+#define SERVEBACKLOG	16
+#define CLOCKTICKSBUFSIZE (256*1024)	/* the clockticks file's write buffer size */
+#define MINLOCALDAYS	64		/* clockticks: the initial size of the day table */
+#define CLOCKTICKSSECS	(24*60*60)	/* clockticks: the thread is woken once a day */
 
 /* Macros */
 #define WHITESPACE(c)   (((c)==' '||(c)=='\t'||(c)=='\n') ? 1 : 0) 
 #define MIN(a,b)	((a)<(b)?(a):(b))
 #define MAX(a,b)	((a)>(b)?(a):(b))
+#define VALUEPTR(classptr, rowidx, metricidx, deviceidx) ((classptr)->valuetbl + \
+	((size_t)(rowidx)*(classptr)->nummetrics+(metricidx))*(classptr)->maxdevices+(deviceidx))
+#define SAMPLEFLAGPTR(classptr, rowidx, deviceidx) ((classptr)->sampleflagtbl + \
+	(size_t)(rowidx)*(classptr)->maxdevices+(deviceidx))
+
+typedef struct {			/* an open addressing hash table: name -> index */
+    char	**nametbl;		/* (copies of) the names - NULL if unused */
+    int		*indextbl;
+    int		size;			/* always a power of 2 */
+    int		numnames;
+} Nameindex;
+
+typedef struct {			/* a range of logarithmic quantile sketch buckets */
+    int		minkey;
+    int		numkeys;
+    unsigned	*countertbl;		/* numkeys counters, from minkey up */
+} Sketchstore;
+
+typedef struct {			/* a (bounded memory) quantile sketch */
+    Sketchstore	positive;		/* (the keys of) values > SKETCHMINVALUE */
+    Sketchstore	negative;		/* and of values < -SKETCHMINVALUE */
+    unsigned	zeroctr;
+} Sketch;
+
+typedef struct outputfile {		/* a (write() buffered) output file */
+    char	*filename;
+    int		fd;			/* -1 while it's not in the open file pool */
+    int		stdoutflag;		/* (never in the pool, or closed) */
+    int		socketflag;		/* --serve: a client (ditto, and errors end it) */
+    char	*bufptr;
+    size_t	bufsize;
+    size_t	len;			/* characters in the buffer */
+    struct outputfile *prevptr;		/* the open file pool LRU list */
+    struct outputfile *nextptr;
+} Outputfile;
 
 typedef struct {			/* e.g., sda, eth0 or NA */
-    char	devicename[MAXDEVNAMELEN+1];
+    char	*devicename;		/* (in the class' device name index) */
     int		number;
+    double	min;
     double	max;
     double	sum;
+    double	mean;			/* (running, for m2) */
+    double	m2;			/* the sum of squares of differences from mean */
+    int		abovectr;		/* values above the threshold */
+    Sketch	sketch;
     double	scale;
-    double	*valuetbl;		/* there should always be count entries! */
-    FILE	*fileptr;
+    int		samplectr;		/* rows read in the current stanza (metric 0's) */
+    int		singlefileflag;		/* a column of the single file */
+    int		appendflag;		/* its multiple file exists (for --incremental) */
+    Outputfile	*outputfileptr;		/* the multiple file output file */
+    double	singlefilevalue;	/* --sparse: the last value written to the single */
+    double	multifilevalue;		/* and multiple files (NAN: none), and the data */
+    time_t	skippedtimestamp;	/* set and row of the last (unchanged) point */
+    int		skippedrowidx;		/* not written to the multiple file (-1: none) */
+    double	*servevaluetbl;		/* --serve: the (unscaled) values of the rows */
+    int		servefirstrow;		/* servefirstrow ... of servetimetbl */
+    int		maxservevalues;		/* (allocated entries) */
 } Device;
 
 typedef struct {			/* e.g., cpu_us and tps */
-    char	metricname[MAXMETNAMELEN+1];
+    char	*metricname;
     int		number;
+    double	min;
     double	max;
     double	sum;
+    double	mean;
+    double	m2;
+    int		abovectr;
     int		numdevices;
+    int		maxdevices;		/* allocated entries in devicetbl */
     Device	*devicetbl;
 } Metric;
 
 typedef struct {			/* e.g., IO, VM, NET */
-    char	classname[MAXCLSNAMELEN+1];
+    char	*classname;
+    char	*datastanza;		/* the data stanza header: classname ":" */
     char	classtype;
     int		startrow;
     int		nummetrics;
     Metric	*metrictbl;
+    Nameindex	deviceindex;		/* names of the devices (of every metric) */
+    int		numfields;		/* values in each data line (of every metric) */
+    int		*fieldmetrictbl;	/* [numfields]: metric index, -1: skip (or NULL) */
+    int		numignoreddevices;	/* (not selected, see select_new_device) */
+    double	*valuetbl;		/* [count][nummetrics][maxdevices] - VALUEPTR */
+    char	*sampleflagtbl;		/* [count][maxdevices]: a (good) sample row? */
+    int		maxdevices;		/* allocated devices (per metric) in valuetbl */
+    double	*bucketvaluetbl;	/* --bucket: [nummetrics][maxdevices] */
+    int		*bucketctrtbl;		/* [maxdevices]: the samples in the bucket */
 } Class;
 
+typedef struct {			/* a growable buffer of (deferred) messages */
+    char	*str;
+    size_t	len;
+    size_t	size;
+} Messagebuf;
+
+typedef struct {			/* the parsed rows of one class stanza */
+    int		numrows;		/* all rows, including bad ones */
+    int		maxrows;
+    unsigned	endlinectr;		/* input file line of the end of the stanza */
+    char	*goodflagtbl;		/* is each row good (the right no. of args)? */
+    double	*valuetbl;		/* nummetrics values per row */
+    size_t	*devicenameofftbl;	/* (array) row device names in devicenamebuf */
+    char	*devicenamebuf;		/* null terminated device names */
+    size_t	devicenamebuflen;
+    size_t	devicenamebufsize;
+    int		numbadvalues;		/* malformed values (strict mode only) */
+    int		terminatedflag;		/* ended by an empty line (not EOF) */
+    Messagebuf	messagebuf;
+} Stanza;
+
+typedef struct dataset {		/* a parsed data set: DATE + all class stanzas */
+    time_t	timestamp;
+    Stanza	*stanzatbl;		/* numstanzas entries ... */
+    int		numstanzas;
+    int		firstclassidx;		/* ... of classtbl[firstclassidx] onwards */
+    Messagebuf	messagebuf;
+    off_t	startoffset;		/* input file offsets and lines of the data set */
+    off_t	endoffset;
+    unsigned	startlinectr;
+    unsigned	endlinectr;
+    int		completeflag;		/* not cut short by EOF (still being written) */
+    struct dataset *nextptr;		/* a Jobsegment's queue (or the free list) */
+} Dataset;
+
+typedef struct {			/* a configuration file (metric) scale entry */
+    char	*name;			/* (in scalenameindex) */
+    double	scale;
+} Scaleentry;
+
+typedef struct {			/* a metric (in metricnameindex) */
+    Class	*classptr;
+    Metric	*metricptr;
+} Metricentry;
+
+typedef struct {			/* an output plan column: an active (metric_)device */
+    double	*valueptr;		/* its value in row 0 (or the bucket) */
+    size_t	rowstride;		/* values between rows (0 for --bucket) */
+    double	multiplier;		/* fullscale/scale */
+    int		startrow;		/* (0 for --bucket) */
+    int		*samplectrptr;		/* its bucket's samples (or always 1) */
+    Outputfile	*outputfileptr;		/* its multiple file */
+    Device	*deviceptr;		/* (--sparse) */
+} Outputcolumn;
+
+typedef struct {			/* a slice of an input line - NOT null terminated! */
+    char	*ptr;
+    int		len;
+} Token;
+
+typedef struct {			/* an input (or configuration) file */
+    char	*filename;
+    int		fd;
+    int		mappedflag;		/* the whole file is mmap'ed */
+    int		eofflag;
+    char	*bufptr;		/* the mapping, or the read buffer */
+    off_t	bufoffset;		/* the input file offset of bufptr[0] */
+    size_t	bufsize;
+    char	*curptr;		/* the first unread character */
+    char	*endptr;		/* one past the last valid character */
+    unsigned	linectr;
+    time_t	timestamp;		/* of the last DATE stanza read */
+    size_t	releasedsize;		/* --max-memory: mapping pages released */
+    Token	*argtbl;		/* (see input_args) */
+    int		maxargs;
+    pid_t	decompressorpid;	/* fd is its output pipe (0 if none) */
+    char	*decompressorname;
+    unsigned char peektbl[MAXMAGICLEN];	/* (a pipe's) magic number bytes read */
+    int		peeklen;
+    int		segmentflag;		/* a segment (see open_input_segment) */
+} Inputfile;
+
+typedef struct {			/* a compressed input file format */
+    char	*magic;			/* the first bytes of the file */
+    int		magiclen;
+    char	*argvtbl[5];		/* the (stdin to stdout) decompressor command */
+} Decompressor;
+
+typedef struct {			/* a part of an input file parsed by a worker thread */
+    char	*startptr;		/* its first DATE line (NULL: the whole file) */
+    char	*endptr;		/* (the next segment's first DATE line) */
+    unsigned	linectr;		/* the line number before startptr ... */
+    int		linectrflag;		/* ... once the previous segment is counted */
+    Dataset	*headptr;		/* the queue of parsed data sets */
+    Dataset	*tailptr;
+    int		doneflag;
+} Jobsegment;
+
+typedef struct {			/* an input file parsed by worker threads */
+    char	*filename;
+    Inputfile	*ifp;
+    int		openedflag;		/* opened (or not) and split into segments */
+    int		openingflag;
+    int		openfailedflag;
+    Jobsegment	*segmenttbl;
+    int		numsegments;
+    int		nextsegmentidx;		/* the next one to be parsed */
+    int		numparsingsegments;	/* ifp is closed when the last one is done */
+    time_t	timestamp;		/* of the last data set processed */
+} Jobfile;
+
+typedef struct {			/* --fleet: a host (one input file) */
+    char	*hostname;
+    Inputfile	*ifp;
+    int		firstclassidx;		/* its classes (of metrics metric@hostname) */
+    int		numhostclasses;
+    Dataset	*headptr;		/* the queue of parsed data sets */
+    Dataset	*tailptr;
+    int		numqueued;
+    Dataset	*freeptr;		/* its processed data sets, for reuse */
+    int		readingflag;		/* a worker thread is reading it */
+    int		doneflag;
+} Host;
+
+typedef struct {			/* a DATE stanza of an input file (the DATE index) */
+    time_t	timestamp;
+    off_t	offset;			/* of its DATE line */
+    unsigned	linectr;		/* the lines before it */
+} Dateentry;
+
+typedef struct {			/* the --incremental state (sidecar) file */
+    char	*filename;
+    int		resumeflag;		/* it was read (this is not the first run) */
+    char	*inputfilename;		/* the input file to resume reading ... */
+    off_t	offset;			/* ... from here */
+    unsigned	linectr;
+    time_t	timestamp;		/* of the last data set processed */
+    time_t	firsttimestamp;		/* of the first (ever) data set */
+} Statefile;
+
+typedef struct {			/* --serve: a series (and its statistics) to output */
+    char	*name;			/* metric or metric_device (a copy) */
+    char	*classname;
+    char	*metricname;
+    char	*devicename;		/* ("" for a vector class metric) */
+    double	scale;
+    Device	*deviceptr;		/* (its stored rows) */
+    int		number;
+    double	min;
+    double	max;
+    double	mean;
+    double	p50;
+    double	p95;
+    double	p99;
+} Serveseries;
+
+typedef struct {			/* clockticks: a local day (or the rest of one) */
+    time_t	timestamp;		/* its start: midnight, or a DST change */
+    struct tm	tm;			/* (the broken down local time then) */
+} Localday;
+
 /*********** uninitialized global variables ***********/
-FILE		*inputfileptr;
+Jobfile		*jobfiletbl;
+int		numjobfiles;
+int		nextjobfileidx;
+Jobsegment	*currentsegmentptr;	/* being stored and output by the main thread */
+int		numqueueddatasets;
+int		maxqueueddatasets;
+Dataset		*freedatasetptr;	/* a list of processed data sets, for reuse */
+Host		*hosttbl;		/* --fleet */
+int		numhosts;
 FILE		*clockticksfileptr;
 int		numclasses;
 int		count;
 int		interval;
-unsigned	inputlinectr;
 double		fullscale;
 
 /*********** initialized global variables ***********/
 int		verbosity		= 0;
 int		datavaluesflag		= 0;
 int		parametersflag		= 0;
+int		firstdatasetflag	= 1;
+int		strictflag		= 0;
+int		singlefileformat	= CSVFORMAT;
+int		sparseflag		= 0;	/* --sparse: output only the changes */
+int		followflag		= 0;
+int		bucketsecs		= 0;	/* --bucket: 0 is every row */
+int		bucketfunction		= MEANBUCKET;
+time_t		fromtimestamp		= 0;	/* --from: 0 is the first data set */
+time_t		totimestamp		= 0;	/* --to: 0 is the last data set */
+long		currentbucket;			/* rows are in bucket (time-1)/bucketsecs */
+int		numbucketrows		= 0;
+int		statsformat		= NOSTATS;	/* -T|--stats */
+int		currentphase		= INITPHASE;
+double		phasestarttime		= 0.0;
+double		phasecpustarttime	= 0.0;
+double		phasesecstbl[NUMPHASES];
+double		phasecpusecstbl[NUMPHASES];	/* (of the main thread) */
+double		clocktickscpusecs	= 0.0;	/* (of the clockticks thread) */
+char		*phasenametbl[NUMPHASES] = { "init", "parse", "store", "singlefile",
+					    "multifiles", "close", "clockticks" };
+double		inputbytectr		= 0.0;	/* of all the data sets processed */
+double		inputrowctr		= 0.0;
+double		inputlinectr		= 0.0;
+double		stanzactr		= 0.0;
+double		valuectr		= 0.0;	/* (good rows x metrics) */
+double		badlinectr		= 0.0;
+double		outputbytectr		= 0.0;
+int		inputfilectr		= 0;
+int		outputopenctr		= 0;	/* (including reopens) */
+size_t		maxmemory		= 0;	/* --max-memory (bytes), 0 is no limit */
+volatile sig_atomic_t stopflag		= 0;	/* --follow: SIGINT or SIGTERM */
+int		badvaluectr		= 0;
+char		decimalpointchar	= '.';
 time_t		firsttimestamp		= 0;
 char		*configfilename 	= NULL;
+char		**includetbl		= NULL;	/* --include globs */
+int		numincludes		= 0;
+char		**excludetbl		= NULL;	/* --exclude globs */
+int		numexcludes		= 0;
 Class		*classtbl		= NULL;
+Scaleentry	*scaletbl		= NULL;
+int		numscaleentries		= 0;
+Nameindex	scalenameindex;			/* name -> its last scale entry */
+Metricentry	*metricentrytbl		= NULL;	/* (see check_metric_names) */
+Nameindex	metricnameindex;		/* name -> metricentrytbl index */
+Nameindex	paramnameindex;			/* name -> paramtbl index */
+Outputfile	*lruheadptr		= NULL;	/* the most recently used open file */
+Outputfile	*lrutailptr		= NULL;
+Outputcolumn	*singlecolumntbl	= NULL;	/* the output plans (see build_output_plans) */
+Outputcolumn	*multicolumntbl		= NULL;
+int		numsinglecolumns	= 0;
+int		nummulticolumns		= 0;
+Outputcolumn	*servecolumntbl		= NULL;	/* --serve: the stored columns */
+int		numservecolumns		= 0;
+char		*servesocketname	= NULL;	/* --serve */
+int		servesocketfd		= -1;
+time_t		*servetimetbl		= NULL;	/* the time of each stored row */
+int		numserverows		= 0;
+int		maxserverows		= 0;
+int		numopenoutputfiles	= 0;
+int		maxopenoutputfiles	= 0;	/* set by main */
+Statefile	*statefileptr		= NULL;	/* --incremental */
+pthread_mutex_t	jobmutex		= PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t	jobcond			= PTHREAD_COND_INITIALIZER;
+pthread_mutex_t	forkmutex		= PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t	servemutex		= PTHREAD_MUTEX_INITIALIZER;	/* the store */
+pthread_mutex_t	clockticksmutex		= PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t	clocktickscond		= PTHREAD_COND_INITIALIZER;
+pthread_t	clockticksthread;
+int		clockticksthreadflag	= 0;
+time_t		clocktickstimestamp	= 0;	/* the latest data set output (so far) */
+time_t		clockticksnexttimestamp	= 0;	/* (when to wake the thread again) */
+int		clockticksdoneflag	= 0;	/* clocktickstimestamp is the last */
+
+/* compressed input files are read from the output of one of these */
+Decompressor decompressortbl[] = {
+    {"\x1f\x8b",                 2, {"gzip", "-d", "-c", NULL       }},
+    {"\x28\xb5\x2f\xfd",         4, {"zstd", "-d", "-c", "-q", NULL }},
+    {"\xfd\x37\x7a\x58\x5a\x00", 6, {"xz",   "-d", "-c", "-T0", NULL}},
+};
+#define NUMDECOMPRESSORS (sizeof(decompressortbl)/sizeof(Decompressor))
 
 /*******************************************************************************
 Define the configuration parameter table and populate it with default values (of
@@ -175,6 +564,7 @@ typedef struct {
 #define CLOCKTICKSLEV5IDX	14
 #define CLOCKTICKSLEV6IDX	15
 #define CLOCKTICKSLEV7IDX	16
+#define THRESHOLDIDX		17
 #define NUMCLOCKTICKSLEVELS	8
 Param paramtbl[] = {
     {FULLSCALEIDX,          "fullscale",             FLTPNT,  {.fltpnt   =100.0        }, {.string=""}},
@@ -194,6 +584,7 @@ Param paramtbl[] = {
     {CLOCKTICKSLEV5IDX,     "clockticks_level_5",    INTEGER, {.longint  =   15*60     }, {.string=""}},
     {CLOCKTICKSLEV6IDX,     "clockticks_level_6",    INTEGER, {.longint  =    5*60     }, {.string=""}},
     {CLOCKTICKSLEV7IDX,     "clockticks_level_7",    INTEGER, {.longint  =       0     }, {.string=""}},
+    {THRESHOLDIDX,          "threshold",             FLTPNT,  {.fltpnt   = 80.0        }, {.string=""}},
 };
 #define NUMCONFIGPARAMS	(sizeof(paramtbl)/sizeof(Param))
 
@@ -207,10 +598,27 @@ typedef struct {
 %s [OPTION ...] inputfile ...\n\
     Where the OPTIONs are:\n\
 	-c|--configurationfile	configuration_file_name\n\
-	-s|--singlefile		single_output_file_name\n\
+	-s|--singlefile		single_output_file_name (- is stdout)\n\
+	-f|--format		csv|binary (the single file format)\n\
 	-m|--multifiledirectory	multiple_files_directory_name\n\
-	-d|--datavalues\n\
+	-z|--sparse		(output only the changes of each metric[_device])\n\
+	-j|--jobs		number_of_input_parsing_threads\n\
+	-H|--fleet		(each input file is a host: merge them, metric@host)\n\
+	-t|--from		timestamp (the first data set, epoch seconds)\n\
+	-u|--to			timestamp (the last data set, epoch seconds)\n\
+	-x|--build-index	(build/update the input files' DATE indexes)\n\
+	-I|--include		metric[_device]_glob (only these, repeatable)\n\
+	-X|--exclude		metric[_device]_glob (not these, repeatable)\n\
+	-i|--incremental	state_file_name\n\
+	-F|--follow		(the last input file, like tail -f)\n\
+	-D|--serve		socket_name (and -F: answer series queries)\n\
+	-b|--bucket		seconds (output one row per bucket)\n\
+	-a|--aggregate		mean|max|min (of each bucket, default mean)\n\
+	-M|--max-memory		bytes[K|M|G] (the memory budget)\n\
+	-T|--stats[=text|json]	(the time of each phase, and counters)\n\
+	-d|--datavalues		(twice: min, percentiles, stddev, %% above threshold)\n\
 	-p|--parameters\n\
+	-S|--strict\n\
 	-v|--verbose\n\
 	-h|--help\n"
 
@@ -228,11 +636,11 @@ Called after a system call error to display details and then exit. May be called
 with one or more arguments.
 *******************************************************************************/
 void err_exit(const char *formatstr, ...) {
-    char	msgstr[MAXTMSTPSTRLEN];
+    char	msgstr[MAXPATHNAMELEN*2];
     va_list	argptr;
 
     va_start (argptr, formatstr);
-    vsprintf (msgstr, formatstr, argptr);
+    vsnprintf (msgstr, sizeof(msgstr), formatstr, argptr);
     va_end (argptr);
     perror(msgstr);
     exit(1);
@@ -240,46 +648,406 @@ void err_exit(const char *formatstr, ...) {
 
 
 /*******************************************************************************
-Parse up to a maximum of maxarg arguments of inputline. argtbl is poplulated
-with pointers to the arguments, and these are null terminated. (So some of the
-contents of inputline are overwritten!)
+If (the magic number at the start of) the input file says it is compressed,
+start its decompressor (reading the file) and read from its output (a pipe)
+instead. So decompression runs in parallel with (and ahead of) the parsing.
+Other threads may be starting decompressors too: the pipe fds are close-on-exec
+before the forkmutex is unlocked, so no decompressor holds another's pipe open.
+
+A pipe (stdin) can't be pread, so its magic number bytes are read (into
+peektbl). If it is compressed, the decompressor's stdin is another pipe, fed
+those bytes and then the rest of the input by feed_decompressor (a child of the
+decompressor's process, forked before the exec). If not, open_inputfile puts
+them at the start of the read buffer.
+*******************************************************************************/
+void feed_decompressor(Inputfile *ifp, int *pipefdtbl) {	/* (after fork: no stdio) */
+    char	buf[PIPE_BUF];
+    ssize_t	numread;
+    int		feedfdtbl[2];
+
+    if (pipe(feedfdtbl) != 0) {
+	return;
+    }
+    if (fork() == 0) {			/* (the decompressor's output is not its) */
+	close(pipefdtbl[0]);
+	close(pipefdtbl[1]);
+	close(feedfdtbl[0]);
+	if (write(feedfdtbl[1], ifp->peektbl, ifp->peeklen) == ifp->peeklen) {
+	    while ((numread=read(ifp->fd, buf, sizeof(buf))) > 0 ||
+					    (numread < 0 && errno == EINTR)) {
+		if (numread > 0 && write(feedfdtbl[1], buf, numread) != numread) {
+		    break;
+		}
+	    }
+	}
+	_exit(0);
+    }
+    close(feedfdtbl[1]);
+    ifp->fd = feedfdtbl[0];
+}
+
+void start_decompressor(Inputfile *ifp) {
+    Decompressor	*decompressorptr;
+    unsigned char	magic[MAXMAGICLEN];
+    ssize_t		magiclen, numread;
+    int			pipefdtbl[2], idx;
+
+    if ((magiclen=pread(ifp->fd, magic, MAXMAGICLEN, 0)) < 0 && errno == ESPIPE) {
+	for (magiclen=0; magiclen<MAXMAGICLEN; magiclen+=numread) {
+	    if ((numread=read(ifp->fd, magic+magiclen, MAXMAGICLEN-magiclen)) == 0) {
+		break;
+	    } else if (numread < 0 && errno != EINTR) {
+		err_exit("Could not read input file '%s', aborting!", ifp->filename);
+	    }
+	    numread = MAX(numread, 0);
+	}
+	memcpy(ifp->peektbl, magic, magiclen);
+	ifp->peeklen = magiclen;
+    }
+    if (magiclen <= 0) {
+	return;
+    }
+    for (idx=0; idx<(int)NUMDECOMPRESSORS; idx++) {
+	decompressorptr = decompressortbl+idx;
+	if (magiclen >= decompressorptr->magiclen &&
+		!memcmp(magic, decompressorptr->magic, decompressorptr->magiclen)) {
+	    break;
+	}
+    }
+    if (idx == (int)NUMDECOMPRESSORS) {
+	return;
+    }
+
+    pthread_mutex_lock(&forkmutex);
+    if (pipe(pipefdtbl) != 0 || fcntl(pipefdtbl[0], F_SETFD, FD_CLOEXEC) != 0 ||
+				fcntl(pipefdtbl[1], F_SETFD, FD_CLOEXEC) != 0) {
+	err_exit("Could not create a pipe for input file '%s', aborting!", ifp->filename);
+    }
+    if ((ifp->decompressorpid=fork()) < 0) {
+	err_exit("Could not fork %s for input file '%s', aborting!",
+				decompressorptr->argvtbl[0], ifp->filename);
+    } else if (ifp->decompressorpid == 0) {
+	if (ifp->peeklen > 0) {
+	    feed_decompressor(ifp, pipefdtbl);
+	}
+	if (dup2(ifp->fd, STDIN_FILENO) >= 0 && dup2(pipefdtbl[1], STDOUT_FILENO) >= 0) {
+	    execvp(decompressorptr->argvtbl[0], decompressorptr->argvtbl);
+	}
+	if (write(STDERR_FILENO, "E: Could not run ", 17) > 0 &&	/* (no stdio) */
+		    write(STDERR_FILENO, decompressorptr->argvtbl[0],
+				    strlen(decompressorptr->argvtbl[0])) > 0) {
+	    write(STDERR_FILENO, "\n", 1);
+	}
+	_exit(127);
+    }
+    pthread_mutex_unlock(&forkmutex);
+
+    close(pipefdtbl[1]);
+    close(ifp->fd);
+    ifp->fd = pipefdtbl[0];
+    ifp->peeklen = 0;			/* (they are the decompressor's) */
+    ifp->decompressorname = decompressorptr->argvtbl[0];
+    if (verbosity > 1) {
+	fprintf(stderr, "i: Reading input file '%s' through %s\n", ifp->filename,
+								ifp->decompressorname);
+    }
+#ifdef F_SETPIPE_SZ
+    fcntl(ifp->fd, F_SETPIPE_SZ, DECOMPPIPESIZE);
+#endif
+}
+
+
+/*******************************************************************************
+Open an input file (or stdin). Regular files are mmap'ed in their entirety, so
+reading them never copies any data. stdin, pipes (and any file that can't be
+mapped) are read into a (large) buffer that grows when a line doesn't fit.
+Returns NULL if the file can't be opened.
+*******************************************************************************/
+Inputfile* open_inputfile(char *inputfilename) {
+    Inputfile	*ifp;
+    struct stat	statbuf;
+    void	*mapptr;
+
+    if ((ifp=calloc(1, sizeof(Inputfile))) == NULL) {
+	err_exit("open_inputfile: calloc for '%s' failed, aborting!", inputfilename);
+    }
+    ifp->filename = inputfilename;
+
+    if (!strcmp(inputfilename, STDINFILENAME)) {
+	ifp->fd = STDIN_FILENO;
+    } else if ((ifp->fd=open(inputfilename, O_RDONLY)) < 0) {
+	free(ifp);
+	return NULL;
+    }
+    start_decompressor(ifp);
+
+    if (!followflag && fstat(ifp->fd, &statbuf) == 0 &&
+		    (statbuf.st_mode&S_IFMT) == S_IFREG && statbuf.st_size > 0) {
+	mapptr = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, ifp->fd, 0);
+	if (mapptr != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+	    madvise(mapptr, statbuf.st_size, MADV_SEQUENTIAL);
+#endif
+	    ifp->mappedflag = 1;
+	    ifp->eofflag    = 1;
+	    ifp->bufptr     = (char*)mapptr;
+	    ifp->bufsize    = statbuf.st_size;
+	    ifp->curptr     = ifp->bufptr;
+	    ifp->endptr     = ifp->bufptr+ifp->bufsize;
+	    return ifp;
+	}
+    }
+
+    ifp->bufsize = INPUTBUFSIZE;
+    if ((ifp->bufptr=malloc(ifp->bufsize)) == NULL) {
+	err_exit("open_inputfile: buffer malloc for '%s' failed, aborting!", inputfilename);
+    }
+    memcpy(ifp->bufptr, ifp->peektbl, ifp->peeklen);	/* (the magic number check's) */
+    ifp->curptr = ifp->bufptr;
+    ifp->endptr = ifp->bufptr+ifp->peeklen;
+    return ifp;
+}
+
+
+/*******************************************************************************
+Unmap (or free the buffer of) and close an input file. The decompressor (if
+any) is waited for: it failed if it exited with an error, or was killed before
+all of its output was read. (An input file closed early kills it with SIGPIPE.)
+*******************************************************************************/
+void close_inputfile(Inputfile *ifp) {
+    int		status;
+
+    if (ifp->segmentflag) {
+	free(ifp->argtbl);
+	free(ifp);
+	return;
+    }
+    if (ifp->mappedflag) {
+	munmap(ifp->bufptr, ifp->bufsize);
+    } else {
+	free(ifp->bufptr);
+    }
+    if (ifp->fd != STDIN_FILENO) {
+	close(ifp->fd);
+    }
+    if (ifp->decompressorpid > 0) {
+	while (waitpid(ifp->decompressorpid, &status, 0) < 0 && errno == EINTR) {
+	}
+	if ((WIFEXITED(status) && WEXITSTATUS(status) != 0) ||
+				    (WIFSIGNALED(status) && ifp->eofflag)) {
+	    fprintf(stderr, "E: Could not decompress input file '%s' (%s failed)\n",
+					    ifp->filename, ifp->decompressorname);
+	}
+    }
+    free(ifp->argtbl);
+    free(ifp);
+}
+
+
+/*******************************************************************************
+Return a segment of an mmap'ed input file: an Inputfile that reads (starting at
+line linectr) the lines from startptr up to endptr of the file's mapping. So the
+segments of a large input file can be parsed by several threads at once. Closing
+a segment does not unmap (or close) the input file.
+*******************************************************************************/
+Inputfile* open_input_segment(Inputfile *fileifp, char *startptr, char *endptr,
+							    unsigned linectr) {
+    Inputfile	*ifp;
+    size_t	pagesize = sysconf(_SC_PAGESIZE);
+
+    if ((ifp=malloc(sizeof(Inputfile))) == NULL) {
+	err_exit("open_input_segment: malloc for '%s' failed, aborting!", fileifp->filename);
+    }
+    *ifp = *fileifp;
+    ifp->segmentflag  = 1;
+    ifp->curptr       = startptr;
+    ifp->endptr       = endptr;
+    ifp->linectr      = linectr;
+    ifp->releasedsize = (startptr-ifp->bufptr)/pagesize*pagesize;
+    ifp->argtbl       = NULL;
+    ifp->maxargs      = 0;
+    return ifp;
+}
+
+
+/*******************************************************************************
+Move the unread data to the start of the read buffer (doubling the size of the
+buffer if it's already full of unread data), then read as much as will fit.
+Returns the number of bytes read - 0 at EOF (and always for mmap'ed files).
+*******************************************************************************/
+size_t fill_input_buffer(Inputfile *ifp) {
+    size_t	unreadsize;
+    ssize_t	numread;
+
+    if (ifp->eofflag) {
+	return 0;
+    }
+
+    unreadsize = ifp->endptr - ifp->curptr;
+    ifp->bufoffset += ifp->curptr - ifp->bufptr;
+    if (ifp->curptr != ifp->bufptr) {
+	memmove(ifp->bufptr, ifp->curptr, unreadsize);
+    } else if (unreadsize == ifp->bufsize) {
+	ifp->bufsize *= 2;
+	if ((ifp->bufptr=realloc(ifp->bufptr, ifp->bufsize)) == NULL) {
+	    err_exit("fill_input_buffer: realloc for '%s' failed, aborting!", ifp->filename);
+	}
+    }
+    ifp->curptr = ifp->bufptr;
+    ifp->endptr = ifp->bufptr+unreadsize;
+
+    while ((numread=read(ifp->fd, ifp->endptr, ifp->bufsize-unreadsize)) < 0) {
+	if (errno != EINTR) {
+	    err_exit("Could not read input file '%s', aborting!", ifp->filename);
+	}
+    }
+    if (numread == 0) {
+	ifp->eofflag = 1;
+    }
+    ifp->endptr += numread;
+    return numread;
+}
+
+
+/*******************************************************************************
+Return the input file offset of the next character to be read, and move to
+(resume reading at line linectr at) offset. seek_inputfile returns 0 if offset
+is past the end of the file, or the file is not seekable (e.g., a pipe). (A
+decompressor's output is read, and discarded, up to a later offset.)
+*******************************************************************************/
+off_t inputfile_offset(Inputfile *ifp) {
+    return ifp->bufoffset + (ifp->curptr-ifp->bufptr);
+}
+
+int seek_inputfile(Inputfile *ifp, off_t offset, unsigned linectr) {
+    struct stat	statbuf;
+
+    if (ifp->mappedflag) {
+	if (offset > (off_t)ifp->bufsize) {
+	    return 0;
+	}
+	ifp->curptr = ifp->bufptr+offset;
+    } else if (ifp->decompressorpid > 0) {	/* can only read forward, to offset */
+	if (offset < inputfile_offset(ifp)) {
+	    return 0;
+	}
+	while (offset > ifp->bufoffset+(ifp->endptr-ifp->bufptr)) {
+	    ifp->curptr = ifp->endptr;
+	    if (fill_input_buffer(ifp) == 0) {
+		return 0;
+	    }
+	}
+	ifp->curptr = ifp->bufptr+(offset-ifp->bufoffset);
+    } else {
+	if (fstat(ifp->fd, &statbuf) != 0 || (statbuf.st_mode&S_IFMT) != S_IFREG ||
+		offset > statbuf.st_size || lseek(ifp->fd, offset, SEEK_SET) != offset) {
+	    return 0;
+	}
+	ifp->bufoffset = offset;
+	ifp->curptr    = ifp->endptr = ifp->bufptr;
+	ifp->eofflag   = 0;
+    }
+    ifp->linectr = linectr;
+    return 1;
+}
+
+
+/*******************************************************************************
+Return a pointer to the next line of the input file (NULL at EOF) and set
+*lineendptrptr to point just past the last character of the line (at the newline
+character). Lines are NOT copied or null terminated, and a line is only valid
+until the next call (lines of mmap'ed files always remain valid).
+*******************************************************************************/
+char* get_input_line(Inputfile *ifp, char **lineendptrptr) {
+    char	*lineptr, *newlineptr;
+    size_t	searchoffset = 0;
+
+    while (ifp->curptr+searchoffset == ifp->endptr || (newlineptr=memchr(
+	    ifp->curptr+searchoffset, '\n', ifp->endptr-ifp->curptr-searchoffset)) == NULL) {
+	searchoffset = ifp->endptr - ifp->curptr;
+	if (fill_input_buffer(ifp) == 0) {
+	    if (ifp->curptr == ifp->endptr) {
+		return NULL;
+	    }
+	    newlineptr = ifp->endptr;		/* the last line has no newline */
+	    break;
+	}
+    }
+
+    lineptr = ifp->curptr;
+    *lineendptrptr = newlineptr;
+    ifp->curptr = newlineptr < ifp->endptr ? newlineptr+1 : newlineptr;
+    ifp->linectr++;
+    return lineptr;
+}
+
+
+/*******************************************************************************
+Return an input file's Token table, grown (if necessary) to hold (at least)
+maxargs Tokens. Each input file has its own, so the parsing threads don't share
+them, and the data stanza readers get one just big enough for their class' data
+lines (plus one, to detect lines with too many arguments) once per stanza.
+*******************************************************************************/
+Token* input_args(Inputfile *ifp, int maxargs) {
+    if (maxargs > ifp->maxargs) {
+	ifp->maxargs = MAX(maxargs, MAX(MINNUMARGS, 2*ifp->maxargs));
+	if ((ifp->argtbl=realloc(ifp->argtbl, ifp->maxargs*sizeof(Token))) == NULL) {
+	    err_exit("input_args: Token table realloc for '%s' failed, aborting!",
+								ifp->filename);
+	}
+    }
+    return ifp->argtbl;
+}
+
+
+/*******************************************************************************
+Parse up to a maximum of maxarg arguments of the line from lineptr up to (but
+not including) lineendptr. argtbl is poplulated with the (pointer, length)
+Tokens of the arguments. The line is NOT modified.
 *******************************************************************************/
-int parse_input_line(char *inputline, char *argtbl[], int maxargs) {
+int parse_input_line(char *lineptr, char *lineendptr, Token argtbl[], int maxargs) {
+    char	*tokenptr;
     int		argidx;
     int		inquoteflag = 0;
 
-    for (argidx=0; argidx<maxargs; argidx++) {	/* set all pointers to NULL */
-	argtbl[argidx] = NULL;
+    for (argidx=0; argidx<maxargs; argidx++) {	/* set all tokens to empty */
+	argtbl[argidx].ptr = NULL;
+	argtbl[argidx].len = 0;
     }
     argidx = 0;
-    while(WHITESPACE(*inputline)) {
-	inputline++;
+    while (lineptr < lineendptr && WHITESPACE(*lineptr)) {
+	lineptr++;
     }
-    while (*inputline) {
-	if (*inputline == COMMENTCHAR) {
+    while (lineptr < lineendptr) {
+	if (*lineptr == COMMENTCHAR) {
 	    break;
 	}
-	if (*inputline == QUOTECHAR) {
+	if (*lineptr == QUOTECHAR) {
 	    inquoteflag = 1;
-	    inputline++;
+	    lineptr++;
 	} else {
 	    inquoteflag = 0;
 	}
 	if (argidx < maxargs) {
-	    argtbl[argidx++] = inputline++;
+	    tokenptr = lineptr;
+	    if (lineptr < lineendptr) {
+		lineptr++;
+	    }
 	} else {
 	    break;
 	}
-	while (*inputline && (!WHITESPACE(*inputline) || inquoteflag)) {
-	    if (*inputline == QUOTECHAR && inquoteflag) {
+	while (lineptr < lineendptr && (!WHITESPACE(*lineptr) || inquoteflag)) {
+	    if (*lineptr == QUOTECHAR && inquoteflag) {
 		break;
 	    }
-	    inputline++;
+	    lineptr++;
 	}
-	if (*inputline) {
-	    *inputline++ = '\0';
-	    while (WHITESPACE(*inputline)) {
-		inputline++;
+	argtbl[argidx].ptr   = tokenptr;
+	argtbl[argidx++].len = lineptr-tokenptr;
+	if (lineptr < lineendptr) {
+	    lineptr++;
+	    while (lineptr < lineendptr && WHITESPACE(*lineptr)) {
+		lineptr++;
 	    }
 	}
     }
@@ -288,16 +1056,184 @@ int parse_input_line(char *inputline, char *argtbl[], int maxargs) {
 
 
 /*******************************************************************************
-Read the contents of the inputfile until the stanza header of the required type
-is reached (reading and ignoring all lines up to that point).
+Token helpers: compare a token with a string, copy a token into a (null
+terminated) string of at most maxlen characters, and convert a token to a
+number. (Tokens are not null terminated, so they can't be passed to atof, etc.)
+token_to_value returns whether the whole token is a number. Its '.' is replaced
+by the locale's decimal point character for strtod, so numbers always use '.'.
+*******************************************************************************/
+int token_equals(Token *tokenptr, char *str) {
+    return (int)strlen(str) == tokenptr->len && !memcmp(tokenptr->ptr, str, tokenptr->len);
+}
+
+char* token_copy(char *str, Token *tokenptr, int maxlen) {
+    int		len = MIN(tokenptr->len, maxlen);
+
+    memcpy(str, tokenptr->ptr, len);
+    str[len] = '\0';
+    return str;
+}
+
+char* token_strdup(Token *tokenptr) {
+    char	*str;
+
+    if ((str=malloc(tokenptr->len+1)) == NULL) {
+	err_exit("token_strdup: malloc failed, aborting!");
+    }
+    return token_copy(str, tokenptr, tokenptr->len);
+}
+
+int token_to_value(Token *tokenptr, double *valueptr) {
+    char	numstr[MAXNUMSTRLEN+1], *pointptr, *endptr;
+
+    token_copy(numstr, tokenptr, MAXNUMSTRLEN);
+    if (decimalpointchar != '.' && (pointptr=strchr(numstr, '.')) != NULL) {
+	*pointptr = decimalpointchar;
+    }
+    *valueptr = strtod(numstr, &endptr);
+    return endptr != numstr && *endptr == '\0' && tokenptr->len <= MAXNUMSTRLEN;
+}
+
+long token_to_long(Token *tokenptr) {
+    char	numstr[MAXNUMSTRLEN+1];
+
+    return atol(token_copy(numstr, tokenptr, MAXNUMSTRLEN));
+}
+
+
+/*******************************************************************************
+Convert the plain decimal number (e.g., 12, -0.5, 1.25e3) at numptr - an argument
+of a line that ends at endptr - to *valueptr, and return a pointer to the end of
+the argument (the whitespace after it, or endptr). So the argument is scanned
+just once, as it is converted. Returns NULL if it isn't one, or has too many
+digits (or too big an exponent) to be converted exactly here: m*10^e and m/10^e
+are correctly rounded when m <= 2^53 and 10^e <= 10^22 are both exact doubles.
+Unlike atof, this does not depend on the locale.
+*******************************************************************************/
+char* scan_decimal(char *numptr, char *endptr, double *valueptr) {
+    static const double	power10tbl[MAXFASTPOWER10+1] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    unsigned long long	mantissa = 0;
+    double		value;
+    int			negativeflag = 0, expnegativeflag = 0;
+    int			numdigits = 0, numsigdigits = 0, exponent = 0, expvalue = 0;
+
+    if (numptr < endptr && (*numptr == '-' || *numptr == '+')) {
+	negativeflag = *numptr++ == '-';
+    }
+    for (; numptr < endptr && *numptr >= '0' && *numptr <= '9'; numptr++, numdigits++) {
+	if (mantissa != 0 || *numptr != '0') {
+	    if (++numsigdigits > MAXFASTDIGITS) {
+		return NULL;
+	    }
+	    mantissa = mantissa*10 + (*numptr-'0');
+	}
+    }
+    if (numptr < endptr && *numptr == '.') {
+	for (numptr++; numptr < endptr && *numptr >= '0' && *numptr <= '9';
+						    numptr++, numdigits++) {
+	    if (mantissa != 0 || *numptr != '0') {
+		if (++numsigdigits > MAXFASTDIGITS) {
+		    return NULL;
+		}
+		mantissa = mantissa*10 + (*numptr-'0');
+	    }
+	    exponent--;
+	}
+    }
+    if (numdigits == 0) {
+	return NULL;
+    }
+    if (numptr < endptr && (*numptr == 'e' || *numptr == 'E')) {
+	if (++numptr < endptr && (*numptr == '-' || *numptr == '+')) {
+	    expnegativeflag = *numptr++ == '-';
+	}
+	if (numptr == endptr) {
+	    return NULL;
+	}
+	for (; numptr < endptr && *numptr >= '0' && *numptr <= '9'; numptr++) {
+	    if ((expvalue = expvalue*10 + (*numptr-'0')) > 2*MAXFASTPOWER10) {
+		return NULL;
+	    }
+	}
+	exponent += expnegativeflag ? -expvalue : expvalue;
+    }
+    if ((numptr < endptr && !WHITESPACE(*numptr)) || mantissa > (1ULL<<53) ||
+			    exponent < -MAXFASTPOWER10 || exponent > MAXFASTPOWER10) {
+	return NULL;
+    }
+    value = (double)mantissa;
+    value = exponent < 0 ? value/power10tbl[-exponent] : value*power10tbl[exponent];
+    *valueptr = negativeflag ? -value : value;
+    return numptr;
+}
+
+
+/*******************************************************************************
+Parse (like parse_input_line) and convert a data stanza line in one pass: up to
+numvalues arguments from firstvalueidx onwards (e.g., after an array class
+device name) are converted to valuetbl as they are found - to the index in
+fieldmetrictbl, if it isn't NULL (and not at all if that's -1, for the fields
+of the metrics --include/--exclude left out). *firsttokenptr is set
+to the first argument. Returns the number of arguments (at most maxargs), or -1
+if the line must be parsed by parse_input_line instead, i.e., it has a quoted
+argument or a comment, or a value that scan_decimal can't convert.
 *******************************************************************************/
-void skip_to_stanza(char *stanza, char *inputline, int mandatoryflag) {
-    int foundflag = 0;
+int parse_data_line(char *lineptr, char *lineendptr, Token *firsttokenptr,
+		    int firstvalueidx, double valuetbl[], int numvalues, int maxargs,
+		    const int fieldmetrictbl[]) {
+    char	*tokenptr;
+    int		argidx = 0, fieldidx, validx;
+
+    firsttokenptr->ptr = NULL;
+    firsttokenptr->len = 0;
+    while (argidx < maxargs) {
+	while (lineptr < lineendptr && WHITESPACE(*lineptr)) {
+	    lineptr++;
+	}
+	if (lineptr == lineendptr) {
+	    break;
+	}
+	if (*lineptr == QUOTECHAR || *lineptr == COMMENTCHAR) {
+	    return -1;
+	}
+	tokenptr = lineptr;
+	fieldidx = argidx-firstvalueidx;
+	validx   = fieldidx < 0 || fieldidx >= numvalues ? -1 :
+			    fieldmetrictbl == NULL ? fieldidx : fieldmetrictbl[fieldidx];
+	if (validx >= 0) {
+	    if ((lineptr=scan_decimal(tokenptr, lineendptr, valuetbl+validx)) == NULL) {
+		return -1;
+	    }
+	} else {
+	    while (lineptr < lineendptr && !WHITESPACE(*lineptr)) {
+		lineptr++;
+	    }
+	}
+	if (argidx == 0) {
+	    firsttokenptr->ptr = tokenptr;
+	    firsttokenptr->len = lineptr-tokenptr;
+	}
+	argidx++;
+    }
+    return argidx;
+}
+
 
-    while (fgets(inputline, MAXINPUTLINELEN, inputfileptr)) {
-	inputlinectr++;
-	inputline[strlen(inputline)-1] = '\0';
-	if (!strcmp(inputline, stanza)) {
+/*******************************************************************************
+Read the lines of the inputfile until the stanza header of the required type is
+reached (reading and ignoring all lines up to that point).
+*******************************************************************************/
+void skip_to_stanza(Inputfile *ifp, char *stanza, int mandatoryflag) {
+    char	*lineptr, *lineendptr;
+    int		stanzalen = strlen(stanza);
+    int		foundflag = 0;
+
+    while ((lineptr=get_input_line(ifp, &lineendptr)) != NULL) {
+	if (lineendptr-lineptr == stanzalen && *lineptr == *stanza &&
+					    !memcmp(lineptr, stanza, stanzalen)) {
 	    foundflag = 1;
 	    break;
 	}
@@ -356,24 +1292,46 @@ void initialize_parameters() {
 
 
 /*******************************************************************************
-Skip to the time values stanza and extract the count and iterations values.
+Skip to the time values stanza and extract the count and iterations values. If
+hostnameptr isn't NULL, *hostnameptr is set to (a copy of) the host name in the
+comment pmc writes after them (h=hostname), or NULL if there isn't one.
 *******************************************************************************/
-void initialize_time_values() {
-    char	inputline[MAXINPUTLINELEN], *argtbl[NUMTIMEVALUES];
+void initialize_time_values(Inputfile *ifp, char **hostnameptr) {
+    char	*lineptr, *lineendptr, *ptr;
+    Token	argtbl[NUMTIMEVALUES];
+    Token	hostnametoken;
     int		numargs;
+    int		keylen = strlen(HOSTNAMEKEY);
 
-    skip_to_stanza(TIMEVALUES, inputline, 1);
+    if (hostnameptr != NULL) {
+	*hostnameptr = NULL;
+    }
 
-    while (fgets(inputline, MAXINPUTLINELEN, inputfileptr)) {
-	inputlinectr++;
-	if ((numargs=parse_input_line(inputline, argtbl, NUMTIMEVALUES)) == NUMTIMEVALUES) {
-	    count    = atoi(argtbl[COUNTIDX]);
-	    interval = atoi(argtbl[INTERVALIDX]);
+    skip_to_stanza(ifp, TIMEVALUES, 1);
+
+    while ((lineptr=get_input_line(ifp, &lineendptr)) != NULL) {
+	if ((numargs=parse_input_line(lineptr, lineendptr, argtbl, NUMTIMEVALUES)) ==
+								    NUMTIMEVALUES) {
+	    count    = token_to_long(argtbl+COUNTIDX);
+	    interval = token_to_long(argtbl+INTERVALIDX);
+	    ptr = memchr(lineptr, COMMENTCHAR, lineendptr-lineptr);
+	    for (; hostnameptr != NULL && ptr != NULL && ptr+keylen < lineendptr; ptr++) {
+		if ((WHITESPACE(ptr[-1]) || ptr[-1] == COMMENTCHAR) &&
+					!memcmp(ptr, HOSTNAMEKEY, keylen)) {
+		    hostnametoken.ptr = ptr+keylen;
+		    for (ptr+=keylen; ptr < lineendptr && !WHITESPACE(*ptr); ptr++) {
+			;
+		    }
+		    hostnametoken.len = ptr-hostnametoken.ptr;
+		    *hostnameptr = token_strdup(&hostnametoken);
+		    break;
+		}
+	    }
 	} else if (numargs == 0) {
 	    break;
 	} else {
-	    fprintf(stderr, "Bad time values at line %d starting '%s', aborting!\n",
-							    inputlinectr, argtbl[0]);
+	    fprintf(stderr, "Bad time values at line %d starting '%.*s', aborting!\n",
+				ifp->linectr, argtbl[0].len, argtbl[0].ptr);
 	    exit(1);
 	}
     }
@@ -381,830 +1339,4649 @@ void initialize_time_values() {
 
 
 /*******************************************************************************
-Skip to the METADATA stanza. For each class, dynamically allocate it's space
-in table classtbl (as it grows) and populate it's data (name, type, start row).
-Also dynamically allocate the space for each class' metrics (metrictbl), and
-populate/initialize the metric's data (name, number, max, sum, numdevices,
-devicetbl).
+Return the (FNV-1a) hash of the len characters of name.
 *******************************************************************************/
-void initialize_metadata() {
-    char	inputline[MAXINPUTLINELEN], *argtbl[MAXNUMMETADATA];
-    Class	*classptr;
-    Metric	*metricptr;
-    int		numargs, startrow, metricidx;
-    int		classidx = 0;
-
-    skip_to_stanza(METADATASTR, inputline, 1);
-
-    /* Loop through the classes */
-    while (fgets(inputline, MAXINPUTLINELEN, inputfileptr)) {
-	inputlinectr++;
-	if ((numargs=parse_input_line(inputline, argtbl, MAXNUMMETADATA)) >= NUMMETAITEMS+1) {
-
-	    if (*argtbl[CLASSTYPEIDX] != VECTORCLASS && *argtbl[CLASSTYPEIDX] !=
-									ARRAYCLASS) {
-		fprintf(stderr,
-		"Class '%s': bad type '%c': must be '%c' or '%c', aborting!\n",
-			    argtbl[0], *argtbl[CLASSTYPEIDX], VECTORCLASS, ARRAYCLASS);
-		exit(1);
-	    }
-
-	    startrow = atoi(argtbl[STARTROWIDX]);
-	    if (startrow < 1 || startrow > count) {
-		fprintf(stderr,
-		"Class '%s': bad start row '%d': must be 1 to %d, aborting!\n",
-							argtbl[0], startrow, count-1);
-		exit(1);
-	    }
+unsigned hash_name(const char *name, int len) {
+    unsigned	hash = 2166136261u;
 
-	    if (classtbl == NULL) {
-		if ((classtbl=calloc(1, sizeof(Class))) == NULL) {
-		    err_exit("initialize_metadata: class calloc failed, aborting!");
-		}
-	    } else {
-		if ((classtbl=realloc(classtbl, (classidx+1)*sizeof(Class))) == NULL) {
-		    err_exit("initialize_metadata: class realloc failed, aborting!");
-		}
-	    }
+    while (len-- > 0) {
+	hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+    return hash;
+}
 
-	    classptr = classtbl+classidx;
-	    strncpy(classptr->classname, argtbl[CLASSSTRIDX], MAXCLSNAMELEN);
-	    classptr->classtype = *argtbl[CLASSTYPEIDX];
-	    classptr->startrow = startrow-1;
 
-	    if ((classptr->metrictbl=calloc(numargs-NUMMETAITEMS, sizeof(Metric))) == NULL) {
-		err_exit("initialize_metadata: metric calloc for class '%s' failed, aborting!",
-									classptr->classname);
-	    }
+/*******************************************************************************
+Return the index saved (by add_name) for the len characters of name, or -1 if
+that name is not in the name index. find_name_index returns a pointer to the
+saved index (so that it may be changed), or NULL.
+*******************************************************************************/
+int* find_name_index(Nameindex *nameindexptr, const char *name, int len) {
+    unsigned	slot;
+    char	*slotname;
 
-	    for (metricidx=0; metricidx<numargs-NUMMETAITEMS; metricidx++) {
-		metricptr = classptr->metrictbl+metricidx;
-	    	strncpy(metricptr->metricname, argtbl[metricidx+NUMMETAITEMS], MAXMETNAMELEN);
-		metricptr->number	= 0;
-		metricptr->max		= 0;
-		metricptr->sum		= 0;
-		metricptr->numdevices   = 0;
-		metricptr->devicetbl    = NULL;
-	    }
-	    classptr->nummetrics = numargs-NUMMETAITEMS;
-	    classidx += 1;
-	} else if (numargs == 0) {
-	    break;
-	} else {
-	    fprintf(stderr, "Bad class '%s' metadata at line %d\n", argtbl[0], inputlinectr);
+    if (nameindexptr->size == 0) {
+	return NULL;
+    }
+    slot = hash_name(name, len) & (nameindexptr->size-1);
+    while ((slotname=nameindexptr->nametbl[slot]) != NULL) {
+	if (!strncmp(slotname, name, len) && slotname[len] == '\0') {
+	    return nameindexptr->indextbl+slot;
 	}
+	slot = (slot+1) & (nameindexptr->size-1);
     }
-    numclasses = classidx;
+    return NULL;
 }
 
+int find_name(Nameindex *nameindexptr, const char *name, int len) {
+    int		*indexptr = find_name_index(nameindexptr, name, len);
 
-/*******************************************************************************
-Read to the first DATA stanza, extract the UTC time, and store that in the
-global variable firsttimestamp. If the TZ parameter has been set in the config
-file, (attempt to) set the environment variable TZ to that value.
-*******************************************************************************/
-void initialize_timestamp() {
-    char	inputline[MAXINPUTLINELEN], *argtbl[NUMDATEARGS];
-    int		numargs;
-    int		firsttimesetctr = 0;
-
-    skip_to_stanza(DATESTR, inputline, 1);
+    return indexptr != NULL ? *indexptr : -1;
+}
 
-    while (fgets(inputline, MAXINPUTLINELEN, inputfileptr)) {
-	inputlinectr++;
 
-	if ((numargs=parse_input_line(inputline, argtbl, NUMDATEARGS)) == NUMDATEARGS) {
-	    firsttimestamp = atol(argtbl[TIMESTAMPIDX]);
-	    firsttimesetctr++;
-	} else if (numargs == 0) {
-	    break;
-	} else {
-	    fprintf(stderr, "initialize_timestamp: date error at line %d (%s)\n",
-							    inputlinectr, inputline);
+/*******************************************************************************
+Save (a copy of) the len characters of name, and its index, in the name index.
+The index is doubled in size whenever it becomes half full. Returns the copy.
+*******************************************************************************/
+char* add_name(Nameindex *nameindexptr, const char *name, int len, int index) {
+    Nameindex	oldnameindex;
+    unsigned	slot;
+    int		oldslot;
+
+    if (2*(nameindexptr->numnames+1) > nameindexptr->size) {
+	oldnameindex = *nameindexptr;
+	nameindexptr->size = MAX(MINNAMEINDEXSIZE, 2*oldnameindex.size);
+	if ((nameindexptr->nametbl=calloc(nameindexptr->size, sizeof(char*))) == NULL ||
+	    (nameindexptr->indextbl=calloc(nameindexptr->size, sizeof(int))) == NULL) {
+	    err_exit("add_name: name index calloc failed, aborting!");
+	}
+	for (oldslot=0; oldslot<oldnameindex.size; oldslot++) {
+	    if (oldnameindex.nametbl[oldslot] != NULL) {
+		slot = hash_name(oldnameindex.nametbl[oldslot],
+		    strlen(oldnameindex.nametbl[oldslot])) & (nameindexptr->size-1);
+		while (nameindexptr->nametbl[slot] != NULL) {
+		    slot = (slot+1) & (nameindexptr->size-1);
+		}
+		nameindexptr->nametbl[slot]  = oldnameindex.nametbl[oldslot];
+		nameindexptr->indextbl[slot] = oldnameindex.indextbl[oldslot];
+	    }
 	}
+	free(oldnameindex.nametbl);
+	free(oldnameindex.indextbl);
     }
 
-    if (firsttimesetctr != 1) {
-	fprintf(stderr,
-	    "firsttimestamp was set %d times at/near line %d; must be 1, aborting!\n",
-							firsttimesetctr, inputlinectr);
-	exit(1);
+    slot = hash_name(name, len) & (nameindexptr->size-1);
+    while (nameindexptr->nametbl[slot] != NULL) {
+	slot = (slot+1) & (nameindexptr->size-1);
+    }
+    if ((nameindexptr->nametbl[slot]=malloc(len+1)) == NULL) {
+	err_exit("add_name: name malloc failed, aborting!");
     }
+    memcpy(nameindexptr->nametbl[slot], name, len);
+    nameindexptr->nametbl[slot][len] = '\0';
+    nameindexptr->indextbl[slot] = index;
+    nameindexptr->numnames++;
+    return nameindexptr->nametbl[slot];
 }
 
 
 /*******************************************************************************
 Classes have metric(s) and metrics have device(s). Metric(s) of (single-row)
 "vector" classes (which actually have no devices), store the data for that
-metric in devicetbl[0].  add_device is called by initialize_classes to allocate
-the space for devicetbl, save the device name and initialize (zero) the
-numerical values.
+metric in devicetbl[0].  add_device is called by initialize_metadata (vector
+classes) and store_array_stanza (the first time each device is seen) to add a
+device to every metric of a class: (if required) grow each metric's devicetbl
+(doubling its size), save the device name and initialize (zero) the numerical
+values. The (len characters of the) device name is added to the class' device
+name index, and that copy is shared by the device's entries in every metric.
+Returns the index of the new device.
+
+The data values of all of a class' devices are in one (row major) table: a row
+holds every metric's devices' values, so the single file row loop reads them in
+order. When the class' table is full, grow_class_values copies it to one twice
+as wide. (The new devices' values are zero.)
 *******************************************************************************/
-void add_device(Metric *metricptr, char *devicename) {
-    Device	*deviceptr;
-    int		deviceidx, numdevices;
-    int		newdeviceflag = 1;
-
-    numdevices = metricptr->numdevices;
-    for (deviceidx=0; deviceidx<numdevices; deviceidx++) {
-	deviceptr = metricptr->devicetbl+deviceidx;
-	if (!strncmp(devicename, deviceptr->devicename, MAXDEVNAMELEN)) { 
-	    newdeviceflag = 0;
-	}
+void grow_class_buckets(Class *classptr, int maxdevices);	/* (below add_device) */
+
+void grow_class_values(Class *classptr) {
+    double	*valuetbl;
+    char	*sampleflagtbl;
+    int		maxdevices, rowidx, metricidx;
+
+    maxdevices = classptr->maxdevices == 0 ?
+	    (classptr->classtype == VECTORCLASS ? 1 : MINNUMDEVICES) : 2*classptr->maxdevices;
+    if ((valuetbl=calloc((size_t)count*classptr->nummetrics*maxdevices,
+							sizeof(double))) == NULL) {
+	err_exit("grow_class_values: value calloc for class '%s' failed, aborting!",
+								classptr->classname);
     }
+    for (rowidx=0; classptr->valuetbl!=NULL && rowidx<count; rowidx++) {
+	for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	    memcpy(valuetbl+((size_t)rowidx*classptr->nummetrics+metricidx)*maxdevices,
+			VALUEPTR(classptr, rowidx, metricidx, 0),
+			classptr->maxdevices*sizeof(double));
+	}
+    }
+    if ((sampleflagtbl=calloc((size_t)count*maxdevices, sizeof(char))) == NULL) {
+	err_exit("grow_class_values: flag calloc for class '%s' failed, aborting!",
+								classptr->classname);
+    }
+    for (rowidx=0; classptr->sampleflagtbl!=NULL && rowidx<count; rowidx++) {
+	memcpy(sampleflagtbl+(size_t)rowidx*maxdevices, SAMPLEFLAGPTR(classptr, rowidx, 0),
+							    classptr->maxdevices);
+    }
+    if (bucketsecs > 0) {
+	grow_class_buckets(classptr, maxdevices);
+    }
+    free(classptr->valuetbl);
+    free(classptr->sampleflagtbl);
+    classptr->valuetbl	    = valuetbl;
+    classptr->sampleflagtbl = sampleflagtbl;
+    classptr->maxdevices    = maxdevices;
+}
 
-    if (newdeviceflag) {
-	if (metricptr->devicetbl == NULL) {
-	    if ((metricptr->devicetbl=calloc(1, sizeof(Device))) == NULL) {
-		err_exit("add_device: device calloc for metric '%s' failed, aborting!",
-								metricptr->metricname);
-	    }
-	} else {
+int add_device(Class *classptr, const char *devicename, int len) {
+    Metric	*metricptr;
+    Device	*deviceptr;
+    char	*namecopy;
+    int		metricidx;
+    int		deviceidx = classptr->metrictbl->numdevices;
+
+    if (deviceidx == classptr->maxdevices) {
+	grow_class_values(classptr);
+    }
+    namecopy = add_name(&classptr->deviceindex, devicename, len, deviceidx);
+    for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	metricptr = classptr->metrictbl+metricidx;
+	if (metricptr->numdevices == metricptr->maxdevices) {
+	    metricptr->maxdevices = MAX(MINNUMDEVICES, 2*metricptr->maxdevices);
 	    if ((metricptr->devicetbl=realloc(metricptr->devicetbl,
-				    (deviceidx+1)*sizeof(Device))) == NULL) {
+				    metricptr->maxdevices*sizeof(Device))) == NULL) {
 		err_exit("add_device: device realloc for metric '%s' failed, aborting!",
 								metricptr->metricname);
 	    }
 	}
 
-	deviceptr = metricptr->devicetbl+deviceidx;
-	strncpy(deviceptr->devicename, devicename, MAXDEVNAMELEN);
-	deviceptr->number = 0;
-	deviceptr->max	  = 0;
-	deviceptr->sum	  = 0;
-	deviceptr->scale  = 0;
-	if ((deviceptr->valuetbl=(double*)calloc(count, sizeof(double))) == NULL) {
-	    err_exit("add_device: value calloc for metric '%s' failed, aborting!",
-								metricptr->metricname);
+	deviceptr = metricptr->devicetbl+deviceidx;
+	deviceptr->devicename	  = namecopy;
+	deviceptr->number	  = 0;
+	deviceptr->min		  = 0;
+	deviceptr->max		  = 0;
+	deviceptr->sum		  = 0;
+	deviceptr->mean		  = 0;
+	deviceptr->m2		  = 0;
+	deviceptr->abovectr	  = 0;
+	memset(&deviceptr->sketch, 0, sizeof(Sketch));
+	deviceptr->scale	  = 0;
+	deviceptr->samplectr	  = 0;
+	deviceptr->singlefileflag = 0;
+	deviceptr->appendflag	  = 0;
+	deviceptr->outputfileptr  = NULL;
+	deviceptr->singlefilevalue = NAN;	/* (--sparse: write the first rows */
+	deviceptr->multifilevalue  = NAN;	/* in full, even for --incremental) */
+	deviceptr->skippedrowidx   = -1;
+	deviceptr->servevaluetbl  = NULL;
+	deviceptr->maxservevalues = 0;
+	metricptr->numdevices++;
+    }
+    return deviceidx;
+}
+
+
+/*******************************************************************************
+--bucket: grow a class' bucket tables (each metric's device sums, and each
+device's sample counter) to maxdevices devices, with the values so far. This is
+called by grow_class_values, as the class' value table grows.
+*******************************************************************************/
+void grow_class_buckets(Class *classptr, int maxdevices) {
+    double	*bucketvaluetbl;
+    int		*bucketctrtbl;
+    int		metricidx;
+
+    if ((bucketvaluetbl=calloc((size_t)classptr->nummetrics*maxdevices,
+						sizeof(double))) == NULL ||
+		(bucketctrtbl=calloc(maxdevices, sizeof(int))) == NULL) {
+	err_exit("grow_class_buckets: calloc for class '%s' failed, aborting!",
+								classptr->classname);
+    }
+    for (metricidx=0; classptr->bucketvaluetbl!=NULL &&
+					metricidx<classptr->nummetrics; metricidx++) {
+	memcpy(bucketvaluetbl+(size_t)metricidx*maxdevices,
+		classptr->bucketvaluetbl+(size_t)metricidx*classptr->maxdevices,
+		classptr->maxdevices*sizeof(double));
+    }
+    if (classptr->bucketctrtbl != NULL) {
+	memcpy(bucketctrtbl, classptr->bucketctrtbl, classptr->maxdevices*sizeof(int));
+    }
+    free(classptr->bucketvaluetbl);
+    free(classptr->bucketctrtbl);
+    classptr->bucketvaluetbl = bucketvaluetbl;
+    classptr->bucketctrtbl   = bucketctrtbl;
+}
+
+
+/*******************************************************************************
+Duplicate metric names (even if they are in different classes) are forbidden.
+Abort if any are found. Each metric's name is added to metricnameindex, which
+the configuration and state files' metric names are looked up in.
+*******************************************************************************/
+void check_metric_names() {
+    Class	*classptr;
+    Metric	*metricptr;
+    int		classidx, metricidx, nummetricentries = 0;
+
+    for (classidx=0; classidx<numclasses; classidx++) {
+	nummetricentries += classtbl[classidx].nummetrics;
+    }
+    if ((metricentrytbl=calloc(nummetricentries+1, sizeof(Metricentry))) == NULL) {
+	err_exit("check_metric_names: calloc failed, aborting!");
+    }
+
+    nummetricentries = 0;
+    for (classidx=0; classidx<numclasses; classidx++) {
+	classptr = classtbl+classidx;
+	for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	    metricptr = classptr->metrictbl+metricidx;
+	    if (find_name(&metricnameindex, metricptr->metricname,
+					    strlen(metricptr->metricname)) >= 0) {
+		fprintf(stderr, "Duplicate metric '%s', aborting\n", metricptr->metricname);
+		exit(1);
+	    }
+	    add_name(&metricnameindex, metricptr->metricname, strlen(metricptr->metricname),
+							    nummetricentries);
+	    metricentrytbl[nummetricentries].classptr  = classptr;
+	    metricentrytbl[nummetricentries].metricptr = metricptr;
+	    nummetricentries++;
+	}
+    }
+}
+
+
+/*******************************************************************************
+Save an -I|--include or -X|--exclude glob (option argument) in its table.
+*******************************************************************************/
+void add_pattern(char ***patterntblptr, int *numpatternsptr, char *pattern) {
+    if ((*patterntblptr=realloc(*patterntblptr, (*numpatternsptr+1)*sizeof(char*))) == NULL) {
+	err_exit("add_pattern: realloc failed, aborting!");
+    }
+    (*patterntblptr)[(*numpatternsptr)++] = pattern;
+}
+
+int match_pattern(char **patterntbl, int numpatterns, const char *name) {
+    int		patternidx;
+
+    for (patternidx=0; patternidx<numpatterns; patternidx++) {
+	if (fnmatch(patterntbl[patternidx], name, 0) == 0) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+--include/--exclude: a metric_device (or a vector metric, when
+metric_device_name is NULL) is selected if its metric name or its metric_device
+name matches an include glob (or there are none), and neither matches an exclude
+glob.
+*******************************************************************************/
+int name_selected(const char *metricname, const char *metric_device_name) {
+    if (match_pattern(excludetbl, numexcludes, metricname) ||
+		(metric_device_name != NULL &&
+		match_pattern(excludetbl, numexcludes, metric_device_name))) {
+	return 0;
+    }
+    return numincludes == 0 || match_pattern(includetbl, numincludes, metricname) ||
+		(metric_device_name != NULL &&
+		match_pattern(includetbl, numincludes, metric_device_name));
+}
+
+
+/*******************************************************************************
+Return 0 if --include/--exclude select none of a metric's metric_devices (or
+the vector metric), whatever its devices are, so that the metric can be left out
+of its class. An include glob can only match a metric_device name if its literal
+prefix (up to its first wildcard) is a prefix of the metric name, or the metric
+name is a prefix of it.
+*******************************************************************************/
+int metric_selected(const char *metricname, int arrayclassflag) {
+    int		patternidx, prefixlen;
+
+    if (match_pattern(excludetbl, numexcludes, metricname)) {
+	return 0;
+    }
+    if (numincludes == 0 || match_pattern(includetbl, numincludes, metricname)) {
+	return 1;
+    }
+    for (patternidx=0; arrayclassflag && patternidx<numincludes; patternidx++) {
+	prefixlen = strcspn(includetbl[patternidx], "*?[\\");
+	if (!strncmp(includetbl[patternidx], metricname, prefixlen) ||
+		    !strncmp(includetbl[patternidx], metricname, strlen(metricname))) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+--fleet: return (a copy of) metricname@hostname, and free metricname.
+*******************************************************************************/
+char* host_metric_name(char *metricname, const char *hostname) {
+    char	*namestr;
+
+    if ((namestr=malloc(strlen(metricname)+strlen(HOSTSEPARATOR)+strlen(hostname)+1))
+								    == NULL) {
+	err_exit("host_metric_name: malloc failed, aborting!");
+    }
+    sprintf(namestr, "%s%s%s", metricname, HOSTSEPARATOR, hostname);
+    free(metricname);
+    return namestr;
+}
+
+
+/*******************************************************************************
+Skip to the METADATA stanza. For each class, dynamically allocate it's space
+in table classtbl (as it grows) and populate it's data (name, type, start row).
+Also dynamically allocate the space for each class' metrics (metrictbl), and
+populate/initialize the metric's data (name, number, max, sum, numdevices,
+devicetbl). Metrics that --include/--exclude leave out are not added (their
+fields are skipped - see fieldmetrictbl), nor are classes with no metrics.
+--fleet: the classes of each input file (host) are added after those of the
+previous ones, and its metric names are suffixed with @hostname.
+*******************************************************************************/
+void initialize_metadata(Inputfile *ifp, const char *hostname) {
+    char	*lineptr, *lineendptr;
+    Token	*argtbl;
+    Class	*classptr;
+    Metric	*metricptr;
+    int		numargs, startrow, fieldidx, metricidx;
+    int		classidx = numclasses;
+
+    skip_to_stanza(ifp, METADATASTR, 1);
+    argtbl = input_args(ifp, MINNUMARGS);
+
+    /* Loop through the classes */
+    while ((lineptr=get_input_line(ifp, &lineendptr)) != NULL) {
+	/* (any number of metrics: if the Tokens ran out, parse it again) */
+	while ((numargs=parse_input_line(lineptr, lineendptr, argtbl, ifp->maxargs)) ==
+								    ifp->maxargs) {
+	    argtbl = input_args(ifp, 2*ifp->maxargs);
+	}
+	if (numargs >= NUMMETAITEMS+1) {
+
+	    if (*argtbl[CLASSTYPEIDX].ptr != VECTORCLASS && *argtbl[CLASSTYPEIDX].ptr !=
+									ARRAYCLASS) {
+		fprintf(stderr,
+		"Class '%.*s': bad type '%c': must be '%c' or '%c', aborting!\n",
+			    argtbl[0].len, argtbl[0].ptr, *argtbl[CLASSTYPEIDX].ptr,
+			    VECTORCLASS, ARRAYCLASS);
+		exit(1);
+	    }
+
+	    startrow = token_to_long(argtbl+STARTROWIDX);
+	    if (startrow < 1 || startrow > count) {
+		fprintf(stderr,
+		"Class '%.*s': bad start row '%d': must be 1 to %d, aborting!\n",
+				argtbl[0].len, argtbl[0].ptr, startrow, count-1);
+		exit(1);
+	    }
+
+	    if (classtbl == NULL) {
+		if ((classtbl=calloc(1, sizeof(Class))) == NULL) {
+		    err_exit("initialize_metadata: class calloc failed, aborting!");
+		}
+	    } else {
+		if ((classtbl=realloc(classtbl, (classidx+1)*sizeof(Class))) == NULL) {
+		    err_exit("initialize_metadata: class realloc failed, aborting!");
+		}
+	    }
+
+	    classptr = classtbl+classidx;
+	    classptr->classname = token_strdup(argtbl+CLASSSTRIDX);
+	    if ((classptr->datastanza=malloc(argtbl[CLASSSTRIDX].len+2)) == NULL) {
+		err_exit("initialize_metadata: malloc for class '%s' failed, aborting!",
+									classptr->classname);
+	    }
+	    sprintf(classptr->datastanza, "%s%c", classptr->classname, STANZATERMCHAR);
+	    classptr->classtype = *argtbl[CLASSTYPEIDX].ptr;
+	    classptr->startrow = startrow-1;
+
+	    classptr->numfields = numargs-NUMMETAITEMS;
+	    if ((classptr->metrictbl=calloc(classptr->numfields, sizeof(Metric))) == NULL ||
+		    (classptr->fieldmetrictbl=calloc(classptr->numfields, sizeof(int))) == NULL) {
+		err_exit("initialize_metadata: metric calloc for class '%s' failed, aborting!",
+									classptr->classname);
+	    }
+
+	    metricidx = 0;
+	    for (fieldidx=0; fieldidx<classptr->numfields; fieldidx++) {
+		metricptr = classptr->metrictbl+metricidx;
+		metricptr->metricname	= token_strdup(argtbl+fieldidx+NUMMETAITEMS);
+		if (hostname != NULL) {
+		    metricptr->metricname = host_metric_name(metricptr->metricname,
+								hostname);
+		}
+		if (!metric_selected(metricptr->metricname,
+					    classptr->classtype == ARRAYCLASS)) {
+		    free(metricptr->metricname);
+		    classptr->fieldmetrictbl[fieldidx] = -1;
+		    continue;
+		}
+		classptr->fieldmetrictbl[fieldidx] = metricidx++;
+		metricptr->number	= 0;
+		metricptr->min		= 0;
+		metricptr->max		= 0;
+		metricptr->sum		= 0;
+		metricptr->mean		= 0;
+		metricptr->m2		= 0;
+		metricptr->abovectr	= 0;
+		metricptr->numdevices   = 0;
+		metricptr->maxdevices   = 0;
+		metricptr->devicetbl    = NULL;
+	    }
+	    classptr->nummetrics = metricidx;
+	    if (classptr->nummetrics == classptr->numfields) {
+		free(classptr->fieldmetrictbl);		/* (every field is a metric) */
+		classptr->fieldmetrictbl = NULL;
+	    }
+	    if (classptr->nummetrics == 0) {
+		if (verbosity > 1) {
+		    fprintf(stderr, "i: Class '%s' has no selected metrics, skipping\n",
+									classptr->classname);
+		}
+		free(classptr->metrictbl);
+		free(classptr->fieldmetrictbl);
+		free(classptr->datastanza);
+		free(classptr->classname);
+		continue;
+	    }
+
+	    /* vector metrics have exactly one "device" - array devices are added
+	       by read_array_stanza as they are found in the data stanzas */
+	    memset(&classptr->deviceindex, 0, sizeof(Nameindex));
+	    classptr->valuetbl	     = NULL;
+	    classptr->sampleflagtbl  = NULL;
+	    classptr->maxdevices     = 0;
+	    classptr->numignoreddevices = 0;
+	    classptr->bucketvaluetbl = NULL;
+	    classptr->bucketctrtbl   = NULL;
+	    if (classptr->classtype == VECTORCLASS) {
+		add_device(classptr, NODEVICENAME, strlen(NODEVICENAME));
+	    }
+	    classidx += 1;
+	} else if (numargs == 0) {
+	    break;
+	} else {
+	    fprintf(stderr, "Bad class '%.*s' metadata at line %d\n", argtbl[0].len,
+						    argtbl[0].ptr, ifp->linectr);
+	}
+    }
+    if (classidx == numclasses) {
+	fprintf(stderr, "No (selected) metrics in input file %s, aborting!\n", ifp->filename);
+	exit(1);
+    }
+    numclasses = classidx;
+}
+
+
+/*******************************************************************************
+Save a (non-parameter) configuration file entry in scaletbl, so that its scale
+value can also be applied to array class devices that are not found until later
+in the input file(s). scalenameindex has the index of the last entry of each
+name (the one that applies).
+*******************************************************************************/
+void add_scale_entry(char *name, double scale) {
+    Scaleentry	*scaleentryptr;
+    int		*indexptr;
+
+    if ((scaletbl=realloc(scaletbl, (numscaleentries+1)*sizeof(Scaleentry))) == NULL) {
+	err_exit("add_scale_entry: scale entry realloc failed, aborting!");
+    }
+    scaleentryptr = scaletbl+numscaleentries;
+    if ((indexptr=find_name_index(&scalenameindex, name, strlen(name))) != NULL) {
+	scaleentryptr->name = scaletbl[*indexptr].name;
+	*indexptr = numscaleentries;
+    } else {
+	scaleentryptr->name = add_name(&scalenameindex, name, strlen(name), numscaleentries);
+    }
+    scaleentryptr->scale = scale;
+    numscaleentries++;
+}
+
+
+/*******************************************************************************
+Return the metric_device name (e.g., tps_sda) of a metric's device, in a buffer
+that grows to fit (and is reused by the next call).
+*******************************************************************************/
+char* format_metric_device_name(Metric *metricptr, const char *devicename) {
+    static char		*namestr = NULL;
+    static size_t	namesize = 0;
+    size_t		len;
+
+    len = strlen(metricptr->metricname)+strlen(paramtbl[METDEVSEPARATORIDX].value.string)+
+						    strlen(devicename)+1;
+    if (len > namesize) {
+	namesize = 2*len;
+	if ((namestr=realloc(namestr, namesize)) == NULL) {
+	    err_exit("format_metric_device_name: realloc failed, aborting!");
+	}
+    }
+    sprintf(namestr, "%s%s%s", metricptr->metricname,
+		paramtbl[METDEVSEPARATORIDX].value.string, devicename);
+    return namestr;
+}
+
+
+/*******************************************************************************
+Set the scale of a newly found array class device from the configuration file
+entries for its metric or its metric_device name: the later one applies, as it
+does in read_configfile.
+*******************************************************************************/
+void apply_configured_scale(Metric *metricptr, Device *deviceptr) {
+    char	*metric_device_name;
+    int		scaleentryidx, metricdeviceidx;
+
+    metric_device_name = format_metric_device_name(metricptr, deviceptr->devicename);
+    scaleentryidx   = find_name(&scalenameindex, metricptr->metricname,
+						    strlen(metricptr->metricname));
+    metricdeviceidx = find_name(&scalenameindex, metric_device_name,
+						    strlen(metric_device_name));
+    scaleentryidx = MAX(scaleentryidx, metricdeviceidx);
+    if (scaleentryidx >= 0) {
+	deviceptr->scale = scaletbl[scaleentryidx].scale;
+    }
+}
+
+
+/*******************************************************************************
+Add a newly found array class device, and set its scales - 0 (not output) for
+the metric_devices that --include/--exclude don't select. If none are selected,
+the device is not added: it's only saved in the class' device index (as
+IGNOREDDEVICE), so it uses no space and its rows are skipped. Returns the
+device's index, or IGNOREDDEVICE.
+*******************************************************************************/
+int select_new_device(Class *classptr, const char *devicename) {
+    Metric	*metricptr;
+    int		metricidx, deviceidx;
+    int		numselected = 0;
+
+    if (numincludes+numexcludes > 0) {
+	for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	    metricptr = classptr->metrictbl+metricidx;
+	    numselected += name_selected(metricptr->metricname,
+				format_metric_device_name(metricptr, devicename));
+	}
+	if (numselected == 0) {
+	    add_name(&classptr->deviceindex, devicename, strlen(devicename), IGNOREDDEVICE);
+	    classptr->numignoreddevices++;
+	    return IGNOREDDEVICE;
+	}
+    }
+
+    deviceidx = add_device(classptr, devicename, strlen(devicename));
+    for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	metricptr = classptr->metrictbl+metricidx;
+	if (numscaleentries > 0) {
+	    apply_configured_scale(metricptr, metricptr->devicetbl+deviceidx);
+	}
+	if (numselected > 0 && !name_selected(metricptr->metricname,
+				format_metric_device_name(metricptr, devicename))) {
+	    metricptr->devicetbl[deviceidx].scale = 0;
+	}
+    }
+    return deviceidx;
+}
+
+
+/*******************************************************************************
+Set the scales of the array class metric_devices that --include/--exclude don't
+select to 0, after the configuration file has (maybe) set them - and changed
+the metric_device separator.
+*******************************************************************************/
+void deselect_devices() {
+    Class	*classptr;
+    Metric	*metricptr;
+    Device	*deviceptr;
+    int		classidx, metricidx, deviceidx;
+
+    for (classidx=0; classidx<numclasses; classidx++) {
+	classptr = classtbl+classidx;
+	for (metricidx=0; classptr->classtype == ARRAYCLASS &&
+					metricidx<classptr->nummetrics; metricidx++) {
+	    metricptr = classptr->metrictbl+metricidx;
+	    for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
+		deviceptr = metricptr->devicetbl+deviceidx;
+		if (!name_selected(metricptr->metricname,
+			format_metric_device_name(metricptr, deviceptr->devicename))) {
+		    deviceptr->scale = 0;
+		}
+	    }
+	}
+    }
+}
+
+
+/*******************************************************************************
+Set the scale of the device(s) of the configuration file entry name: a metric
+(all of its devices), and/or any array class metric_device names - which are
+found by looking up (in metricnameindex and the class' device index) each way of
+splitting name at a metric_device separator. Returns 0 if there are none.
+*******************************************************************************/
+int set_configured_scale(char *name, double scale) {
+    Metricentry	*metricentryptr;
+    Metric	*metricptr;
+    char	*separator = paramtbl[METDEVSEPARATORIDX].value.string;
+    int		len = strlen(name), separatorlen = strlen(separator);
+    int		metricentryidx, deviceidx, prefixlen;
+    int		foundflag = 0;
+
+    if ((metricentryidx=find_name(&metricnameindex, name, len)) >= 0) {
+	metricptr = metricentrytbl[metricentryidx].metricptr;
+	for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
+	    metricptr->devicetbl[deviceidx].scale = scale;
+	}
+	foundflag = 1;
+    }
+
+    for (prefixlen=1; prefixlen+separatorlen<len; prefixlen++) {
+	if (memcmp(name+prefixlen, separator, separatorlen) ||
+		(metricentryidx=find_name(&metricnameindex, name, prefixlen)) < 0) {
+	    continue;
+	}
+	metricentryptr = metricentrytbl+metricentryidx;
+	if (metricentryptr->classptr->classtype == ARRAYCLASS &&
+		(deviceidx=find_name(&metricentryptr->classptr->deviceindex,
+			    name+prefixlen+separatorlen, len-prefixlen-separatorlen)) >= 0) {
+	    metricentryptr->metricptr->devicetbl[deviceidx].scale = scale;
+	    foundflag = 1;
+	}
+    }
+    return foundflag;
+}
+
+
+/*******************************************************************************
+--fleet: a configuration file entry without a host name (e.g., cpu_us or
+tps_sda) applies to every host: the scale of each metric@hostname (or
+metric@hostname_device) is set, and saved for the devices not found yet.
+Returns 0 if no host has the metric.
+*******************************************************************************/
+int set_host_configured_scales(char *name, double scale) {
+    char	*separator = paramtbl[METDEVSEPARATORIDX].value.string;
+    char	*namestr, *hostname;
+    int		len = strlen(name), separatorlen = strlen(separator);
+    int		hostidx, prefixlen, metricnamelen;
+    int		foundflag = 0;
+
+    for (hostidx=0; hostidx<numhosts; hostidx++) {
+	hostname = hosttbl[hostidx].hostname;
+	if ((namestr=malloc(len+strlen(HOSTSEPARATOR)+strlen(hostname)+1)) == NULL) {
+	    err_exit("set_host_configured_scales: malloc failed, aborting!");
+	}
+	for (prefixlen=len; prefixlen>0; prefixlen--) {	/* (len: a metric) */
+	    if (prefixlen < len && (prefixlen+separatorlen >= len ||
+				memcmp(name+prefixlen, separator, separatorlen))) {
+		continue;
+	    }
+	    sprintf(namestr, "%.*s%s%s%s", prefixlen, name, HOSTSEPARATOR, hostname,
+							    name+prefixlen);
+	    metricnamelen = prefixlen+strlen(HOSTSEPARATOR)+strlen(hostname);
+	    if (find_name(&metricnameindex, namestr, metricnamelen) >= 0) {
+		set_configured_scale(namestr, scale);
+		add_scale_entry(namestr, scale);
+		foundflag = 1;
+		break;
+	    }
+	}
+	free(namestr);
+    }
+    return foundflag;
+}
+
+
+/*******************************************************************************
+Read and parse a configuration file, which may contain maximum scale values for
+metrics (e.g., cpu_us 100.0) and/or paramtbl vales (e.g., singlefiledelimiter '|').
+Anything after the comment character ('#') is ignored.
+*******************************************************************************/
+void read_configfile() {
+    char	valuestr[MAXPARAMVALLEN+1], *namestr, *lineptr, *lineendptr;
+    Token	tokentbl[2];
+    Param	*paramptr;
+    int		numargs, paramidx;
+    int		legalparamflag;
+    Inputfile	*configfileptr;
+
+    if ((configfileptr=open_inputfile(configfilename)) == NULL) {
+	err_exit("Could not open configuration file '%s', aborting!", configfilename);
+    }
+    for (paramidx=0; paramidx<(int)NUMCONFIGPARAMS; paramidx++) {
+	add_name(&paramnameindex, paramtbl[paramidx].paramname,
+				    strlen(paramtbl[paramidx].paramname), paramidx);
+    }
+
+    while ((lineptr=get_input_line(configfileptr, &lineendptr)) != NULL) {
+	if ((numargs=parse_input_line(lineptr, lineendptr, tokentbl, 2)) == 2) {
+	    namestr = token_strdup(tokentbl);		/* (names may be any length) */
+	    token_copy(valuestr, tokentbl+1, MAXPARAMVALLEN);
+
+	    /* if a metric or a metric_device line has a scale value, grab it */
+	    legalparamflag = set_configured_scale(namestr, atof(valuestr));
+
+	    /* Overwrite any paramtbl value with value(s) set in the config file */
+	    if ((paramidx=find_name(&paramnameindex, namestr, strlen(namestr))) >= 0) {
+		paramptr = paramtbl+paramidx;
+		switch(paramptr->type) {
+		    case CHAR:    paramptr->value.character = *valuestr; break;
+		    case FLTPNT:  paramptr->value.fltpnt    = atof(valuestr); break;
+		    case INTEGER: paramptr->value.longint   = atoi(valuestr); break;
+		    case STRING:
+			paramptr->value.string = (char*)malloc(strlen(valuestr)+1);
+			strcpy(paramptr->value.string, valuestr);
+			break;
+		    default:
+			fprintf(stderr, "SNARK: read_configfile\n");
+			exit(1);
+			break;
+		}
+		legalparamflag = 1;
+	    } else {
+		add_scale_entry(namestr, atof(valuestr));
+		if (numhosts > 0 && strstr(namestr, HOSTSEPARATOR) == NULL) {
+		    legalparamflag |= set_host_configured_scales(namestr, atof(valuestr));
+		}
+	    }
+
+	    /* (names that --include/--exclude leave out are expected to be unknown) */
+	    if (legalparamflag == 0 && name_selected(namestr, NULL)) {
+		fprintf(stderr, "Ignoring unknown configuraton file parameter '%s'\n", namestr);
+	    }
+	    free(namestr);
+	} else if (numargs != 0) {
+	    fprintf(stderr, "Bad configuration file line starting '%.*s'\n",
+						tokentbl[0].len, tokentbl[0].ptr);
+	}
+    }
+    close_inputfile(configfileptr);
+
+    if (*paramtbl[TIMEZONEIDX].value.string != '\0') {
+	setenv("TZ", paramtbl[TIMEZONEIDX].value.string, 1);
+	tzset();
+    }
+}
+
+
+/*******************************************************************************
+Append a (printf formatted) message to a message buffer. Messages are deferred
+- and output by print_messages - so that they are in the same order whether or
+not the input file is parsed by a separate thread.
+*******************************************************************************/
+void add_message(Messagebuf *messagebufptr, const char *formatstr, ...) {
+    va_list	argptr;
+    int		len;
+
+    if (messagebufptr->str == NULL) {
+	messagebufptr->size = MAXTMSTPSTRLEN;
+	if ((messagebufptr->str=malloc(messagebufptr->size)) == NULL) {
+	    err_exit("add_message: malloc failed, aborting!");
+	}
+    }
+    while (1) {
+	va_start(argptr, formatstr);
+	len = vsnprintf(messagebufptr->str+messagebufptr->len,
+			    messagebufptr->size-messagebufptr->len, formatstr, argptr);
+	va_end(argptr);
+	if (messagebufptr->len+len < messagebufptr->size) {
+	    messagebufptr->len += len;
+	    return;
+	}
+	messagebufptr->size = 2*(messagebufptr->len+len+1);
+	if ((messagebufptr->str=realloc(messagebufptr->str, messagebufptr->size)) == NULL) {
+	    err_exit("add_message: realloc failed, aborting!");
+	}
+    }
+}
+
+void print_messages(Messagebuf *messagebufptr) {
+    if (messagebufptr->len > 0) {
+	fputs(messagebufptr->str, stderr);
+	messagebufptr->len = 0;
+    }
+}
+
+
+/*******************************************************************************
+Make room for (at least) one more row in a (parsed) stanza.
+*******************************************************************************/
+void grow_stanza(Stanza *stanzaptr, Class *classptr) {
+    stanzaptr->maxrows = stanzaptr->maxrows ? 2*stanzaptr->maxrows : count;
+    if ((stanzaptr->goodflagtbl=realloc(stanzaptr->goodflagtbl,
+						stanzaptr->maxrows)) == NULL ||
+	(stanzaptr->valuetbl=realloc(stanzaptr->valuetbl,
+	    (size_t)stanzaptr->maxrows*classptr->nummetrics*sizeof(double))) == NULL) {
+	err_exit("grow_stanza: realloc for class '%s' failed, aborting!",
+								classptr->classname);
+    }
+    if (classptr->classtype == ARRAYCLASS && (stanzaptr->devicenameofftbl=realloc(
+			stanzaptr->devicenameofftbl,
+			(size_t)stanzaptr->maxrows*sizeof(size_t))) == NULL) {
+	err_exit("grow_stanza: device name realloc for class '%s' failed, aborting!",
+								classptr->classname);
+    }
+}
+
+
+/*******************************************************************************
+Save (a null terminated copy of) the device name of the next row of an array
+class stanza in its device name buffer, which doubles in size when it's full.
+(The input buffer may be reused, or released, before the stanza is stored.)
+*******************************************************************************/
+void save_device_name(Stanza *stanzaptr, Token *tokenptr) {
+    while (stanzaptr->devicenamebuflen+tokenptr->len+1 > stanzaptr->devicenamebufsize) {
+	stanzaptr->devicenamebufsize = stanzaptr->devicenamebufsize ?
+				    2*stanzaptr->devicenamebufsize : MINDEVNAMEBUFSIZE;
+	if ((stanzaptr->devicenamebuf=realloc(stanzaptr->devicenamebuf,
+					    stanzaptr->devicenamebufsize)) == NULL) {
+	    err_exit("save_device_name: realloc failed, aborting!");
+	}
+    }
+    stanzaptr->devicenameofftbl[stanzaptr->numrows] = stanzaptr->devicenamebuflen;
+    token_copy(stanzaptr->devicenamebuf+stanzaptr->devicenamebuflen, tokenptr,
+								tokenptr->len);
+    stanzaptr->devicenamebuflen += tokenptr->len+1;
+}
+
+
+/*******************************************************************************
+Convert the tokens argtbl[0 ... numvalues-1] (from parse_input_line) of a data
+stanza line to valuetbl, as atof would (0.0 if a token doesn't start with a
+number). Like parse_data_line, the fields of the metrics that are left out are
+skipped. In strict mode, tokens that are not numbers are counted and reported,
+and make the row bad (the return value is 0).
+*******************************************************************************/
+int convert_data_tokens(Inputfile *ifp, Class *classptr, Stanza *stanzaptr,
+				    Token argtbl[], double valuetbl[], int numvalues) {
+    int		fieldidx, validx;
+    int		goodflag = 1;
+
+    for (fieldidx=0; fieldidx<numvalues; fieldidx++) {
+	validx = fieldidx;
+	if (classptr->fieldmetrictbl != NULL) {
+	    validx = classptr->fieldmetrictbl[fieldidx];
+	}
+	if (validx >= 0 && !token_to_value(argtbl+fieldidx, valuetbl+validx) && strictflag) {
+	    stanzaptr->numbadvalues++;
+	    add_message(&stanzaptr->messagebuf,
+		    "File %s line %d class %s: malformed value '%.*s'\n",
+		    ifp->filename, ifp->linectr, classptr->classname,
+		    argtbl[fieldidx].len, argtbl[fieldidx].ptr);
+	    goodflag = 0;
+	}
+    }
+    return goodflag;
+}
+
+
+/*******************************************************************************
+Read (parse) a vector class stanza of input file data into a Stanza. This only
+converts the data - it does not change any Class, Metric or Device - so it may
+be called by several threads at once (on different input files).
+*******************************************************************************/
+void read_vector_stanza(Inputfile *ifp, Class *classptr, Stanza *stanzaptr) {
+    char	*lineptr, *lineendptr;
+    Token	*argtbl;
+    double	*valueptr;
+    int		numargs, convertedflag;
+    int		maxargs = classptr->numfields+1;	/* (one too many is bad) */
+
+    argtbl = input_args(ifp, maxargs);
+    stanzaptr->numrows = 0;
+    stanzaptr->numbadvalues = 0;
+    stanzaptr->terminatedflag = 0;
+    while ((lineptr=get_input_line(ifp, &lineendptr)) != NULL) {
+	if (stanzaptr->numrows == stanzaptr->maxrows) {
+	    grow_stanza(stanzaptr, classptr);
+	}
+	valueptr = stanzaptr->valuetbl+stanzaptr->numrows*classptr->nummetrics;
+	if ((numargs=parse_data_line(lineptr, lineendptr, argtbl, 0, valueptr,
+			    classptr->numfields, maxargs, classptr->fieldmetrictbl)) >= 0) {
+	    convertedflag = 1;
+	} else {
+	    numargs = parse_input_line(lineptr, lineendptr, argtbl, maxargs);
+	    convertedflag = 0;
+	}
+	if (numargs == 0) {
+	    stanzaptr->terminatedflag = 1;
+	    break;
+	}
+	if (numargs == classptr->numfields) {
+	    stanzaptr->goodflagtbl[stanzaptr->numrows] = convertedflag ||
+			stanzaptr->numrows < classptr->startrow ||
+			convert_data_tokens(ifp, classptr, stanzaptr, argtbl, valueptr,
+							    classptr->numfields);
+	} else {
+	    stanzaptr->goodflagtbl[stanzaptr->numrows] = 0;
+	    add_message(&stanzaptr->messagebuf,
+		    "File %s line %d vector class %s: bad data starting '%.*s'\n",
+		    ifp->filename, ifp->linectr, classptr->classname,
+		    argtbl[0].len, argtbl[0].ptr);
+	}
+	stanzaptr->numrows++;
+    }
+    stanzaptr->endlinectr = ifp->linectr;
+}
+
+
+/*******************************************************************************
+Process a (parsed) vector class stanza: store its data values, and flag the
+(good) sample rows for update_class_statistics.
+*******************************************************************************/
+void store_vector_stanza(char *inputfilename, Class *classptr, Stanza *stanzaptr) {
+    double	*valueptr;
+    int		metricidx, rowidx;
+
+    print_messages(&stanzaptr->messagebuf);
+    badvaluectr += stanzaptr->numbadvalues;
+    memset(classptr->sampleflagtbl, 0, (size_t)count*classptr->maxdevices);
+    for (rowidx=classptr->startrow; rowidx<MIN(stanzaptr->numrows, count); rowidx++) {
+	if (!stanzaptr->goodflagtbl[rowidx]) {
+	    continue;
+	}
+	valueptr = stanzaptr->valuetbl+rowidx*classptr->nummetrics;
+	for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	    *VALUEPTR(classptr, rowidx, metricidx, 0) = valueptr[metricidx];
+	}
+	*SAMPLEFLAGPTR(classptr, rowidx, 0) = 1;
+    }
+    if (stanzaptr->numrows != count) {
+	fprintf(stderr, "File %s line %d vector class %s: expected %d rows, not %d\n",
+		inputfilename, stanzaptr->endlinectr, classptr->classname, count,
+		stanzaptr->numrows);
+    }
+}
+
+
+/*******************************************************************************
+Return the index of the device named devicename in an array class (all the
+metrics of a class have the same devices, in the same order), or -1 if there
+isn't one. The device at guessidx (where it would be if the devices are in the
+same order as in the previous rows) is checked first, then the class' device
+name index.
+*******************************************************************************/
+int find_device(Class *classptr, const char *devicename, int len, int guessidx) {
+    Metric	*metricptr = classptr->metrictbl;
+    char	*guessname;
+
+    if (guessidx < metricptr->numdevices) {
+	guessname = metricptr->devicetbl[guessidx].devicename;
+	if (!strncmp(devicename, guessname, len) && guessname[len] == '\0') {
+	    return guessidx;
+	}
+    }
+    return find_name(&classptr->deviceindex, devicename, len);
+}
+
+
+/*******************************************************************************
+Read (parse) an array class stanza of input file data into a Stanza, saving the
+device name of each row. Like read_vector_stanza, this is thread safe.
+*******************************************************************************/
+void read_array_stanza(Inputfile *ifp, Class *classptr, Stanza *stanzaptr) {
+    char	*lineptr, *lineendptr;
+    Token	*argtbl;
+    double	*valueptr;
+    int		numargs, convertedflag;
+    int		maxargs = classptr->numfields+2;	/* device name, and one too many */
+
+    argtbl = input_args(ifp, maxargs);
+    stanzaptr->numrows = 0;
+    stanzaptr->devicenamebuflen = 0;
+    stanzaptr->numbadvalues = 0;
+    stanzaptr->terminatedflag = 0;
+    while ((lineptr=get_input_line(ifp, &lineendptr)) != NULL) {
+	if (stanzaptr->numrows == stanzaptr->maxrows) {
+	    grow_stanza(stanzaptr, classptr);
+	}
+	valueptr = stanzaptr->valuetbl+stanzaptr->numrows*classptr->nummetrics;
+	if ((numargs=parse_data_line(lineptr, lineendptr, argtbl, 1, valueptr,
+			    classptr->numfields, maxargs, classptr->fieldmetrictbl)) >= 0) {
+	    convertedflag = 1;
+	} else {
+	    numargs = parse_input_line(lineptr, lineendptr, argtbl, maxargs);
+	    convertedflag = 0;
+	}
+	if (numargs == 0) {
+	    stanzaptr->terminatedflag = 1;
+	    break;
+	}
+	save_device_name(stanzaptr, argtbl);
+	if (numargs == classptr->numfields+1) {
+	    stanzaptr->goodflagtbl[stanzaptr->numrows] = convertedflag ||
+			convert_data_tokens(ifp, classptr, stanzaptr, argtbl+1, valueptr,
+							    classptr->numfields);
+	} else {
+	    stanzaptr->goodflagtbl[stanzaptr->numrows] = 0;
+	    add_message(&stanzaptr->messagebuf,
+		    "File %s line %d array class %s: bad data starting '%.*s'\n",
+		    ifp->filename, ifp->linectr, classptr->classname,
+		    argtbl[0].len, argtbl[0].ptr);
+	}
+	stanzaptr->numrows++;
+    }
+    stanzaptr->endlinectr = ifp->linectr;
+}
+
+
+/*******************************************************************************
+Process a (parsed) array class stanza: store its data values, and flag the
+(good) sample rows of each device for update_class_statistics. The device of
+each row is
+looked up, and any device not seen before is added to every metric of the
+class - so devices are found as they are read, and the input file(s) only need
+to be read once - unless --include/--exclude select none of its metric_devices
+(then the rows of the device are skipped). Returns the number of new devices.
+Every metric of a device has the same samples, so only metric 0's device counts
+them, and a row's values are stored a (metric) stride apart from its first -
+and the next row's device is guessed to be the one after this row's.
+*******************************************************************************/
+int store_array_stanza(char *inputfilename, Class *classptr, Stanza *stanzaptr) {
+    char	*devicename;
+    Device	*devicetbl;
+    double	*valueptr, *storeptr;
+    int		metricidx, deviceidx, sampleidx, rowidx;
+    int		guessidx = 0;
+    int		numnewdevices = 0;
+    size_t	metricstride;
+
+    print_messages(&stanzaptr->messagebuf);
+    badvaluectr += stanzaptr->numbadvalues;
+    if (classptr->sampleflagtbl != NULL) {
+	memset(classptr->sampleflagtbl, 0, (size_t)count*classptr->maxdevices);
+    }
+    devicetbl = classptr->metrictbl->devicetbl;
+    for (deviceidx=0; deviceidx<classptr->metrictbl->numdevices; deviceidx++) {
+	devicetbl[deviceidx].samplectr = 0;
+    }
+
+    for (rowidx=0; rowidx<stanzaptr->numrows; rowidx++) {
+	devicename = stanzaptr->devicenamebuf+stanzaptr->devicenameofftbl[rowidx];
+	valueptr   = stanzaptr->valuetbl+rowidx*classptr->nummetrics;
+	if (guessidx >= classptr->metrictbl->numdevices) {
+	    guessidx = 0;
+	}
+	deviceidx  = find_device(classptr, devicename, strlen(devicename), guessidx);
+	guessidx   = deviceidx >= 0 ? deviceidx+1 : guessidx;
+	if (!stanzaptr->goodflagtbl[rowidx]) {
+	    /* a bad row of a known device still uses (and zeroes) its sample */
+	    if (deviceidx >= 0 && (sampleidx=devicetbl[deviceidx].samplectr++) < count) {
+		metricstride = classptr->maxdevices;
+		storeptr = VALUEPTR(classptr, sampleidx, 0, deviceidx);
+		for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+		    storeptr[metricidx*metricstride] = 0;
+		}
+	    }
+	    continue;
+	}
+	if (deviceidx == -1) {
+	    if ((deviceidx=select_new_device(classptr, devicename)) == IGNOREDDEVICE) {
+		continue;
+	    }
+	    devicetbl = classptr->metrictbl->devicetbl;	/* (it may have moved) */
+	    guessidx = deviceidx+1;
+	    numnewdevices++;
+	} else if (deviceidx == IGNOREDDEVICE) {
+	    continue;
+	}
+
+	sampleidx = devicetbl[deviceidx].samplectr++;
+	if (sampleidx >= classptr->startrow && sampleidx < count) {
+	    metricstride = classptr->maxdevices;
+	    storeptr = VALUEPTR(classptr, sampleidx, 0, deviceidx);
+	    for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+		storeptr[metricidx*metricstride] = valueptr[metricidx];
+	    }
+	    *SAMPLEFLAGPTR(classptr, sampleidx, deviceidx) = 1;
+	}
+    }
+
+    if (stanzaptr->numrows != count*(classptr->metrictbl->numdevices+
+						    classptr->numignoreddevices)) {
+	fprintf(stderr, "File %s line %d array class %s: expected %d rows, not %d\n",
+			    inputfilename, stanzaptr->endlinectr, classptr->classname,
+			    count*(classptr->metrictbl->numdevices+classptr->numignoreddevices),
+			    stanzaptr->numrows);
+
+	/* zero the rows of any device(s) missing from (some of) this stanza */
+	for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	    for (deviceidx=0; deviceidx<classptr->metrictbl->numdevices; deviceidx++) {
+		for (sampleidx=devicetbl[deviceidx].samplectr; sampleidx<count; sampleidx++) {
+		    *VALUEPTR(classptr, sampleidx, metricidx, deviceidx) = 0;
+		}
+	    }
+	}
+    }
+    return numnewdevices;
+}
+
+
+/*******************************************************************************
+Quantile sketches (like DDSketch): a value v > 0 is counted in the bucket (key)
+ceil(log(v)/log(gamma)), where gamma = (1+SKETCHACCURACY)/(1-SKETCHACCURACY), so
+every value in the bucket is within SKETCHACCURACY (relative) of
+2*gamma^key/(gamma+1). (sketch_key looks up the log of v's mantissa in a table,
+so that's +/- 2^-SKETCHLOGBITS more.) Negative values are counted (by -v) in a
+second store.
+A store holds the counters of a range of keys, and is widened as required -
+but never to more than MAXSKETCHKEYS: the lowest keys are collapsed (merged)
+into the lowest one kept. So the memory used is bounded, however many values
+are added, and only the (relative) accuracy of the smallest values is lost.
+*******************************************************************************/
+double sketch_log_gamma() {
+    static double	loggamma = 0;
+
+    if (loggamma == 0) {
+	loggamma = log((1+SKETCHACCURACY)/(1-SKETCHACCURACY));
+    }
+    return loggamma;
+}
+
+/* the key of (normal) value > 0: log(value) = e*log(2) + log(m), 1 <= m < 2 */
+int sketch_key(double value) {
+    static double	logmantissatbl[1<<SKETCHLOGBITS], log2;
+    static int		initializedflag = 0;
+    uint64_t		bits;
+    int			idx;
+
+    if (!initializedflag) {
+	for (idx=0; idx<(1<<SKETCHLOGBITS); idx++) {
+	    logmantissatbl[idx] = log(1+(idx+0.5)/(1<<SKETCHLOGBITS))/sketch_log_gamma();
+	}
+	log2 = log(2.0)/sketch_log_gamma();
+	initializedflag = 1;
+    }
+    memcpy(&bits, &value, sizeof(bits));		/* IEEE 754 double */
+    return (int)ceil(((int)((bits>>52)&0x7ff)-1023)*log2 +
+		    logmantissatbl[(bits>>(52-SKETCHLOGBITS))&((1<<SKETCHLOGBITS)-1)]);
+}
+
+void add_to_sketch_store(Sketchstore *storeptr, int key, unsigned number) {
+    unsigned	*countertbl;
+    int		minkey, maxkey, idx;
+
+    if (key >= storeptr->minkey && key < storeptr->minkey+storeptr->numkeys) {
+	storeptr->countertbl[key-storeptr->minkey] += number;
+	return;
+    }
+    if (storeptr->numkeys == 0) {
+	minkey = maxkey = key;
+    } else {
+	minkey = MIN(key, storeptr->minkey);
+	maxkey = MAX(key, storeptr->minkey+storeptr->numkeys-1);
+    }
+    if (maxkey-minkey >= MAXSKETCHKEYS) {
+	minkey = maxkey-MAXSKETCHKEYS+1;
+	key = MAX(key, minkey);
+    }
+    if (storeptr->numkeys == 0 || minkey != storeptr->minkey ||
+				maxkey != storeptr->minkey+storeptr->numkeys-1) {
+	if ((countertbl=calloc(maxkey-minkey+1, sizeof(unsigned))) == NULL) {
+	    err_exit("add_to_sketch_store: calloc failed, aborting!");
+	}
+	for (idx=0; idx<storeptr->numkeys; idx++) {
+	    countertbl[MAX(storeptr->minkey+idx, minkey)-minkey] += storeptr->countertbl[idx];
+	}
+	free(storeptr->countertbl);
+	storeptr->countertbl = countertbl;
+	storeptr->minkey     = minkey;
+	storeptr->numkeys    = maxkey-minkey+1;
+    }
+    storeptr->countertbl[key-storeptr->minkey] += number;
+}
+
+void add_to_sketch(Sketch *sketchptr, double value) {
+    if (value > SKETCHMINVALUE) {
+	add_to_sketch_store(&sketchptr->positive, sketch_key(value), 1);
+    } else if (value < -SKETCHMINVALUE) {
+	add_to_sketch_store(&sketchptr->negative, sketch_key(-value), 1);
+    } else {
+	sketchptr->zeroctr++;
+    }
+}
+
+void merge_sketch_store(Sketchstore *storeptr, Sketchstore *otherptr) {
+    int		idx;
+
+    for (idx=0; idx<otherptr->numkeys; idx++) {
+	if (otherptr->countertbl[idx] > 0) {
+	    add_to_sketch_store(storeptr, otherptr->minkey+idx, otherptr->countertbl[idx]);
+	}
+    }
+}
+
+void merge_sketch(Sketch *sketchptr, Sketch *otherptr) {
+    merge_sketch_store(&sketchptr->positive, &otherptr->positive);
+    merge_sketch_store(&sketchptr->negative, &otherptr->negative);
+    sketchptr->zeroctr += otherptr->zeroctr;
+}
+
+void free_sketch(Sketch *sketchptr) {
+    free(sketchptr->positive.countertbl);
+    free(sketchptr->negative.countertbl);
+    memset(sketchptr, 0, sizeof(Sketch));
+}
+
+/* the (approximate) q quantile (0 <= q <= 1) of the sketch's number values */
+double sketch_quantile(Sketch *sketchptr, int number, double q) {
+    Sketchstore	*storeptr;
+    double	gamma = exp(sketch_log_gamma());
+    double	rank = q*(number-1), ctr = 0;
+    int		idx;
+
+    storeptr = &sketchptr->negative;	/* the most negative values first */
+    for (idx=storeptr->numkeys-1; idx>=0; idx--) {
+	if ((ctr+=storeptr->countertbl[idx]) > rank) {
+	    return -2*pow(gamma, storeptr->minkey+idx)/(gamma+1);
+	}
+    }
+    if ((ctr+=sketchptr->zeroctr) > rank) {
+	return 0;
+    }
+    storeptr = &sketchptr->positive;
+    for (idx=0; idx<storeptr->numkeys; idx++) {
+	if ((ctr+=storeptr->countertbl[idx]) > rank) {
+	    return 2*pow(gamma, storeptr->minkey+idx)/(gamma+1);
+	}
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+Update the (whole run) statistics of a class' metrics and devices with the
+sample rows (flagged by store_*_stanza) of the current data set. Each device's
+samples are copied to (contiguous) samplevaluetbl, and the kernels are plain,
+branch free loops over it. The (threshold) count has its own loop, which gcc
+vectorizes (at -O3, for x86-64-v2 or later); the min and max loop does not (its
+compares must keep NaN's and -0's order, without -ffast-math). The sum is added
+in sample order - as it always was. The mean and m2 (for
+the standard deviation) of the data set are then merged with those so far
+(Chan et al's parallel variance), and the samples are added to the sketch.
+The threshold is in fullscale units: a device's value v is above it if
+fullscale/scale*v > threshold (devices with scale 0 are never above it).
+*******************************************************************************/
+void merge_statistics(int *numberptr, double *meanptr, double *m2ptr, int number,
+							double mean, double m2) {
+    double	delta = mean - *meanptr;
+    double	total = (double)*numberptr + number;
+
+    *meanptr += delta*number/total;
+    *m2ptr   += m2 + delta*delta*(double)*numberptr*number/total;
+    *numberptr += number;
+}
+
+void update_class_statistics(Class *classptr) {
+    static double	*samplevaluetbl = NULL;
+    Metric	*metricptr;
+    Device	*deviceptr;
+    double	min, max, sum, mean, m2, limit, value, *valueptr;
+    int		metricidx, deviceidx, rowidx, numsamples, abovectr, metricnumber;
+
+    if (samplevaluetbl == NULL &&
+		(samplevaluetbl=malloc(count*sizeof(double))) == NULL) {
+	err_exit("update_class_statistics: malloc failed, aborting!");
+    }
+
+    for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	metricptr    = classptr->metrictbl+metricidx;
+	metricnumber = metricptr->number;
+	for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
+	    deviceptr  = metricptr->devicetbl+deviceidx;
+	    numsamples = 0;
+	    for (rowidx=classptr->startrow; rowidx<count; rowidx++) {
+		if (*SAMPLEFLAGPTR(classptr, rowidx, deviceidx)) {
+		    samplevaluetbl[numsamples++] =
+				    *VALUEPTR(classptr, rowidx, metricidx, deviceidx);
+		}
+	    }
+	    if (numsamples == 0) {
+		continue;
+	    }
+
+	    limit = deviceptr->scale > 0 ?
+		    paramtbl[THRESHOLDIDX].value.fltpnt * deviceptr->scale / fullscale : INFINITY;
+	    min = max = samplevaluetbl[0];
+	    for (rowidx=0; rowidx<numsamples; rowidx++) {
+		value = samplevaluetbl[rowidx];
+		min   = value < min ? value : min;
+		max   = value > max ? value : max;
+	    }
+	    abovectr = 0;
+	    for (rowidx=0; rowidx<numsamples; rowidx++) {
+		abovectr += samplevaluetbl[rowidx] > limit;
+	    }
+	    sum = 0;
+	    for (rowidx=0; rowidx<numsamples; rowidx++) {
+		deviceptr->sum += samplevaluetbl[rowidx];
+		sum += samplevaluetbl[rowidx];
+	    }
+	    mean = sum/numsamples;
+	    m2	 = 0;
+	    for (rowidx=0; rowidx<numsamples; rowidx++) {
+		m2 += (samplevaluetbl[rowidx]-mean)*(samplevaluetbl[rowidx]-mean);
+	    }
+	    for (rowidx=0; rowidx<numsamples; rowidx++) {
+		add_to_sketch(&deviceptr->sketch, samplevaluetbl[rowidx]);
+	    }
+
+	    deviceptr->min = deviceptr->number == 0 ? min : MIN(deviceptr->min, min);
+	    deviceptr->max = deviceptr->number == 0 ? max : MAX(deviceptr->max, max);
+	    deviceptr->abovectr += abovectr;
+	    merge_statistics(&deviceptr->number, &deviceptr->mean, &deviceptr->m2,
+							    numsamples, mean, m2);
+
+	    metricptr->min = metricptr->number == 0 ? min : MIN(metricptr->min, min);
+	    metricptr->max = metricptr->number == 0 ? max : MAX(metricptr->max, max);
+	    metricptr->abovectr += abovectr;
+	    merge_statistics(&metricptr->number, &metricptr->mean, &metricptr->m2,
+							    numsamples, mean, m2);
+	}
+
+	/* a metric's sum is added in input (row, then device) order */
+	if (metricptr->number != metricnumber) {
+	    for (rowidx=classptr->startrow; rowidx<count; rowidx++) {
+		valueptr = VALUEPTR(classptr, rowidx, metricidx, 0);
+		for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
+		    if (*SAMPLEFLAGPTR(classptr, rowidx, deviceidx)) {
+			metricptr->sum += valueptr[deviceidx];
+		    }
+		}
+	    }
+	}
+    }
+}
+
+
+/*******************************************************************************
+Output files are written through their own buffers (not stdio): one write()
+each time a buffer fills up, and when the file is closed. At most
+maxopenoutputfiles of them are open at once (so there can be many more multiple
+file output files than ulimit -n). When another one is needed, the least
+recently used (written) one is closed - and later reopened (for append) the
+next time its buffer is flushed. Unless appendflag is set, open_outputfile
+truncates the file if it already exists!!! Filename - is stdout.
+*******************************************************************************/
+void close_outputfile_fd(Outputfile *ofp) {
+    if (close(ofp->fd) != 0) {
+	err_exit("Could not close output file '%s', aborting!", ofp->filename);
+    }
+    ofp->fd = -1;
+    if (ofp->prevptr != NULL) {
+	ofp->prevptr->nextptr = ofp->nextptr;
+    } else {
+	lruheadptr = ofp->nextptr;
+    }
+    if (ofp->nextptr != NULL) {
+	ofp->nextptr->prevptr = ofp->prevptr;
+    } else {
+	lrutailptr = ofp->prevptr;
+    }
+    numopenoutputfiles--;
+}
+
+void use_outputfile_fd(Outputfile *ofp, int flags) {
+    if (ofp->stdoutflag) {
+	return;
+    }
+    if (ofp->fd >= 0) {
+	if (ofp == lruheadptr) {
+	    return;
+	}
+	ofp->prevptr->nextptr = ofp->nextptr;	/* there must be a previous one */
+	if (ofp->nextptr != NULL) {
+	    ofp->nextptr->prevptr = ofp->prevptr;
+	} else {
+	    lrutailptr = ofp->prevptr;
+	}
+    } else {
+	while (numopenoutputfiles >= MAX(maxopenoutputfiles, MINOPENOUTFILES)) {
+	    close_outputfile_fd(lrutailptr);
+	}
+	if ((ofp->fd=open(ofp->filename, flags, 0666)) < 0) {
+	    err_exit("Could not create/open file '%s', aborting!", ofp->filename);
+	}
+	numopenoutputfiles++;
+	outputopenctr++;
+    }
+    ofp->prevptr = NULL;
+    ofp->nextptr = lruheadptr;
+    if (lruheadptr != NULL) {
+	lruheadptr->prevptr = ofp;
+    } else {
+	lrutailptr = ofp;
+    }
+    lruheadptr = ofp;
+}
+
+
+/*******************************************************************************
+--serve: write to a client's socket. A client that has gone away (or is too slow)
+just ends its response - it must not stop (SIGPIPE) or abort pma.
+*******************************************************************************/
+void write_socket(Outputfile *ofp, const char *str, size_t len) {
+    ssize_t	numwritten;
+
+    while (len > 0 && ofp->fd >= 0) {
+	if ((numwritten=send(ofp->fd, str, len, MSG_NOSIGNAL)) < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    ofp->fd = -1;		/* (answer_request closes the socket) */
+	    break;
+	}
+	str += numwritten;
+	len -= numwritten;
+    }
+}
+
+Outputfile* open_outputfile(char *filename, size_t bufsize, int appendflag) {
+    Outputfile	*ofp;
+
+    if ((ofp=malloc(sizeof(Outputfile))) == NULL || (ofp->bufptr=malloc(bufsize)) == NULL ||
+					    (ofp->filename=strdup(filename)) == NULL) {
+	err_exit("open_outputfile: malloc for '%s' failed, aborting!", filename);
+    }
+    ofp->bufsize    = bufsize;
+    ofp->len        = 0;
+    ofp->socketflag = 0;
+    if ((ofp->stdoutflag=!strcmp(filename, STDOUTFILENAME))) {
+	ofp->fd = STDOUT_FILENO;
+    } else {
+	ofp->fd = -1;
+	use_outputfile_fd(ofp, O_WRONLY|O_CREAT|(appendflag ? O_APPEND : O_TRUNC));
+    }
+    return ofp;
+}
+
+void write_outputfile(Outputfile *ofp, const char *str, size_t len) {
+    ssize_t	numwritten;
+
+    if (ofp->socketflag) {
+	write_socket(ofp, str, len);
+	return;
+    }
+    use_outputfile_fd(ofp, O_WRONLY|O_APPEND);
+    while (len > 0) {
+	if ((numwritten=write(ofp->fd, str, len)) < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    err_exit("Could not write output file '%s', aborting!", ofp->filename);
+	}
+	str += numwritten;
+	len -= numwritten;
+	outputbytectr += numwritten;
+    }
+}
+
+void flush_outputfile(Outputfile *ofp) {
+    if (ofp->len > 0) {
+	write_outputfile(ofp, ofp->bufptr, ofp->len);
+	ofp->len = 0;
+    }
+}
+
+void close_outputfile(Outputfile *ofp) {
+    flush_outputfile(ofp);
+    if (ofp->fd >= 0 && !ofp->stdoutflag) {
+	close_outputfile_fd(ofp);
+    }
+    free(ofp->bufptr);
+    free(ofp->filename);
+    free(ofp);
+}
+
+
+/*******************************************************************************
+Append characters, a string or a value (formatted exactly as "%.1f"
+would) to an output file's buffer. For |value| < 10^14, 8*value and 2*value are
+exact and TwoSum gives 10*value exactly (as s+e), so it can be rounded (ties to
+even, like printf) to a whole number of tenths.
+*******************************************************************************/
+void put_string(Outputfile *ofp, const char *str, size_t len) {
+    if (ofp->len+len > ofp->bufsize) {
+	flush_outputfile(ofp);
+	if (len > ofp->bufsize) {
+	    write_outputfile(ofp, str, len);
+	    return;
+	}
+    }
+    memcpy(ofp->bufptr+ofp->len, str, len);
+    ofp->len += len;
+}
+
+void put_char(Outputfile *ofp, char character) {
+    if (ofp->len == ofp->bufsize) {
+	flush_outputfile(ofp);
+    }
+    ofp->bufptr[ofp->len++] = character;
+}
+
+void put_value(Outputfile *ofp, double value) {
+    char		numstr[MAXNUMSTRLEN+DBL_MAX_10_EXP], *numptr;
+    double		absvalue = value < 0 ? -value : value;
+    double		a, b, s, e, floors, diff;
+    unsigned long long	tenths;
+
+    if (!(absvalue < MAXFASTVALUE)) {		/* including inf and nan */
+	put_string(ofp, numstr, snprintf(numstr, sizeof(numstr), "%.1f", value));
+	return;
+    }
+    a = absvalue*8;
+    b = absvalue*2;
+    s = a+b;
+    e = (a-(s-(s-a))) + (b-(s-a));
+    tenths = (unsigned long long)s;		/* floor(s) */
+    floors = (double)tenths;
+    diff = (s-floors) - 0.5;
+    if (diff > 0 || (diff == 0 && (e > 0 || (e == 0 && (tenths&1))))) {
+	tenths++;
+    }
+
+    numptr = numstr+sizeof(numstr);
+    *--numptr = '0' + tenths%10;
+    *--numptr = decimalpointchar;
+    tenths /= 10;
+    do {
+	*--numptr = '0' + tenths%10;
+	tenths /= 10;
+    } while (tenths > 0);
+    if (signbit(value)) {
+	*--numptr = '-';
+    }
+    put_string(ofp, numptr, numstr+sizeof(numstr)-numptr);
+}
+
+
+/*******************************************************************************
+Format the time of row rowidx of the data set with timestamp into timestampstr
+(MAXTMSTPSTRLEN characters, NOT null terminated) using strftime and formatstr.
+Returns its length. All the rows of a data set are interval seconds apart, so
+the first row's broken down time is just updated - localtime is only called
+for every row when there is a DST or day change in the data set. formatstr "%s"
+(the multiple file default) is simply the timestamp itself (format_epoch_time).
+*******************************************************************************/
+int format_epoch_time(char *timestampstr, time_t timestamp) {
+    char		*numptr = timestampstr+MAXTMSTPSTRLEN;
+    unsigned long	abstimestamp;
+
+    abstimestamp = timestamp < 0 ? -(unsigned long)timestamp : (unsigned long)timestamp;
+    do {
+	*--numptr = '0' + abstimestamp%10;
+	abstimestamp /= 10;
+    } while (abstimestamp > 0);
+    if (timestamp < 0) {
+	*--numptr = '-';
+    }
+    memmove(timestampstr, numptr, timestampstr+MAXTMSTPSTRLEN-numptr);
+    return timestampstr+MAXTMSTPSTRLEN-numptr;
+}
+
+int format_row_time(char *timestampstr, char *formatstr, time_t timestamp, int rowidx) {
+    static time_t	cachedtimestamp;
+    static int		cachedflag = 0;
+    static int		samedayflag;
+    static struct tm	firstrowtm;
+    struct tm		rowtm, *tmptr;
+    time_t		rowtimestamp = timestamp+(rowidx+1)*interval;
+    time_t		firstrowtimestamp, lastrowtimestamp;
+    int			seconds, minutes;
+
+    if (!strcmp(formatstr, "%s")) {
+	return format_epoch_time(timestampstr, rowtimestamp);
+    }
+
+    if (!cachedflag || timestamp != cachedtimestamp) {
+	cachedtimestamp   = timestamp;
+	cachedflag        = 1;
+	firstrowtimestamp = timestamp+interval;
+	lastrowtimestamp  = timestamp+count*interval;
+					    /* NOT UTC!!! the collector timezone!!! */
+	firstrowtm = *localtime(&firstrowtimestamp);
+	tmptr = localtime(&lastrowtimestamp);
+	samedayflag = tmptr->tm_isdst == firstrowtm.tm_isdst &&
+		      tmptr->tm_yday  == firstrowtm.tm_yday &&
+		      tmptr->tm_year  == firstrowtm.tm_year;
+    }
+
+    if (samedayflag) {
+	rowtm         = firstrowtm;
+	seconds       = rowtm.tm_sec + rowidx*interval;
+	minutes       = rowtm.tm_min + seconds/60;
+	rowtm.tm_sec  = seconds%60;
+	rowtm.tm_min  = minutes%60;
+	rowtm.tm_hour += minutes/60;
+	tmptr = &rowtm;
+    } else {
+	tmptr = localtime(&rowtimestamp);
+    }
+    return strftime(timestampstr, MAXTMSTPSTRLEN, formatstr, tmptr);
+}
+
+
+/*******************************************************************************
+Write the header (first line) to all of the "active" (scale != 0) metric and
+metric_device files using formatting specified by the relevant paramtbl entry.
+*******************************************************************************/
+void output_singlefile_headers(Outputfile *singlefileptr) {
+    Class	*classptr;
+    Metric	*metricptr;
+    Device	*deviceptr;
+    int		classidx, metricidx, deviceidx;
+
+    put_string(singlefileptr, "Time", 4);
+    for (classidx=0; classidx<numclasses; classidx++) {	/* loop thru classes */
+	classptr = classtbl+classidx;
+	for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	    metricptr = classptr->metrictbl+metricidx;
+
+	    if (classptr->classtype == VECTORCLASS) {
+		deviceptr = metricptr->devicetbl;
+		if (deviceptr->scale != 0) {
+		    deviceptr->singlefileflag  = 1;
+		    deviceptr->singlefilevalue = NAN;
+		    put_char(singlefileptr, paramtbl[SINGFILEDELIMITERIDX].value.character);
+		    put_string(singlefileptr, metricptr->metricname,
+						    strlen(metricptr->metricname));
+		}
+	    } else {
+		for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
+		    deviceptr = metricptr->devicetbl+deviceidx;
+		    if (deviceptr->scale != 0) {
+			deviceptr->singlefileflag  = 1;
+			deviceptr->singlefilevalue = NAN;
+			put_char(singlefileptr,
+				    paramtbl[SINGFILEDELIMITERIDX].value.character);
+			put_string(singlefileptr, metricptr->metricname,
+				    strlen(metricptr->metricname));
+			put_string(singlefileptr, paramtbl[METDEVSEPARATORIDX].value.string,
+				    strlen(paramtbl[METDEVSEPARATORIDX].value.string));
+			put_string(singlefileptr, deviceptr->devicename,
+				    strlen(deviceptr->devicename));
+		    }
+		}
+	    }
+	}
+    }
+    put_char(singlefileptr, '\n');
+}
+
+
+/*******************************************************************************
+Build the output plans: a flat table of the columns of the single file (the
+devices with singlefileflag) and one of the multiple files (the devices with an
+output file) - and, for --serve, one of the devices it stores (scale != 0) - in
+class, metric, device order. Each column has a pointer to its
+value in row 0 (or the bucket), the row stride, the multiplier (fullscale/scale)
+and start row, so the writers just walk a table. The value tables move when
+devices are added, so this is called again (by process_data_set) whenever new
+devices are found.
+*******************************************************************************/
+void add_output_column(Outputcolumn *columnptr, Class *classptr, int metricidx,
+								int deviceidx) {
+    static int	onectr = 1;
+    Device	*deviceptr = classptr->metrictbl[metricidx].devicetbl+deviceidx;
+
+    if (bucketsecs > 0) {
+	columnptr->valueptr	= classptr->bucketvaluetbl+
+					    (size_t)metricidx*classptr->maxdevices+deviceidx;
+	columnptr->rowstride	= 0;
+	columnptr->startrow	= 0;
+	columnptr->samplectrptr	= classptr->bucketctrtbl+deviceidx;
+    } else {
+	columnptr->valueptr	= VALUEPTR(classptr, 0, metricidx, deviceidx);
+	columnptr->rowstride	= (size_t)classptr->nummetrics*classptr->maxdevices;
+	columnptr->startrow	= classptr->startrow;
+	columnptr->samplectrptr	= &onectr;
+    }
+    columnptr->multiplier    = fullscale / deviceptr->scale;
+    columnptr->outputfileptr = deviceptr->outputfileptr;
+    columnptr->deviceptr     = deviceptr;
+}
+
+void build_output_plans() {
+    Class	*classptr;
+    Metric	*metricptr;
+    Device	*deviceptr;
+    int		classidx, metricidx, deviceidx;
+    int		maxcolumns = 0;
+
+    for (classidx=0; classidx<numclasses; classidx++) {
+	classptr = classtbl+classidx;
+	maxcolumns += classptr->nummetrics*classptr->metrictbl->numdevices;
+    }
+    if ((singlecolumntbl=realloc(singlecolumntbl, maxcolumns*sizeof(Outputcolumn))) == NULL ||
+	(multicolumntbl=realloc(multicolumntbl, maxcolumns*sizeof(Outputcolumn))) == NULL ||
+	(servecolumntbl=realloc(servecolumntbl, maxcolumns*sizeof(Outputcolumn))) == NULL) {
+	err_exit("build_output_plans: realloc failed, aborting!");
+    }
+
+    numsinglecolumns = nummulticolumns = numservecolumns = 0;
+    for (classidx=0; classidx<numclasses; classidx++) {
+	classptr = classtbl+classidx;
+	for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	    metricptr = classptr->metrictbl+metricidx;
+	    for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
+		deviceptr = metricptr->devicetbl+deviceidx;
+		if (deviceptr->singlefileflag) {
+		    add_output_column(singlecolumntbl+numsinglecolumns++, classptr,
+							    metricidx, deviceidx);
+		}
+		if (deviceptr->outputfileptr != NULL) {
+		    add_output_column(multicolumntbl+nummulticolumns++, classptr,
+							    metricidx, deviceidx);
+		}
+		if (servesocketname != NULL && deviceptr->scale != 0) {
+		    add_output_column(servecolumntbl+numservecolumns++, classptr,
+							    metricidx, deviceidx);
+		}
+	    }
+	}
+    }
+}
+
+
+/*******************************************************************************
+Write the numrows rows (of the current stanzas, or one bucket) of the single file
+output plan's columns (the active - scale != 0 - metrics and metric_devices) to
+a single file. (Devices first found after the header was written are not in the
+single file.) The time of row rowidx is timestamp+(rowidx+1)*interval. --sparse:
+a value that is the same as the column's last one is not written either - so
+an empty field is unchanged (or has no value), and readers just fill down.
+*******************************************************************************/
+void output_singlefile_body(Outputfile *singlefileptr, time_t timestamp, int numrows) {
+    Outputcolumn *columnptr, *endcolumnptr = singlecolumntbl+numsinglecolumns;
+    int		rowidx;
+    char	delimiter = paramtbl[SINGFILEDELIMITERIDX].value.character;
+    char	timestampstr[MAXTMSTPSTRLEN];
+    double	value;
+
+    for (rowidx=0; rowidx<numrows; rowidx++) {
+	put_string(singlefileptr, timestampstr, format_row_time(timestampstr,
+		    paramtbl[SINGFILEDATEFMTIDX].value.string, timestamp, rowidx));
+	for (columnptr=singlecolumntbl; columnptr<endcolumnptr; columnptr++) {
+	    put_char(singlefileptr, delimiter);
+	    if (rowidx >= columnptr->startrow && *columnptr->samplectrptr != 0) {
+		value = columnptr->multiplier * columnptr->valueptr[rowidx*columnptr->rowstride];
+		if (sparseflag) {
+		    if (value == columnptr->deviceptr->singlefilevalue) {
+			continue;
+		    }
+		    columnptr->deviceptr->singlefilevalue = value;
+		}
+		put_value(singlefileptr, value);
+	    }
+	}
+	put_char(singlefileptr, '\n');
+    }
+}
+
+
+/*******************************************************************************
+The binary (-f binary) single file format is columnar and can be mmap'ed. All
+integers and doubles are in the byte order of the writer (see byteorder), and
+every field is 8 byte aligned. It has one column (of doubles) for each active
+metric (or metric_device) - the same columns as the CSV single file.
+
+  header (40 bytes):
+    char     magic[8]		"PMABIN01"
+    uint32   version		1 (or 2, --sparse)
+    uint32   byteorder		0x01020304 (as written by the writer)
+    uint32   numcolumns
+    uint32   rowsperblock	count (the rows of each data set), or 1 (--bucket)
+    int64    interval		seconds between rows (or the bucket seconds)
+    double   fullscale		a value's CSV equivalent is fullscale/scale*value
+  numcolumns column descriptors (128 bytes each):
+    char     classname[40]	NUL padded
+    char     metricname[40]
+    char     devicename[40]	"" for vector class metrics
+    double   scale		(the values are NOT scaled)
+  then one block per data set, or bucket ((1+numcolumns)*rowsperblock*8 bytes):
+    int64    timestamps[rowsperblock]
+    double   values[numcolumns][rowsperblock]	NaN before the class' startrow
+							(or for no samples)
+
+So block b starts at 40 + 128*numcolumns + b*(1+numcolumns)*rowsperblock*8, and
+the values of column c of block b are a contiguous array of rowsperblock doubles.
+
+Version 2 (--sparse) blocks only have the columns that have changed: a column
+whose rowsperblock values are (bit for bit) the same as in the previous block is
+left out - so the blocks have to be read in order:
+    int64    timestamps[rowsperblock]
+    uint64   changedbits[(numcolumns+63)/64]	bit c%64 of word c/64: column c
+    double   values[changed columns][rowsperblock]	(every column in block 0)
+*******************************************************************************/
+void put_binary_name(Outputfile *ofp, char *name) {
+    char	namestr[BINARYNAMELEN];
+
+    memset(namestr, 0, BINARYNAMELEN);
+    strncpy(namestr, name, BINARYNAMELEN-1);
+    put_string(ofp, namestr, BINARYNAMELEN);
+}
+
+void output_binary_headers(Outputfile *singlefileptr) {
+    Class	*classptr;
+    Metric	*metricptr;
+    Device	*deviceptr;
+    int		classidx, metricidx, deviceidx;
+    uint32_t	uint32tbl[4];
+    int64_t	interval64 = bucketsecs > 0 ? bucketsecs : interval;
+
+    uint32tbl[0] = sparseflag ? BINARYSPARSEVERSION : BINARYVERSION;
+    uint32tbl[1] = BINARYBYTEORDER;
+    uint32tbl[2] = 0;
+    uint32tbl[3] = bucketsecs > 0 ? 1 : count;
+    for (classidx=0; classidx<numclasses; classidx++) {	/* count the columns */
+	classptr = classtbl+classidx;
+	for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	    metricptr = classptr->metrictbl+metricidx;
+	    for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
+		if (metricptr->devicetbl[deviceidx].scale != 0) {
+		    uint32tbl[2]++;
+		}
+	    }
+	}
+    }
+    put_string(singlefileptr, BINARYMAGIC, 8);
+    put_string(singlefileptr, (char*)uint32tbl, sizeof(uint32tbl));
+    put_string(singlefileptr, (char*)&interval64, sizeof(interval64));
+    put_string(singlefileptr, (char*)&fullscale, sizeof(fullscale));
+
+    for (classidx=0; classidx<numclasses; classidx++) {
+	classptr = classtbl+classidx;
+	for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	    metricptr = classptr->metrictbl+metricidx;
+	    for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
+		deviceptr = metricptr->devicetbl+deviceidx;
+		if (deviceptr->scale != 0) {
+		    deviceptr->singlefileflag = 1;
+		    put_binary_name(singlefileptr, classptr->classname);
+		    put_binary_name(singlefileptr, metricptr->metricname);
+		    put_binary_name(singlefileptr, classptr->classtype == VECTORCLASS ?
+							"" : deviceptr->devicename);
+		    put_string(singlefileptr, (char*)&deviceptr->scale, sizeof(double));
+		}
+	    }
+	}
+    }
+}
+
+
+/*******************************************************************************
+Write the block of the current data set (or bucket) to a binary single file.
+--sparse: the block's columns are gathered into blocktbl, compared with those of
+the previous block (lastblocktbl), and only the changed ones are written.
+*******************************************************************************/
+void output_sparse_binary_body(Outputfile *singlefileptr, int numrows) {
+    static double	*blocktbl = NULL, *lastblocktbl = NULL;
+    static uint64_t	*changedbittbl;
+    double		*valueptr, *tmpptr;
+    int			columnidx, rowidx, firstblockflag = blocktbl == NULL;
+    int			numwords = (numsinglecolumns+63)/64;
+    Outputcolumn	*columnptr;
+
+    if (firstblockflag && ((blocktbl=malloc(2*(size_t)numsinglecolumns*numrows*
+								sizeof(double)+1)) == NULL ||
+		(changedbittbl=malloc(numwords*sizeof(uint64_t)+1)) == NULL)) {
+	err_exit("output_sparse_binary_body: malloc failed, aborting!");
+    }
+    if (firstblockflag) {
+	lastblocktbl = blocktbl+(size_t)numsinglecolumns*numrows;
+    }
+
+    memset(changedbittbl, 0, numwords*sizeof(uint64_t));
+    for (columnidx=0; columnidx<numsinglecolumns; columnidx++) {
+	columnptr = singlecolumntbl+columnidx;
+	valueptr  = blocktbl+(size_t)columnidx*numrows;
+	for (rowidx=0; rowidx<numrows; rowidx++) {
+	    valueptr[rowidx] = rowidx >= columnptr->startrow && *columnptr->samplectrptr != 0 ?
+			    columnptr->valueptr[rowidx*columnptr->rowstride] : NAN;
+	}
+	if (firstblockflag || memcmp(valueptr, lastblocktbl+(size_t)columnidx*numrows,
+							    numrows*sizeof(double))) {
+	    changedbittbl[columnidx/64] |= (uint64_t)1 << columnidx%64;
+	}
+    }
+
+    put_string(singlefileptr, (char*)changedbittbl, numwords*sizeof(uint64_t));
+    for (columnidx=0; columnidx<numsinglecolumns; columnidx++) {
+	if (changedbittbl[columnidx/64] & (uint64_t)1 << columnidx%64) {
+	    put_string(singlefileptr, (char*)(blocktbl+(size_t)columnidx*numrows),
+							    numrows*sizeof(double));
+	}
+    }
+    tmpptr       = lastblocktbl;
+    lastblocktbl = blocktbl;
+    blocktbl     = tmpptr;
+}
+
+void output_binary_body(Outputfile *singlefileptr, time_t timestamp, int numrows) {
+    Outputcolumn *columnptr, *endcolumnptr = singlecolumntbl+numsinglecolumns;
+    int		rowidx;
+    int64_t	rowtimestamp;
+    double	nan = NAN;
+
+    for (rowidx=0; rowidx<numrows; rowidx++) {
+	rowtimestamp = timestamp+(rowidx+1)*interval;
+	put_string(singlefileptr, (char*)&rowtimestamp, sizeof(rowtimestamp));
+    }
+    if (sparseflag) {
+	output_sparse_binary_body(singlefileptr, numrows);
+	return;
+    }
+    for (columnptr=singlecolumntbl; columnptr<endcolumnptr; columnptr++) {
+	for (rowidx=0; rowidx<numrows; rowidx++) {
+	    put_string(singlefileptr, (char*)(rowidx >= columnptr->startrow &&
+			    *columnptr->samplectrptr != 0 ?
+			    columnptr->valueptr+rowidx*columnptr->rowstride : &nan),
+								sizeof(double));
+	}
+    }
+}
+
+
+/*******************************************************************************
+Open one multi file output file. (It will be truncated if it already exists!!!)
+*******************************************************************************/
+FILE* open_multifile(char* filerelpath) {
+    FILE	*fileptr;
+
+    if ((fileptr=fopen(filerelpath, "w")) == NULL) {
+	err_exit("Could not create/open file '%s', aborting!", filerelpath);
+    }
+    return fileptr;
+}
+
+
+/*******************************************************************************
+If the multifiledirname directory does not exist, create it. Then open a multi
+output file for each metric (and metric_device) whose scale is not zero. If the
+file already exists, truncate it (or, for --incremental, append to the files of
+the previous run). This is called again whenever new devices are found, and
+then only opens files for those (not already open) devices.
+*******************************************************************************/
+void prepare_multi_output_files(char *multifiledirname) {
+    char	filerelpath[MAXPATHNAMELEN], formatstr[MAXFORMATSTRLEN];
+    char	headerstr[MAXPATHNAMELEN];
+    char	*metric_device_name;
+    struct stat	statbuf;
+    Class	*classptr;
+    Metric	*metricptr;
+    Device	*deviceptr;
+    int		classidx, metricidx, deviceidx;
+
+    if (multifiledirname == NULL) {
+	return;
+    }
+
+    if (stat(multifiledirname, &statbuf) != 0) {	/* if multifiledirname does not exist, */
+	if (mkdir(multifiledirname, MULTIDIRMODE) != 0) {	/* create it */
+	    err_exit("Could not create/open directory '%s', aborting!", multifiledirname);
+	}
+	stat(multifiledirname, &statbuf);		/* and get it's details */
+    }
+
+    if ((statbuf.st_mode&S_IFMT) != S_IFDIR || (statbuf.st_mode&S_IWUSR) == 0) {
+	fprintf(stderr, "'%s' is not a writable directory, aborting\n", multifiledirname);
+	exit(1);
+    }
+
+    for (classidx=0; classidx<numclasses; classidx++) {	/* loop through the classes */
+	classptr = classtbl+classidx;
+	for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	    metricptr=classptr->metrictbl+metricidx;
+	    if (classptr->classtype == VECTORCLASS) {
+		deviceptr = metricptr->devicetbl;
+		if (deviceptr->scale != 0 && deviceptr->outputfileptr == NULL) {
+		    sprintf(filerelpath, "%s/%s", multifiledirname, metricptr->metricname);
+		    deviceptr->outputfileptr = open_outputfile(filerelpath, MULTIOUTBUFSIZE,
+							    deviceptr->appendflag);
+		    if (deviceptr->appendflag) {
+			continue;
+		    }
+		    deviceptr->appendflag = 1;
+		    sprintf(formatstr, "%s\n", paramtbl[MULTIFILEHEADERFMTIDX].value.string);
+		    put_string(deviceptr->outputfileptr, headerstr, MIN(MAXPATHNAMELEN-1,
+				snprintf(headerstr, MAXPATHNAMELEN, formatstr,
+				    metricptr->metricname, deviceptr->scale)));
+		}
+	    } else {
+		for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
+		    deviceptr = metricptr->devicetbl+deviceidx;
+		    if (deviceptr->scale != 0 && deviceptr->outputfileptr == NULL) {
+			sprintf(filerelpath, "%s/%s%s%s", multifiledirname, metricptr->metricname,
+				    paramtbl[METDEVSEPARATORIDX].value.string,
+				    deviceptr->devicename);
+			deviceptr->outputfileptr = open_outputfile(filerelpath,
+					    MULTIOUTBUFSIZE, deviceptr->appendflag);
+			if (deviceptr->appendflag) {
+			    continue;
+			}
+			deviceptr->appendflag = 1;
+			metric_device_name = format_metric_device_name(metricptr, deviceptr->devicename);
+			sprintf(formatstr, "%s\n", paramtbl[MULTIFILEHEADERFMTIDX].value.string);
+			put_string(deviceptr->outputfileptr, headerstr, MIN(MAXPATHNAMELEN-1,
+				    snprintf(headerstr, MAXPATHNAMELEN, formatstr,
+					metric_device_name, deviceptr->scale)));
+		    }
+		}
+	    }
+	}
+    }
+    if (clockticksfileptr == NULL) {
+	sprintf(filerelpath, "%s/%s", multifiledirname,
+				    paramtbl[CLOCKTICKSFILENAMEIDX].value.string);
+	clockticksfileptr = open_multifile(filerelpath);
+    }
+}
+
+
+/*******************************************************************************
+Write the numrows rows (of the current stanzas, or one bucket) of the multiple
+files output plan's columns (the active - scale != 0 - metrics and
+metric_devices) to their multiple file output files. --sparse: only the first
+and last points of each run of the same value are written (the last one once
+the value changes, or by output_skipped_point at the end), so the lines drawn
+(by gnuplot, as steps or not) are the same - but an idle device is just two.
+*******************************************************************************/
+void output_point(Outputfile *ofp, char *timestampstr, int timestampstrlen, double value) {
+    put_string(ofp, timestampstr, timestampstrlen);
+    put_char(ofp, paramtbl[MULTIFILEDELIMITERIDX].value.character);
+    put_value(ofp, value);
+    put_char(ofp, '\n');
+}
+
+void output_skipped_point(Device *deviceptr) {
+    char	timestampstr[MAXTMSTPSTRLEN];
+
+    if (deviceptr->skippedrowidx >= 0) {
+	output_point(deviceptr->outputfileptr, timestampstr, format_row_time(timestampstr,
+		    paramtbl[MULTIFILEDATEFMTIDX].value.string, deviceptr->skippedtimestamp,
+		    deviceptr->skippedrowidx), deviceptr->multifilevalue);
+	deviceptr->skippedrowidx = -1;
+    }
+}
+
+void output_multifile_bodies_data(time_t timestamp, int numrows) {
+    Outputcolumn *columnptr, *endcolumnptr = multicolumntbl+nummulticolumns;
+    Device	*deviceptr;
+    int		rowidx;
+    char	timestampstr[MAXTMSTPSTRLEN];
+    int		timestampstrlen;
+    double	value;
+
+    for (rowidx=0; rowidx<numrows; rowidx++) {
+	timestampstrlen = format_row_time(timestampstr,
+		    paramtbl[MULTIFILEDATEFMTIDX].value.string, timestamp, rowidx);
+	for (columnptr=multicolumntbl; columnptr<endcolumnptr; columnptr++) {
+	    if (rowidx >= columnptr->startrow && *columnptr->samplectrptr != 0) {
+		value = columnptr->multiplier * columnptr->valueptr[rowidx*columnptr->rowstride];
+		if (sparseflag) {
+		    deviceptr = columnptr->deviceptr;
+		    if (value == deviceptr->multifilevalue) {
+			deviceptr->skippedtimestamp = timestamp;
+			deviceptr->skippedrowidx    = rowidx;
+			continue;
+		    }
+		    output_skipped_point(deviceptr);
+		    deviceptr->multifilevalue = value;
+		}
+		output_point(columnptr->outputfileptr, timestampstr, timestampstrlen, value);
+	    }
+	}
+    }
+}
+
+
+/*******************************************************************************
+Clockticks is a special "extra" multiple file output file that contains data
+that is useful for visualizing the time scale for graphical utilities that don't
+handle a time axis well (such as xgraph).
+
+A tick's time of day (and its broken down time, for strftime) is worked out
+from the table of the local days from begtimestamp to endtimestamp - each one's
+start (local midnight, or a DST - UTC offset - change, found by bisection) and
+broken down time then - so localtime is called a few times a day, not for every
+tick. The lines are written through a buffer of CLOCKTICKSBUFSIZE characters.
+
+populate_clockticks runs in its own thread, from the first data set on: it
+writes the ticks up to (a bit after) clocktickstimestamp, then waits for the
+main thread to output more data sets, until clockticksdoneflag. If the last
+data set is earlier than ticks already written (the input went back in time),
+the file is written again, so it is the same as if it were written at the end.
+*******************************************************************************/
+int seconds_of_day(struct tm *tmptr) {
+    return 3600*tmptr->tm_hour + 60*tmptr->tm_min + tmptr->tm_sec;
+}
+
+/* is t in the local day (or part day) starting at localdayptr (no DST change)? */
+int in_local_day(Localday *localdayptr, time_t timestamp) {
+    struct tm	tmbuf;
+
+    localtime_r(&timestamp, &tmbuf);
+    return tmbuf.tm_yday  == localdayptr->tm.tm_yday &&
+	   tmbuf.tm_isdst == localdayptr->tm.tm_isdst &&
+	   seconds_of_day(&tmbuf) == seconds_of_day(&localdayptr->tm) +
+						    timestamp-localdayptr->timestamp;
+}
+
+int build_local_days(time_t begtimestamp, time_t endtimestamp, Localday **localdaytblptr) {
+    Localday	*localdaytbl = NULL, *localdayptr;
+    struct tm	tmbuf;
+    time_t	timestamp, nexttimestamp, lowtimestamp, midtimestamp;
+    int		numdays = 0, maxdays = 0;
+
+    for (timestamp=begtimestamp; timestamp<=endtimestamp; timestamp=nexttimestamp) {
+	if (numdays == maxdays) {
+	    maxdays = MAX(MINLOCALDAYS, 2*maxdays);
+	    if ((localdaytbl=realloc(localdaytbl, maxdays*sizeof(Localday))) == NULL) {
+		err_exit("build_local_days: realloc failed, aborting!");
+	    }
+	}
+	localdayptr = localdaytbl+numdays++;
+	localdayptr->timestamp = timestamp;
+	localtime_r(&timestamp, &localdayptr->tm);
+
+	nexttimestamp = timestamp+24*60*60-seconds_of_day(&localdayptr->tm);
+	localtime_r(&nexttimestamp, &tmbuf);
+	if (seconds_of_day(&tmbuf) != 0 || tmbuf.tm_isdst != localdayptr->tm.tm_isdst) {
+	    lowtimestamp = timestamp;		/* the change is after low, at or before next */
+	    while (nexttimestamp-lowtimestamp > 1) {
+		midtimestamp = lowtimestamp+(nexttimestamp-lowtimestamp)/2;
+		if (in_local_day(localdayptr, midtimestamp)) {
+		    lowtimestamp = midtimestamp;
+		} else {
+		    nexttimestamp = midtimestamp;
+		}
+	    }
+	}
+    }
+    *localdaytblptr = localdaytbl;
+    return numdays;
+}
+
+void populate_clockticks() {
+    char	formatstr[MAXFORMATSTRLEN], timestampstr[MAXTMSTPSTRLEN];
+    char	levelstrtbl[NUMCLOCKTICKSLEVELS][MAXNUMSTRLEN];
+    char	*bufptr, *datefmtstr = paramtbl[MULTIFILEDATEFMTIDX].value.string;
+    time_t	clockticktbl[NUMCLOCKTICKSLEVELS], begtimestamp, endtimestamp, timestamp;
+    struct tm	tickstructbuf;
+    Localday	*localdaytbl, *localdayptr;
+    Param	*paramptr;
+    int		paramidx, levelidx, clockticktime, numdays, dayidx = 0;
+    int		levelctr = 0, epochflag = !strcmp(datefmtstr, "%s"), doneflag;
+    size_t	buflen = 0, timestampstrlen, levelstrlen;
+    time_t	minclocktick = 10*365*24*60*60;	/* insanely unusably large value */
+
+    for (paramidx=CLOCKTICKSLEV0IDX; paramidx<=CLOCKTICKSLEV7IDX; paramidx++) {
+	paramptr = paramtbl+paramidx;
+	if (paramptr->value.longint > 0) {
+	    clockticktbl[levelctr] = paramptr->value.longint;
+	    minclocktick = MIN(paramptr->value.longint, minclocktick);
+
+	    /* ensure all non-zero clocktick levels are multiples of each other */
+	    if (levelctr > 0 && (clockticktbl[levelctr-1] % clockticktbl[levelctr] != 0)) {
+		fprintf(stderr,
+			"clockticks level %d (%ld) is not a multple of level %d (%ld)\n",
+			levelctr-1, clockticktbl[levelctr-1], levelctr, clockticktbl[levelctr]);
+		return;
+	    }
+	    levelctr++;
+	} else {	/* exit at first non-positive value */
+	    break;
+	}
+    }
+    if (levelctr == 0) {
+	fprintf(stderr, "No valid clockticks levels specified!\n");
+    }
+    for (levelidx=0; levelidx<levelctr; levelidx++) {
+	snprintf(levelstrtbl[levelidx], MAXNUMSTRLEN, " %d\n", 2*(levelidx-levelctr));
+    }
+    if ((bufptr=malloc(CLOCKTICKSBUFSIZE)) == NULL) {
+	err_exit("populate_clockticks: malloc failed, aborting!");
+    }
+
+    sprintf(formatstr, "%s\n", paramtbl[MULTIFILEHEADERFMTIDX].value.string);
+    fprintf(clockticksfileptr, formatstr, paramtbl[CLOCKTICKSFILENAMEIDX].value.string,
+									    fullscale);
+    /* Begin the clockticks a bit before the first data, and ... */
+    begtimestamp = timestamp = firsttimestamp/minclocktick*minclocktick;
+    do {
+	pthread_mutex_lock(&clockticksmutex);
+	while (!clockticksdoneflag &&
+		((clocktickstimestamp+count*interval)/minclocktick+1)*minclocktick < timestamp) {
+	    pthread_cond_wait(&clocktickscond, &clockticksmutex);
+	}
+	doneflag = clockticksdoneflag;
+	/* end them a bit after the last data (so far) */
+	endtimestamp = ((clocktickstimestamp+count*interval)/minclocktick+1)*minclocktick;
+	pthread_mutex_unlock(&clockticksmutex);
+
+	if (doneflag && endtimestamp < timestamp-minclocktick) {	/* (start again) */
+	    rewind(clockticksfileptr);
+	    if (ftruncate(fileno(clockticksfileptr), 0) != 0) {
+		err_exit("Could not truncate output file '%s', aborting!",
+				    paramtbl[CLOCKTICKSFILENAMEIDX].value.string);
+	    }
+	    fprintf(clockticksfileptr, formatstr,
+			paramtbl[CLOCKTICKSFILENAMEIDX].value.string, fullscale);
+	    buflen    = 0;
+	    timestamp = begtimestamp;
+	}
+	numdays = build_local_days(timestamp, endtimestamp, &localdaytbl);
+	dayidx	= 0;
+	for (; timestamp<=endtimestamp; timestamp+=minclocktick) {
+	    while (dayidx < numdays-1 && localdaytbl[dayidx+1].timestamp <= timestamp) {
+		dayidx++;
+	    }
+	    localdayptr   = localdaytbl+dayidx;
+	    clockticktime = seconds_of_day(&localdayptr->tm) + timestamp-localdayptr->timestamp;
+	    for (levelidx=0; levelidx<levelctr; levelidx++) {
+		if (clockticktime % clockticktbl[levelidx] == 0) {
+		    if (epochflag) {
+			timestampstrlen = format_epoch_time(timestampstr, timestamp);
+		    } else {
+			tickstructbuf	  = localdayptr->tm;
+			tickstructbuf.tm_hour = clockticktime/3600;
+			tickstructbuf.tm_min  = clockticktime/60%60;
+			tickstructbuf.tm_sec  = clockticktime%60;
+			timestampstrlen = strftime(timestampstr, MAXTMSTPSTRLEN, datefmtstr,
+								    &tickstructbuf);
+		    }
+		    levelstrlen = strlen(levelstrtbl[levelidx]);
+		    if (buflen+2*timestampstrlen+levelstrlen+3 > CLOCKTICKSBUFSIZE) {
+			fwrite(bufptr, 1, buflen, clockticksfileptr);
+			buflen = 0;
+		    }
+		    memcpy(bufptr+buflen, timestampstr, timestampstrlen);
+		    memcpy(bufptr+buflen+timestampstrlen, " 0\n", 3);
+		    buflen += timestampstrlen+3;
+		    memcpy(bufptr+buflen, timestampstr, timestampstrlen);
+		    memcpy(bufptr+buflen+timestampstrlen, levelstrtbl[levelidx], levelstrlen);
+		    buflen += timestampstrlen+levelstrlen;
+		    break;
+		}
+	    }
+	}
+	free(localdaytbl);
+    } while (!doneflag);
+    fwrite(bufptr, 1, buflen, clockticksfileptr);
+    if (fclose(clockticksfileptr) != 0) {
+	err_exit("Could not close output file '%s', aborting!",
+				    paramtbl[CLOCKTICKSFILENAMEIDX].value.string);
+    }
+    clockticksfileptr = NULL;
+    free(bufptr);
+}
+
+
+/*******************************************************************************
+Open the single file output file, if one has been specified. (When resuming an
+--incremental run, append to it: its header, and columns, are already set.)
+*******************************************************************************/
+Outputfile* prepare_single_output_file(char *singlefilename) {
+    Outputfile	*singlefileptr = NULL;
+
+    if (singlefilename != NULL && statefileptr != NULL && statefileptr->resumeflag) {
+	singlefileptr = open_outputfile(singlefilename, SINGLEOUTBUFSIZE, 1);
+    } else if (singlefilename != NULL) { /* will be truncated if it exists!!! */
+	singlefileptr = open_outputfile(singlefilename, SINGLEOUTBUFSIZE, 0);
+	if (singlefileformat == BINARYFORMAT) {
+	    output_binary_headers(singlefileptr);
+	} else {
+	    output_singlefile_headers(singlefileptr);
+	}
+    }
+    return singlefileptr;
+}
+
+
+/*******************************************************************************
+Called once the first data set has been read (so that the devices of the array
+classes are known): read the configuration file, then create/open the output
+files, write their headers, and build the output plans.
+*******************************************************************************/
+void initialize_outputs(char *singlefilename, Outputfile **singlefileptrptr,
+							    char *multifiledirname) {
+    if (configfilename != NULL) {
+	read_configfile();	/* optionally sets TZ  */
+    }
+    if (numincludes+numexcludes > 0) {
+	deselect_devices();
+    }
+    *singlefileptrptr = prepare_single_output_file(singlefilename);
+    prepare_multi_output_files(multifiledirname);
+    build_output_plans();
+}
+
+
+/*******************************************************************************
+Flush (write the buffered data of) and close all of the output files.
+*******************************************************************************/
+void close_output_files(Outputfile *singlefileptr) {
+    Class	*classptr;
+    Metric	*metricptr;
+    Device	*deviceptr;
+    int		classidx, metricidx, deviceidx;
+
+    if (singlefileptr != NULL) {
+	close_outputfile(singlefileptr);
+    }
+    for (classidx=0; classidx<numclasses; classidx++) {
+	classptr = classtbl+classidx;
+	for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	    metricptr = classptr->metrictbl+metricidx;
+	    for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
+		deviceptr = metricptr->devicetbl+deviceidx;
+		if (deviceptr->outputfileptr != NULL) {
+		    output_skipped_point(deviceptr);		/* (--sparse) */
+		    close_outputfile(deviceptr->outputfileptr);
+		    deviceptr->outputfileptr = NULL;
+		}
+	    }
+	}
+    }
+}
+
+
+/*******************************************************************************
+Write the buffered data of all of the output files (--follow).
+*******************************************************************************/
+void flush_output_files(Outputfile *singlefileptr) {
+    Class	*classptr;
+    Metric	*metricptr;
+    Device	*deviceptr;
+    int		classidx, metricidx, deviceidx;
+
+    if (singlefileptr != NULL) {
+	flush_outputfile(singlefileptr);
+    }
+    for (classidx=0; classidx<numclasses; classidx++) {
+	classptr = classtbl+classidx;
+	for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	    metricptr = classptr->metrictbl+metricidx;
+	    for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
+		deviceptr = metricptr->devicetbl+deviceidx;
+		if (deviceptr->outputfileptr != NULL) {
+		    flush_outputfile(deviceptr->outputfileptr);
+		}
+	    }
+	}
+    }
+}
+
+
+/*******************************************************************************
+--max-memory: the pages of an mmap'ed input file stay resident (and in the RSS)
+once they have been read, so a year's input file would need as much memory.
+Every MAX(MINRELEASESIZE, maxmemory/8) bytes, the (whole) pages before the
+current data set are released - they are not used again. (If --incremental or
+--follow move back to them, they are just read from the file again.)
+*******************************************************************************/
+void release_input_pages(Inputfile *ifp) {
+#ifdef MADV_DONTNEED
+    size_t	pagesize = sysconf(_SC_PAGESIZE);
+    size_t	readsize = (ifp->curptr-ifp->bufptr)/pagesize*pagesize;
+
+    if (ifp->mappedflag && maxmemory > 0 &&
+			readsize >= ifp->releasedsize+MAX(MINRELEASESIZE, maxmemory/8)) {
+	madvise(ifp->bufptr+ifp->releasedsize, readsize-ifp->releasedsize, MADV_DONTNEED);
+	ifp->releasedsize = readsize;
+    }
+#else
+    (void)ifp;
+#endif
+}
+
+
+/*******************************************************************************
+Return the peak memory use (the maximum resident set size) in K bytes.
+*******************************************************************************/
+long peak_memory_kbytes() {
+    struct rusage	rusagebuf;
+
+    if (getrusage(RUSAGE_SELF, &rusagebuf) != 0) {
+	return 0;
+    }
+#ifdef __APPLE__
+    return rusagebuf.ru_maxrss/1024;		/* (bytes, not K bytes) */
+#else
+    return rusagebuf.ru_maxrss;
+#endif
+}
+
+
+/*******************************************************************************
+Return the time of a clock (e.g., CLOCK_MONOTONIC) in seconds.
+*******************************************************************************/
+double clock_seconds(clockid_t clockid) {
+    struct timespec	timespecbuf;
+
+    clock_gettime(clockid, &timespecbuf);
+    return timespecbuf.tv_sec + timespecbuf.tv_nsec/1e9;
+}
+
+
+/*******************************************************************************
+--stats: add the wall and (main thread) CPU time since the current phase
+started to its totals, and start the given phase. Only the main thread changes
+phases: with -j, parse is the time spent waiting for the parsing threads.
+*******************************************************************************/
+void start_phase(int phase) {
+    double	now, cpunow;
+
+    if (statsformat == NOSTATS) {
+	return;
+    }
+    now    = clock_seconds(CLOCK_MONOTONIC);
+    cpunow = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+    phasesecstbl[currentphase]    += now-phasestarttime;
+    phasecpusecstbl[currentphase] += cpunow-phasecpustarttime;
+    phasestarttime    = now;
+    phasecpustarttime = cpunow;
+    currentphase = phase;
+}
+
+
+/*******************************************************************************
+The clockticks thread: populate the clockticks file while the main thread reads
+and outputs the data sets (and then closes the other output files). It starts
+once the first data set (firsttimestamp) is known. It only reads the (by then
+unchanging) parameters, and uses localtime_r. The main thread tells it the
+timestamp of the latest data set output - once a day (CLOCKTICKSSECS) of them,
+and of the last one (doneflag) when the input has all been read.
+*******************************************************************************/
+void* populate_clockticks_thread(void *argptr) {
+    (void)argptr;
+    populate_clockticks();
+    clocktickscpusecs = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+    return NULL;
+}
+
+void start_clockticks_thread(time_t timestamp) {
+    if (clockticksfileptr == NULL) {		/* (no multiple files) */
+	return;
+    }
+    clocktickstimestamp	    = timestamp;
+    clockticksnexttimestamp = timestamp+CLOCKTICKSSECS;
+    if ((errno=pthread_create(&clockticksthread, NULL, populate_clockticks_thread,
+								    NULL)) != 0) {
+	err_exit("pthread_create failed, aborting!");
+    }
+    clockticksthreadflag = 1;
+}
+
+void update_clockticks_thread(time_t timestamp, int doneflag) {
+    if (!clockticksthreadflag || (!doneflag && timestamp < clockticksnexttimestamp)) {
+	return;
+    }
+    pthread_mutex_lock(&clockticksmutex);
+    clocktickstimestamp = timestamp;
+    clockticksdoneflag  = doneflag;
+    pthread_cond_signal(&clocktickscond);
+    pthread_mutex_unlock(&clockticksmutex);
+    clockticksnexttimestamp = timestamp+CLOCKTICKSSECS;
+}
+
+
+/*******************************************************************************
+--stats: count the input lines, stanzas, values and bad lines of a (parsed)
+data set that is about to be stored.
+*******************************************************************************/
+void count_data_set(Dataset *datasetptr) {
+    Stanza	*stanzaptr;
+    int		stanzaidx, rowidx;
+
+    inputbytectr += datasetptr->endoffset-datasetptr->startoffset;
+    inputlinectr += datasetptr->endlinectr-datasetptr->startlinectr;
+    inputrowctr  += count;
+    stanzactr++;				/* DATE */
+    for (stanzaidx=0; stanzaidx<datasetptr->numstanzas; stanzaidx++) {
+	stanzaptr = datasetptr->stanzatbl+stanzaidx;
+	stanzactr += stanzaptr->numrows > 0;
+	for (rowidx=0; rowidx<stanzaptr->numrows; rowidx++) {
+	    if (stanzaptr->goodflagtbl[rowidx]) {
+		valuectr += classtbl[datasetptr->firstclassidx+stanzaidx].nummetrics;
+	    } else {
+		badlinectr++;
+	    }
+	}
+    }
+}
+
+
+/*******************************************************************************
+--stats: output a phase's wall and CPU time, and the input data set bytes and
+rows processed per (wall) second of it.
+*******************************************************************************/
+void output_phase_stats(char *phasename, double secs, double cpusecs, int lastflag) {
+    if (statsformat == JSONSTATS) {
+	fprintf(stderr, "\"%s\": {\"wall\": %.6f, \"cpu\": %.6f, \"mbps\": %.3f, \"rowsps\": %.1f}%s",
+			phasename, secs, cpusecs, secs > 0.0 ? inputbytectr/1e6/secs : 0.0,
+			secs > 0.0 ? inputrowctr/secs : 0.0, lastflag ? "}, " : ", ");
+    } else if (secs > 0.0) {
+	fprintf(stderr, "# %-12s %11.3f %11.3f %13.1f %15.0f\n", phasename, secs, cpusecs,
+				    inputbytectr/1e6/secs, inputrowctr/secs);
+    } else {
+	fprintf(stderr, "# %-12s %11.3f %11.3f %13s %15s\n", phasename, secs, cpusecs,
+								    "-", "-");
+    }
+}
+
+
+/*******************************************************************************
+--stats: output (to stderr) the time taken by each phase, and in total (the
+total CPU time includes the parsing threads), and the counters - as a table,
+or as one line of JSON.
+*******************************************************************************/
+void output_stats() {
+    double	totalsecs = 0.0;
+    struct rusage rusagebuf;
+    int		phase;
+
+    start_phase(currentphase);
+    if (statsformat == JSONSTATS) {
+	fprintf(stderr, "{\"phases\": {");
+    } else {
+	fprintf(stderr, "### Stats ######## Wall s ###### CPU s ######### MB/s ######### Rows/s\n");
+    }
+    for (phase=0; phase<NUMPHASES; phase++) {
+	output_phase_stats(phasenametbl[phase], phasesecstbl[phase], phasecpusecstbl[phase],
+								phase == NUMPHASES-1);
+	totalsecs += phasesecstbl[phase];
+    }
+    getrusage(RUSAGE_SELF, &rusagebuf);
+    output_phase_stats("total", totalsecs, rusagebuf.ru_utime.tv_sec+rusagebuf.ru_stime.tv_sec
+	    + (rusagebuf.ru_utime.tv_usec+rusagebuf.ru_stime.tv_usec)/1e6, 0);
+
+    if (statsformat == JSONSTATS) {
+	fprintf(stderr, "\"inputfiles\": %d, \"inputbytes\": %.0f, \"lines\": %.0f, "
+		"\"stanzas\": %.0f, \"rows\": %.0f, \"values\": %.0f, \"badlines\": %.0f, "
+		"\"badvalues\": %d, \"byteswritten\": %.0f, \"filesopened\": %d}\n",
+		inputfilectr, inputbytectr, inputlinectr, stanzactr, inputrowctr, valuectr,
+		badlinectr, badvaluectr, outputbytectr, outputopenctr);
+    } else {
+	fprintf(stderr, "# input files   %14d\n",   inputfilectr);
+	fprintf(stderr, "# input bytes   %14.0f\n", inputbytectr);
+	fprintf(stderr, "# lines         %14.0f\n", inputlinectr);
+	fprintf(stderr, "# stanzas       %14.0f\n", stanzactr);
+	fprintf(stderr, "# rows          %14.0f\n", inputrowctr);
+	fprintf(stderr, "# values        %14.0f\n", valuectr);
+	fprintf(stderr, "# bad lines     %14.0f\n", badlinectr);
+	fprintf(stderr, "# bad values    %14d\n",   badvaluectr);
+	fprintf(stderr, "# bytes written %14.0f\n", outputbytectr);
+	fprintf(stderr, "# files opened  %14d\n",   outputopenctr);
+    }
+}
+
+
+/*******************************************************************************
+--from: the DATE index (sidecar) file of an input file (named inputfile.idx) has
+the timestamp, offset and line number of every DATE stanza in it. Read it into
+*dateentrytblptr. Returns the number of entries (0 if there is no index).
+*******************************************************************************/
+int read_date_index(char *indexfilename, Dateentry **dateentrytblptr) {
+    Inputfile	*ifp;
+    Dateentry	*dateentryptr;
+    char	*lineptr, *lineendptr;
+    Token	argtbl[NUMINDEXARGS+1];
+    int		numentries = 0, maxentries = 0;
+
+    *dateentrytblptr = NULL;
+    if ((ifp=open_inputfile(indexfilename)) == NULL) {
+	return 0;
+    }
+    skip_to_stanza(ifp, INDEXSTR, 0);
+    while ((lineptr=get_input_line(ifp, &lineendptr)) != NULL &&
+	    parse_input_line(lineptr, lineendptr, argtbl, NUMINDEXARGS+1) == NUMINDEXARGS) {
+	if (numentries == maxentries) {
+	    maxentries = MAX(MINDATEENTRIES, 2*maxentries);
+	    if ((*dateentrytblptr=realloc(*dateentrytblptr,
+					maxentries*sizeof(Dateentry))) == NULL) {
+		err_exit("read_date_index: realloc failed, aborting!");
+	    }
+	}
+	dateentryptr = *dateentrytblptr+numentries++;
+	dateentryptr->timestamp = token_to_long(argtbl);
+	dateentryptr->offset    = token_to_long(argtbl+1);
+	dateentryptr->linectr   = token_to_long(argtbl+2);
+    }
+    close_inputfile(ifp);
+    return numentries;
+}
+
+
+/*******************************************************************************
+Write the DATE index file (or try to - it's only an optimization, so the input
+file's directory needn't be writable).
+*******************************************************************************/
+void write_date_index(char *indexfilename, Dateentry dateentrytbl[], int numentries) {
+    char	tmpfilename[MAXPATHNAMELEN];
+    FILE	*fileptr;
+    int		entryidx;
+
+    snprintf(tmpfilename, MAXPATHNAMELEN, "%s.tmp", indexfilename);
+    if ((fileptr=fopen(tmpfilename, "w")) == NULL) {
+	fprintf(stderr, "W: Could not create DATE index file '%s'\n", tmpfilename);
+	return;
+    }
+    fprintf(fileptr, "# pma DATE index file (timestamp offset line) - do not edit!\n%s\n",
+								    INDEXSTR);
+    for (entryidx=0; entryidx<numentries; entryidx++) {
+	fprintf(fileptr, "%ld %lld %u\n", (long)dateentrytbl[entryidx].timestamp,
+					(long long)dateentrytbl[entryidx].offset,
+					dateentrytbl[entryidx].linectr);
+    }
+    if (fclose(fileptr) != 0 || rename(tmpfilename, indexfilename) != 0) {
+	fprintf(stderr, "W: Could not write DATE index file '%s'\n", indexfilename);
+	unlink(tmpfilename);
+    }
+}
+
+
+/*******************************************************************************
+Return 1 if the DATE stanza of a DATE index entry is (still) in the (mmap'ed)
+input file, i.e., the file hasn't been replaced since it was indexed.
+*******************************************************************************/
+int date_entry_found(Inputfile *ifp, Dateentry *dateentryptr) {
+    char	*lineptr, *lineendptr;
+    Token	argtbl[NUMDATEARGS];
+    int		datestrlen = strlen(DATESTR);
+
+    if (dateentryptr->offset < 0 ||
+		dateentryptr->offset+datestrlen+1 >= (off_t)ifp->bufsize) {
+	return 0;
+    }
+    lineptr = ifp->bufptr+dateentryptr->offset;
+    if (memcmp(lineptr, DATESTR, datestrlen) || lineptr[datestrlen] != '\n') {
+	return 0;
+    }
+    lineptr += datestrlen+1;
+    if ((lineendptr=memchr(lineptr, '\n', ifp->endptr-lineptr)) == NULL) {
+	return 0;
+    }
+    return parse_input_line(lineptr, lineendptr, argtbl, NUMDATEARGS) == NUMDATEARGS &&
+			    token_to_long(argtbl+TIMESTAMPIDX) == dateentryptr->timestamp;
+}
+
+
+/*******************************************************************************
+Add the DATE stanzas of an (mmap'ed) input file, from offset (line linectr)
+onwards, to a DATE index. Only the lines are scanned - the data isn't parsed.
+Returns the number of entries.
+*******************************************************************************/
+int index_date_stanzas(Inputfile *ifp, Dateentry **dateentrytblptr, int numentries,
+					    off_t offset, unsigned linectr) {
+    Dateentry	*dateentryptr;
+    char	*lineptr, *lineendptr, *nextlineendptr;
+    Token	argtbl[NUMDATEARGS];
+    int		maxentries = numentries;
+    int		datestrlen = strlen(DATESTR);
+
+    for (lineptr=ifp->bufptr+offset; lineptr < ifp->endptr &&
+		(lineendptr=memchr(lineptr, '\n', ifp->endptr-lineptr)) != NULL;
+		lineptr=lineendptr+1, linectr++) {
+	if (lineendptr-lineptr != datestrlen || memcmp(lineptr, DATESTR, datestrlen)) {
+	    continue;
+	}
+	if ((nextlineendptr=memchr(lineendptr+1, '\n', ifp->endptr-lineendptr-1)) == NULL) {
+	    break;				/* (pmc is still writing it) */
+	}
+	if (parse_input_line(lineendptr+1, nextlineendptr, argtbl, NUMDATEARGS) !=
+								NUMDATEARGS) {
+	    continue;
+	}
+	if (numentries >= maxentries) {
+	    maxentries = MAX(MINDATEENTRIES, 2*maxentries);
+	    if ((*dateentrytblptr=realloc(*dateentrytblptr,
+					maxentries*sizeof(Dateentry))) == NULL) {
+		err_exit("index_date_stanzas: realloc failed, aborting!");
+	    }
+	}
+	dateentryptr = *dateentrytblptr+numentries++;
+	dateentryptr->timestamp = token_to_long(argtbl+TIMESTAMPIDX);
+	dateentryptr->offset    = lineptr-ifp->bufptr;
+	dateentryptr->linectr   = linectr;
+    }
+    return numentries;
+}
+
+
+/*******************************************************************************
+Read the DATE index of an (mmap'ed) input file, and bring it up to date: an
+index of a file that has grown is extended from its last DATE stanza; one that
+doesn't match the file (e.g., it has been rotated) is rebuilt. Either way, the
+index file is rewritten if it has changed. Returns the number of entries.
+*******************************************************************************/
+int update_date_index(Inputfile *ifp, Dateentry **dateentrytblptr) {
+    char	indexfilename[MAXPATHNAMELEN];
+    int		numentries, numindexedentries;
+    off_t	offset = 0;
+    unsigned	linectr = 0;
+
+    snprintf(indexfilename, MAXPATHNAMELEN, "%s%s", ifp->filename, DATEINDEXSUFFIX);
+    numentries = numindexedentries = read_date_index(indexfilename, dateentrytblptr);
+    if (numentries > 0 && (!date_entry_found(ifp, *dateentrytblptr) ||
+			    !date_entry_found(ifp, *dateentrytblptr+numentries-1))) {
+	numentries = 0;
+	numindexedentries = -1;			/* (rebuild it) */
+    }
+    if (numentries > 0) {			/* (the last one may have been partial) */
+	numentries--;
+	offset  = (*dateentrytblptr)[numentries].offset;
+	linectr = (*dateentrytblptr)[numentries].linectr;
+    }
+    numentries = index_date_stanzas(ifp, dateentrytblptr, numentries, offset, linectr);
+    if (numentries != numindexedentries) {
+	if (verbosity > 1) {
+	    fprintf(stderr, "i: Writing DATE index file '%s' (%d data sets)\n",
+							indexfilename, numentries);
+	}
+	write_date_index(indexfilename, *dateentrytblptr, numentries);
+    }
+    return numentries;
+}
+
+
+/*******************************************************************************
+--build-index: build (or update) the DATE index of an input file.
+*******************************************************************************/
+void build_date_index(char *inputfilename) {
+    Inputfile	*ifp;
+    Dateentry	*dateentrytbl;
+
+    if ((ifp=open_inputfile(inputfilename)) == NULL) {
+	fprintf(stderr, "E: Could not open input file '%s', skipping\n", inputfilename);
+	return;
+    }
+    if (ifp->mappedflag && strcmp(inputfilename, STDINFILENAME)) {
+	update_date_index(ifp, &dateentrytbl);
+	free(dateentrytbl);
+    } else {
+	fprintf(stderr, "E: Input file '%s' can't be indexed (not a regular, %s\n",
+						inputfilename, "uncompressed file), skipping");
+    }
+    close_inputfile(ifp);
+}
+
+
+/*******************************************************************************
+--from: seek an (mmap'ed) input file to its first data set at or after
+fromtimestamp, found by a binary search of its DATE index - so the earlier data
+sets aren't even scanned. (read_data_set skips any that are left, e.g., of
+input files that can't be indexed.)
+*******************************************************************************/
+void seek_from_timestamp(Inputfile *ifp) {
+    Dateentry	*dateentrytbl;
+    int		numentries, lowidx, highidx, mididx;
+
+    if (fromtimestamp == 0 || !ifp->mappedflag || !strcmp(ifp->filename, STDINFILENAME)) {
+	return;
+    }
+    numentries = update_date_index(ifp, &dateentrytbl);
+    lowidx  = 0;
+    highidx = numentries;
+    while (lowidx < highidx) {
+	mididx = lowidx+(highidx-lowidx)/2;
+	if (dateentrytbl[mididx].timestamp < fromtimestamp) {
+	    lowidx = mididx+1;
+	} else {
+	    highidx = mididx;
+	}
+    }
+    lowidx = MIN(lowidx, numentries-1);		/* (after the last one: skip it) */
+    if (lowidx >= 0 && dateentrytbl[lowidx].offset > inputfile_offset(ifp)) {
+	seek_inputfile(ifp, dateentrytbl[lowidx].offset, dateentrytbl[lowidx].linectr);
+    }
+    free(dateentrytbl);
+}
+
+
+/*******************************************************************************
+Read (parse) the next data set - a DATE stanza followed by the data stanza of
+each class - of an input file into a Dataset. Returns 0 (at EOF) if there are
+no more data sets (or, --to, the next one is later). Data sets before --from are
+skipped. Like read_*_stanza, this is thread safe. read_host_data_set reads the
+stanzas of numhostclasses classes, from classtbl[firstclassidx] (--fleet: those
+of one host) - a Dataset is only ever used for the same classes.
+*******************************************************************************/
+int read_host_data_set(Inputfile *ifp, Dataset *datasetptr, int firstclassidx,
+							    int numhostclasses) {
+    char	*lineptr, *lineendptr;
+    Token	argtbl[NUMDATEARGS];
+    Class	*classptr;
+    time_t	timestamp;
+    int		stanzaidx, numargs;
+
+    if (datasetptr->stanzatbl == NULL) {
+	if ((datasetptr->stanzatbl=calloc(numhostclasses, sizeof(Stanza))) == NULL) {
+	    err_exit("read_data_set: stanza calloc for '%s' failed, aborting!",
+								ifp->filename);
+	}
+	datasetptr->numstanzas    = numhostclasses;
+	datasetptr->firstclassidx = firstclassidx;
+    }
+
+    release_input_pages(ifp);
+    datasetptr->startoffset  = inputfile_offset(ifp);
+    datasetptr->startlinectr = ifp->linectr;
+    do {		/* (--from: skip the earlier data sets, unread) */
+	skip_to_stanza(ifp, DATESTR, 0);
+	if ((lineptr=get_input_line(ifp, &lineendptr)) == NULL) {
+	    return 0;
+	}
+	numargs = parse_input_line(lineptr, lineendptr, argtbl, NUMDATEARGS);
+	timestamp = numargs == NUMDATEARGS ? token_to_long(argtbl+TIMESTAMPIDX) : 0;
+    } while (numargs == NUMDATEARGS && timestamp < fromtimestamp);
+    if (totimestamp > 0 && timestamp > totimestamp) {
+	return 0;			/* --to: the rest of the input file isn't read */
+    }
+    if (numargs == NUMDATEARGS) {
+	ifp->timestamp = timestamp;
+    } else {
+	add_message(&datasetptr->messagebuf,
+			"read_inputfile: date error at input file %s line %d: %.*s\n",
+			ifp->filename, ifp->linectr, (int)(lineendptr-lineptr), lineptr);
+    }
+    datasetptr->timestamp = ifp->timestamp;
+
+    for (stanzaidx=0; stanzaidx<numhostclasses; stanzaidx++) {
+	classptr = classtbl+firstclassidx+stanzaidx;
+	skip_to_stanza(ifp, classptr->datastanza, 0);
+
+	if (classptr->classtype == VECTORCLASS) {
+	    read_vector_stanza(ifp, classptr, datasetptr->stanzatbl+stanzaidx);
+	} else {
+	    read_array_stanza(ifp, classptr, datasetptr->stanzatbl+stanzaidx);
+	}
+    }
+    datasetptr->endoffset    = inputfile_offset(ifp);
+    datasetptr->endlinectr   = ifp->linectr;
+    datasetptr->completeflag = datasetptr->stanzatbl[numhostclasses-1].terminatedflag;
+    return 1;
+}
+
+int read_data_set(Inputfile *ifp, Dataset *datasetptr) {
+    return read_host_data_set(ifp, datasetptr, 0, numclasses);
+}
+
+
+/*******************************************************************************
+Free the buffers of a Dataset (and of its Stanzas).
+*******************************************************************************/
+void free_data_set(Dataset *datasetptr) {
+    Stanza	*stanzaptr;
+    int		stanzaidx;
+
+    if (datasetptr->stanzatbl != NULL) {
+	for (stanzaidx=0; stanzaidx<datasetptr->numstanzas; stanzaidx++) {
+	    stanzaptr = datasetptr->stanzatbl+stanzaidx;
+	    free(stanzaptr->goodflagtbl);
+	    free(stanzaptr->valuetbl);
+	    free(stanzaptr->devicenameofftbl);
+	    free(stanzaptr->devicenamebuf);
+	    free(stanzaptr->messagebuf.str);
+	}
+	free(datasetptr->stanzatbl);
+    }
+    free(datasetptr->messagebuf.str);
+    memset(datasetptr, 0, sizeof(Dataset));
+}
+
+
+/*******************************************************************************
+--serve: append numrows rows (like output_rows) of the serve output plan's columns
+to the (in memory) store: the time of each row is in servetimetbl, and each
+device's (unscaled, NAN if there is no sample) values of the rows from the one
+where it was first stored are in its servevaluetbl. Called (like everything
+that changes the classes, metrics and devices) with servemutex locked.
+*******************************************************************************/
+void store_serve_rows(time_t timestamp, int numrows) {
+    Outputcolumn *columnptr, *endcolumnptr = servecolumntbl+numservecolumns;
+    Device	*deviceptr;
+    double	*valueptr;
+    int		rowidx, numvalues;
+
+    if (numserverows+numrows > maxserverows) {
+	maxserverows = MAX(MINSERVEROWS, MAX(2*maxserverows, numserverows+numrows));
+	if ((servetimetbl=realloc(servetimetbl, maxserverows*sizeof(time_t))) == NULL) {
+	    err_exit("store_serve_rows: realloc failed, aborting!");
+	}
+    }
+    for (columnptr=servecolumntbl; columnptr<endcolumnptr; columnptr++) {
+	deviceptr = columnptr->deviceptr;
+	if (deviceptr->servevaluetbl == NULL) {
+	    deviceptr->servefirstrow = numserverows;
+	}
+	numvalues = numserverows-deviceptr->servefirstrow;
+	if (numvalues+numrows > deviceptr->maxservevalues) {
+	    deviceptr->maxservevalues = MAX(MINSERVEROWS, MAX(2*deviceptr->maxservevalues,
+								numvalues+numrows));
+	    if ((deviceptr->servevaluetbl=realloc(deviceptr->servevaluetbl,
+			    deviceptr->maxservevalues*sizeof(double))) == NULL) {
+		err_exit("store_serve_rows: realloc failed, aborting!");
+	    }
+	}
+	valueptr = deviceptr->servevaluetbl+numvalues;
+	for (rowidx=0; rowidx<numrows; rowidx++) {
+	    valueptr[rowidx] = rowidx >= columnptr->startrow && *columnptr->samplectrptr != 0 ?
+			    columnptr->valueptr[rowidx*columnptr->rowstride] : NAN;
+	}
+    }
+    for (rowidx=0; rowidx<numrows; rowidx++) {
+	servetimetbl[numserverows+rowidx] = timestamp+(rowidx+1)*interval;
+    }
+    numserverows += numrows;
+}
+
+
+/*******************************************************************************
+Write numrows rows (see output_singlefile_body) to the single file and/or the
+multiple files (and the --serve store).
+*******************************************************************************/
+void output_rows(time_t timestamp, int numrows, Outputfile *singlefileptr,
+							    char *multifiledirname) {
+    int		phase = currentphase;
+
+    if (servesocketname != NULL) {
+	store_serve_rows(timestamp, numrows);
+    }
+    if (singlefileptr != NULL) {
+	start_phase(SINGLEPHASE);
+	if (singlefileformat == BINARYFORMAT) {
+	    output_binary_body(singlefileptr, timestamp, numrows);
+	} else {
+	    output_singlefile_body(singlefileptr, timestamp, numrows);
+	}
+    }
+    if (multifiledirname != NULL) {
+	start_phase(MULTIPHASE);
+	output_multifile_bodies_data(timestamp, numrows);
+    }
+    start_phase(phase);
+}
+
+
+/*******************************************************************************
+--bucket: instead of every row, output one row per bucketsecs seconds: the
+mean, max or min (bucketfunction) of the good samples of each device in the
+bucket. Row times t (timestamp+(rowidx+1)*interval) from n*bucketsecs+1 to
+(n+1)*bucketsecs are in bucket n, which is output (timestamped (n+1)*bucketsecs)
+when the first row of a later bucket arrives - or by output_bucket at the end.
+Only the current bucket is kept (in the classes' bucket tables).
+*******************************************************************************/
+void output_bucket(Outputfile *singlefileptr, char *multifiledirname) {
+    Class	*classptr;
+    int		classidx, metricidx, deviceidx;
+
+    if (numbucketrows == 0) {
+	return;
+    }
+    for (classidx=0; bucketfunction==MEANBUCKET && classidx<numclasses; classidx++) {
+	classptr = classtbl+classidx;
+	for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	    for (deviceidx=0; deviceidx<classptr->metrictbl->numdevices; deviceidx++) {
+		if (classptr->bucketctrtbl[deviceidx] > 0) {
+		    classptr->bucketvaluetbl[(size_t)metricidx*classptr->maxdevices+deviceidx]
+					    /= classptr->bucketctrtbl[deviceidx];
+		}
+	    }
+	}
+    }
+    output_rows((currentbucket+1)*bucketsecs-interval, 1, singlefileptr, multifiledirname);
+    for (classidx=0; classidx<numclasses; classidx++) {
+	classptr = classtbl+classidx;
+	if (classptr->bucketctrtbl != NULL) {
+	    memset(classptr->bucketctrtbl, 0, classptr->maxdevices*sizeof(int));
+	}
+    }
+    numbucketrows = 0;
+}
+
+void bucket_data_set(time_t timestamp, Outputfile *singlefileptr, char *multifiledirname) {
+    Class	*classptr;
+    double	value, *bucketvalueptr;
+    long	bucket;
+    int		rowidx, classidx, metricidx, deviceidx, numdevices;
+
+    for (rowidx=0; rowidx<count; rowidx++) {
+	bucket = (timestamp+(rowidx+1)*interval-1)/bucketsecs;
+	if (numbucketrows > 0 && bucket != currentbucket) {
+	    output_bucket(singlefileptr, multifiledirname);
+	}
+	currentbucket = bucket;
+	numbucketrows++;
+
+	for (classidx=0; classidx<numclasses; classidx++) {
+	    classptr = classtbl+classidx;
+	    numdevices = classptr->metrictbl->numdevices;
+	    if (rowidx < classptr->startrow) {
+		continue;
+	    }
+	    for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+		bucketvalueptr = classptr->bucketvaluetbl+(size_t)metricidx*classptr->maxdevices;
+		for (deviceidx=0; deviceidx<numdevices; deviceidx++) {
+		    if (!*SAMPLEFLAGPTR(classptr, rowidx, deviceidx)) {
+			continue;
+		    }
+		    value = *VALUEPTR(classptr, rowidx, metricidx, deviceidx);
+		    if (classptr->bucketctrtbl[deviceidx] == 0) {
+			bucketvalueptr[deviceidx] = value;
+		    } else if (bucketfunction == MEANBUCKET) {
+			bucketvalueptr[deviceidx] += value;
+		    } else if (bucketfunction == MAXBUCKET) {
+			bucketvalueptr[deviceidx] = MAX(bucketvalueptr[deviceidx], value);
+		    } else {
+			bucketvalueptr[deviceidx] = MIN(bucketvalueptr[deviceidx], value);
+		    }
+		}
+	    }
+	    for (deviceidx=0; deviceidx<numdevices; deviceidx++) {
+		classptr->bucketctrtbl[deviceidx] += *SAMPLEFLAGPTR(classptr, rowidx, deviceidx);
+	    }
+	}
+    }
+}
+
+
+/*******************************************************************************
+Discard the (not yet printed) messages of a data set that won't be processed.
+*******************************************************************************/
+void discard_data_set_messages(Dataset *datasetptr) {
+    int		stanzaidx;
+
+    datasetptr->messagebuf.len = 0;
+    for (stanzaidx=0; stanzaidx<datasetptr->numstanzas; stanzaidx++) {
+	datasetptr->stanzatbl[stanzaidx].messagebuf.len = 0;
+    }
+}
+
+
+/*******************************************************************************
+Store a (parsed) data set in its classes' metrics and devices. Returns the
+number of new devices.
+*******************************************************************************/
+int store_data_set(char *inputfilename, Dataset *datasetptr) {
+    Class	*classptr;
+    int		stanzaidx;
+    int		numnewdevices = 0;
+
+    start_phase(STOREPHASE);
+    if (statsformat != NOSTATS) {
+	count_data_set(datasetptr);
+    }
+    print_messages(&datasetptr->messagebuf);
+    for (stanzaidx=0; stanzaidx<datasetptr->numstanzas; stanzaidx++) {
+	classptr = classtbl+datasetptr->firstclassidx+stanzaidx;
+	if (classptr->classtype == VECTORCLASS) {
+	    store_vector_stanza(inputfilename, classptr, datasetptr->stanzatbl+stanzaidx);
+	} else {
+	    numnewdevices += store_array_stanza(inputfilename, classptr,
+						    datasetptr->stanzatbl+stanzaidx);
+	}
+    }
+    return numnewdevices;
+}
+
+
+/*******************************************************************************
+Output the (stored) rows of timestamp in the single file and/or multiple file
+formats. The output files are initialized after the first data set has been
+stored. (inputfilename and linectr are where any new devices were found.)
+*******************************************************************************/
+void output_data_set(time_t timestamp, int numnewdevices, char *inputfilename,
+		    unsigned linectr, char *singlefilename, Outputfile **singlefileptrptr,
+							    char *multifiledirname) {
+    int		classidx;
+
+    if (firstdatasetflag) {
+	firsttimestamp = timestamp;
+	start_phase(INITPHASE);
+	initialize_outputs(singlefilename, singlefileptrptr, multifiledirname);
+	start_clockticks_thread(timestamp);
+	start_phase(STOREPHASE);
+	firstdatasetflag = 0;
+    } else if (numnewdevices > 0) {
+	if (singlefilename != NULL && verbosity > 0) {
+	    fprintf(stderr,
+		"i: %d new device(s) at input file %s line %d: not in the single file\n",
+		numnewdevices, inputfilename, linectr);
+	}
+	prepare_multi_output_files(multifiledirname);
+	build_output_plans();
+    }
+
+    for (classidx=0; classidx<numclasses; classidx++) {
+	update_class_statistics(classtbl+classidx);
+    }
+
+    if (bucketsecs > 0) {
+	bucket_data_set(timestamp, *singlefileptrptr, multifiledirname);
+    } else {
+	output_rows(timestamp, count, *singlefileptrptr, multifiledirname);
+    }
+    update_clockticks_thread(timestamp, 0);
+}
+
+
+/*******************************************************************************
+Store a (parsed) data set, then output it. For --incremental, the end of each
+data set is where the next run will resume - unless it was cut short by EOF (pmc
+is still writing it), when it is not used now, but re-read by the next run.
+*******************************************************************************/
+void process_data_set(char *inputfilename, Dataset *datasetptr, char *singlefilename,
+				    Outputfile **singlefileptrptr, char *multifiledirname) {
+    int		numnewdevices;
+
+    if (statefileptr != NULL) {
+	if (!datasetptr->completeflag) {	/* (the last one) at EOF: next time */
+	    statefileptr->inputfilename = inputfilename;
+	    statefileptr->offset  = datasetptr->startoffset;
+	    statefileptr->linectr = datasetptr->startlinectr;
+	    discard_data_set_messages(datasetptr);
+	    return;
+	}
+	statefileptr->inputfilename = inputfilename;
+	statefileptr->offset    = datasetptr->endoffset;
+	statefileptr->linectr   = datasetptr->endlinectr;
+	statefileptr->timestamp = datasetptr->timestamp;
+    }
+
+    pthread_mutex_lock(&servemutex);		/* (--serve: the store changes) */
+    numnewdevices = store_data_set(inputfilename, datasetptr);
+    output_data_set(datasetptr->timestamp, numnewdevices, inputfilename,
+		    datasetptr->stanzatbl[datasetptr->numstanzas-1].endlinectr,
+		    singlefilename, singlefileptrptr, multifiledirname);
+    pthread_mutex_unlock(&servemutex);
+}
+
+
+/*******************************************************************************
+Read all the data sets of an input file, and output them in the single file
+and/or multiple file formats. Returns the timestamp of the last data set.
+*******************************************************************************/
+time_t read_inputfile(Inputfile *ifp, char *singlefilename, Outputfile **singlefileptrptr,
+							    char *multifiledirname) {
+    Dataset	dataset;
+
+    memset(&dataset, 0, sizeof(Dataset));
+    start_phase(PARSEPHASE);
+    seek_from_timestamp(ifp);
+    while (read_data_set(ifp, &dataset)) {
+	process_data_set(ifp->filename, &dataset, singlefilename, singlefileptrptr,
+							    multifiledirname);
+	start_phase(PARSEPHASE);
+    }
+    free_data_set(&dataset);
+    return ifp->timestamp;
+}
+
+
+/*******************************************************************************
+Open (if it isn't already) an input file of read_inputfiles_in_parallel and split
+it into Jobsegments: an mmap'ed input file into parts of (about) SEGMENTSIZE
+bytes, each starting at a DATE line - so each part is a whole number of data
+sets, and the parts of one large input file can be parsed by several worker
+threads at once. Any other input file (stdin, a pipe or a decompressor's output)
+is one segment, read as it comes.
+*******************************************************************************/
+void open_jobfile(Jobfile *jobfileptr) {
+    Inputfile	*ifp;
+    Jobsegment	*segmentptr;
+    char	*startptr, *lineptr, *lineendptr;
+    int		maxsegments = 1;
+    int		datestrlen = strlen(DATESTR);
+
+    if (jobfileptr->ifp == NULL &&
+		    (jobfileptr->ifp=open_inputfile(jobfileptr->filename)) == NULL) {
+	jobfileptr->openfailedflag = 1;
+	return;
+    }
+    ifp = jobfileptr->ifp;
+    seek_from_timestamp(ifp);
+    if (ifp->mappedflag) {	/* (all but the last segment are >= SEGMENTSIZE) */
+	maxsegments = (ifp->endptr-ifp->curptr)/SEGMENTSIZE + 1;
+    }
+    if ((jobfileptr->segmenttbl=calloc(maxsegments, sizeof(Jobsegment))) == NULL) {
+	err_exit("open_jobfile: calloc for '%s' failed, aborting!", jobfileptr->filename);
+    }
+    segmentptr = jobfileptr->segmenttbl;
+    segmentptr->linectr     = ifp->linectr;
+    segmentptr->linectrflag = 1;
+    jobfileptr->numsegments = 1;
+
+    for (startptr=ifp->curptr; ifp->mappedflag; startptr=lineptr) {
+	segmentptr->startptr = startptr;
+	segmentptr->endptr   = ifp->endptr;
+	if (jobfileptr->numsegments == maxsegments || ifp->endptr-startptr <= SEGMENTSIZE ||
+				    (lineptr=memchr(startptr+SEGMENTSIZE-1, '\n',
+				    ifp->endptr-startptr-SEGMENTSIZE+1)) == NULL) {
+	    break;
+	}
+	for (lineptr++; lineptr < ifp->endptr; lineptr=lineendptr+1) {
+	    if ((lineendptr=memchr(lineptr, '\n', ifp->endptr-lineptr)) == NULL ||
+			    (lineendptr-lineptr == datestrlen &&
+			    !memcmp(lineptr, DATESTR, datestrlen))) {
+		break;
+	    }
+	}
+	if (lineptr >= ifp->endptr || lineendptr == NULL) {	/* (not before the last line) */
+	    break;
+	}
+	segmentptr->endptr = lineptr;
+	segmentptr++;
+	jobfileptr->numsegments++;
+    }
+    jobfileptr->numparsingsegments = jobfileptr->numsegments;
+}
+
+
+/*******************************************************************************
+A worker thread for read_inputfiles_in_parallel: take the next segment of the
+next input file from jobfiletbl (opening and splitting the input file first),
+and read (parse) its data sets into that segment's queue - waiting whenever
+JOBQUEUELEN data sets per thread are already queued, unless the main thread is
+waiting for this segment. Repeat until there are no more segments. A segment's
+worker counts its lines, so the next one's line numbers are known.
+*******************************************************************************/
+void* parse_jobfiles(void *argptr) {
+    Jobfile	*jobfileptr;
+    Jobsegment	*segmentptr;
+    Inputfile	*ifp;
+    Dataset	*datasetptr;
+    char	*ptr;
+    unsigned	numlines;
+    int		moreflag, closeflag = 0;
+
+    (void)argptr;
+    while (1) {
+	pthread_mutex_lock(&jobmutex);
+	while (1) {
+	    if (nextjobfileidx == numjobfiles) {
+		pthread_mutex_unlock(&jobmutex);
+		return NULL;
+	    }
+	    jobfileptr = jobfiletbl+nextjobfileidx;
+	    if (jobfileptr->openingflag && !jobfileptr->openedflag) {
+		pthread_cond_wait(&jobcond, &jobmutex);
+	    } else if (!jobfileptr->openedflag) {
+		jobfileptr->openingflag = 1;
+		pthread_mutex_unlock(&jobmutex);
+		open_jobfile(jobfileptr);
+		pthread_mutex_lock(&jobmutex);
+		jobfileptr->openedflag = 1;
+		pthread_cond_broadcast(&jobcond);
+	    } else if (jobfileptr->nextsegmentidx < jobfileptr->numsegments) {
+		break;
+	    } else {
+		nextjobfileidx++;
+	    }
+	}
+	segmentptr = jobfileptr->segmenttbl+jobfileptr->nextsegmentidx++;
+	pthread_mutex_unlock(&jobmutex);
+
+	ifp = jobfileptr->ifp;
+	if (segmentptr->startptr != NULL) {
+	    numlines = 0;
+	    for (ptr=segmentptr->startptr; (ptr=memchr(ptr, '\n',
+					    segmentptr->endptr-ptr)) != NULL; ptr++) {
+		numlines++;
+	    }
+	    pthread_mutex_lock(&jobmutex);
+	    while (!segmentptr->linectrflag) {
+		pthread_cond_wait(&jobcond, &jobmutex);
+	    }
+	    if (segmentptr+1 < jobfileptr->segmenttbl+jobfileptr->numsegments) {
+		segmentptr[1].linectr     = segmentptr->linectr+numlines;
+		segmentptr[1].linectrflag = 1;
+		pthread_cond_broadcast(&jobcond);
+	    }
+	    pthread_mutex_unlock(&jobmutex);
+	    ifp = open_input_segment(jobfileptr->ifp, segmentptr->startptr,
+					    segmentptr->endptr, segmentptr->linectr);
+	}
+
+	do {
+	    pthread_mutex_lock(&jobmutex);
+	    while (numqueueddatasets >= maxqueueddatasets && segmentptr != currentsegmentptr) {
+		pthread_cond_wait(&jobcond, &jobmutex);
+	    }
+	    if ((datasetptr=freedatasetptr) != NULL) {
+		freedatasetptr = datasetptr->nextptr;
+	    }
+	    pthread_mutex_unlock(&jobmutex);
+	    if (datasetptr == NULL && (datasetptr=calloc(1, sizeof(Dataset))) == NULL) {
+		err_exit("parse_jobfiles: calloc for '%s' failed, aborting!", ifp->filename);
+	    }
+
+	    moreflag = read_data_set(ifp, datasetptr);
+
+	    pthread_mutex_lock(&jobmutex);
+	    if (moreflag) {
+		datasetptr->nextptr = NULL;
+		if (segmentptr->headptr == NULL) {
+		    segmentptr->headptr = datasetptr;
+		} else {
+		    segmentptr->tailptr->nextptr = datasetptr;
+		}
+		segmentptr->tailptr = datasetptr;
+		numqueueddatasets++;
+	    } else {
+		datasetptr->nextptr = freedatasetptr;
+		freedatasetptr = datasetptr;
+		segmentptr->doneflag = 1;
+		closeflag = --jobfileptr->numparsingsegments == 0;
+	    }
+	    pthread_cond_broadcast(&jobcond);
+	    pthread_mutex_unlock(&jobmutex);
+	} while (moreflag);
+
+	if (ifp != jobfileptr->ifp) {
+	    close_inputfile(ifp);
+	}
+	if (closeflag) {		/* (its data sets don't point into it) */
+	    close_inputfile(jobfileptr->ifp);
+	    jobfileptr->ifp = NULL;
+	}
+    }
+}
+
+
+/*******************************************************************************
+Read (parse) the input files in parallel, using numjobs worker threads, but
+store and output their data sets in this (the main) thread in exactly the same
+order as read_inputfile does - so the output is identical. (Except that a
+malformed data set - e.g., one missing its blank line or a class stanza - at the
+start of a segment is not read past.) firstifp is the (already opened) first
+input file. Returns the timestamp of the last data set.
+*******************************************************************************/
+time_t read_inputfiles_in_parallel(char *inputfilenametbl[], int numinputfiles,
+		    Inputfile *firstifp, int numjobs, char *singlefilename,
+		    Outputfile **singlefileptrptr, char *multifiledirname) {
+    pthread_t	*threadtbl;
+    Jobfile	*jobfileptr;
+    Jobsegment	*segmentptr;
+    Dataset	*datasetptr;
+    int		jobfileidx, threadidx, segmentidx;
+    time_t	lasttimestamp = 0;
+
+    numjobfiles = numinputfiles;
+    maxqueueddatasets = numjobs*JOBQUEUELEN;
+    if ((jobfiletbl=calloc(numjobfiles, sizeof(Jobfile))) == NULL ||
+	(threadtbl=calloc(numjobs, sizeof(pthread_t))) == NULL) {
+	err_exit("read_inputfiles_in_parallel: calloc failed, aborting!");
+    }
+    for (jobfileidx=0; jobfileidx<numjobfiles; jobfileidx++) {
+	jobfiletbl[jobfileidx].filename = inputfilenametbl[jobfileidx];
+    }
+    jobfiletbl[0].ifp = firstifp;
+
+    for (threadidx=0; threadidx<numjobs; threadidx++) {
+	if ((errno=pthread_create(threadtbl+threadidx, NULL, parse_jobfiles, NULL)) != 0) {
+	    err_exit("Could not create thread %d, aborting!", threadidx);
+	}
+    }
+
+    for (jobfileidx=0; jobfileidx<numjobfiles; jobfileidx++) {
+	jobfileptr = jobfiletbl+jobfileidx;
+	if (jobfileidx > 0 && verbosity > 1) {
+	    fprintf(stderr, "i: Processing input file '%s'\n", jobfileptr->filename);
+	}
+	start_phase(PARSEPHASE);
+	pthread_mutex_lock(&jobmutex);
+	while (!jobfileptr->openedflag) {
+	    pthread_cond_wait(&jobcond, &jobmutex);
+	}
+	pthread_mutex_unlock(&jobmutex);
+
+	for (segmentidx=0; segmentidx<jobfileptr->numsegments; segmentidx++) {
+	    segmentptr = jobfileptr->segmenttbl+segmentidx;
+	    pthread_mutex_lock(&jobmutex);
+	    currentsegmentptr = segmentptr;
+	    pthread_cond_broadcast(&jobcond);
+	    pthread_mutex_unlock(&jobmutex);
+
+	    while (1) {
+		start_phase(PARSEPHASE);
+		pthread_mutex_lock(&jobmutex);
+		while (segmentptr->headptr == NULL && !segmentptr->doneflag) {
+		    pthread_cond_wait(&jobcond, &jobmutex);
+		}
+		if ((datasetptr=segmentptr->headptr) == NULL) {	/* done */
+		    pthread_mutex_unlock(&jobmutex);
+		    break;
+		}
+		segmentptr->headptr = datasetptr->nextptr;
+		numqueueddatasets--;
+		pthread_cond_broadcast(&jobcond);
+		pthread_mutex_unlock(&jobmutex);
+
+		process_data_set(jobfileptr->filename, datasetptr, singlefilename,
+					    singlefileptrptr, multifiledirname);
+		jobfileptr->timestamp = datasetptr->timestamp;
+
+		pthread_mutex_lock(&jobmutex);
+		datasetptr->nextptr = freedatasetptr;
+		freedatasetptr = datasetptr;
+		pthread_mutex_unlock(&jobmutex);
+	    }
+	}
+
+	if (jobfileptr->openfailedflag) {
+	    fprintf(stderr, "E: Could not open input file '%s', skipping\n",
+								jobfileptr->filename);
+	} else {
+	    lasttimestamp = jobfileptr->timestamp;
+	    inputfilectr += jobfileidx > 0;	/* (the first one is counted by main) */
+	}
+    }
+
+    for (threadidx=0; threadidx<numjobs; threadidx++) {
+	pthread_join(threadtbl[threadidx], NULL);
+    }
+    while ((datasetptr=freedatasetptr) != NULL) {
+	freedatasetptr = datasetptr->nextptr;
+	free_data_set(datasetptr);
+	free(datasetptr);
+    }
+    for (jobfileidx=0; jobfileidx<numjobfiles; jobfileidx++) {
+	free(jobfiletbl[jobfileidx].segmenttbl);
+    }
+    free(threadtbl);
+    free(jobfiletbl);
+    return lasttimestamp;
+}
+
+
+/*******************************************************************************
+--fleet: open the input files - one per host - and read their time values and
+metadata. The host name is the h= of pmc's TIME_VALUES comment (or, if there
+isn't one, the input file's name). Every host's classes are added to classtbl,
+with metric names metric@hostname, so the hosts are output side by side. They
+must all have the same count and interval.
+*******************************************************************************/
+void open_hosts(char *inputfilenametbl[], int numinputfiles) {
+    Host	*hostptr;
+    Inputfile	*ifp;
+    char	*hostname, *ptr;
+    int		inputfileidx, hostidx, firstcount = 0, firstinterval = 0;
+
+    if ((hosttbl=calloc(numinputfiles, sizeof(Host))) == NULL) {
+	err_exit("open_hosts: calloc failed, aborting!");
+    }
+    for (inputfileidx=0; inputfileidx<numinputfiles; inputfileidx++) {
+	if (verbosity > 1) {
+	    fprintf(stderr, "i: Processing input file '%s'\n", inputfilenametbl[inputfileidx]);
+	}
+	if ((ifp=open_inputfile(inputfilenametbl[inputfileidx])) == NULL) {
+	    fprintf(stderr, "E: Could not open input file '%s', skipping\n",
+						    inputfilenametbl[inputfileidx]);
+	    continue;
+	}
+	inputfilectr++;
+	initialize_time_values(ifp, &hostname);
+	if (numhosts == 0) {
+	    firstcount    = count;
+	    firstinterval = interval;
+	    if (bucketsecs > 0 && bucketsecs % interval != 0) {
+		fprintf(stderr, "Bucket seconds %d must be a multiple of the interval %d, %s\n",
+						    bucketsecs, interval, "aborting!");
+		exit(1);
+	    }
+	} else if (count != firstcount || interval != firstinterval) {
+	    fprintf(stderr, "Input file '%s': count %d and interval %d are not %d and %d %s\n",
+			    ifp->filename, count, interval, firstcount, firstinterval,
+			    "(of the first input file), aborting!");
+	    exit(1);
+	}
+	if (hostname == NULL) {
+	    ptr = strrchr(ifp->filename, '/');
+	    if ((hostname=strdup(ptr == NULL ? ifp->filename : ptr+1)) == NULL) {
+		err_exit("open_hosts: strdup failed, aborting!");
+	    }
+	}
+	for (hostidx=0; hostidx<numhosts; hostidx++) {
+	    if (!strcmp(hosttbl[hostidx].hostname, hostname)) {
+		fprintf(stderr, "Input files '%s' and '%s' are both host '%s', aborting!\n",
+				hosttbl[hostidx].ifp->filename, ifp->filename, hostname);
+		exit(1);
+	    }
+	}
+
+	hostptr = hosttbl+numhosts++;
+	hostptr->hostname	= hostname;
+	hostptr->ifp		= ifp;
+	hostptr->firstclassidx	= numclasses;
+	initialize_metadata(ifp, hostname);
+	hostptr->numhostclasses	= numclasses-hostptr->firstclassidx;
+	seek_from_timestamp(ifp);
+    }
+    if (numhosts == 0) {
+	fprintf(stderr, "No input files could be opened, aborting!\n");
+	exit(1);
+    }
+    check_metric_names();
+}
+
+
+/*******************************************************************************
+--fleet: add a (just read) data set to its host's queue - or, at the end of the
+input file (moreflag is 0), to its free list. Called with jobmutex locked if
+there are worker threads.
+*******************************************************************************/
+void queue_host_data_set(Host *hostptr, Dataset *datasetptr, int moreflag) {
+    if (moreflag) {
+	datasetptr->nextptr = NULL;
+	if (hostptr->headptr == NULL) {
+	    hostptr->headptr = datasetptr;
+	} else {
+	    hostptr->tailptr->nextptr = datasetptr;
+	}
+	hostptr->tailptr = datasetptr;
+	hostptr->numqueued++;
+    } else {
+	datasetptr->nextptr = hostptr->freeptr;
+	hostptr->freeptr = datasetptr;
+	hostptr->doneflag = 1;
+    }
+}
+
+
+/*******************************************************************************
+--fleet: a worker thread for read_hosts - read (parse) the next data set of the
+host (that no other thread is reading) with the fewest queued, until every
+host's input file has been read. Each host's queue is limited to JOBQUEUELEN
+data sets, so memory use is bounded however far apart the hosts' times are.
+*******************************************************************************/
+void* parse_hosts(void *argptr) {
+    Host	*hostptr, *nexthostptr;
+    Dataset	*datasetptr;
+    int		hostidx, moreflag, alldoneflag;
+
+    (void)argptr;
+    pthread_mutex_lock(&jobmutex);
+    while (1) {
+	nexthostptr = NULL;
+	alldoneflag = 1;
+	for (hostidx=0; hostidx<numhosts; hostidx++) {
+	    hostptr = hosttbl+hostidx;
+	    alldoneflag &= hostptr->doneflag;
+	    if (!hostptr->doneflag && !hostptr->readingflag &&
+				hostptr->numqueued < JOBQUEUELEN && (nexthostptr == NULL ||
+				hostptr->numqueued < nexthostptr->numqueued)) {
+		nexthostptr = hostptr;
+	    }
+	}
+	if (alldoneflag) {
+	    break;
+	}
+	if (nexthostptr == NULL) {
+	    pthread_cond_wait(&jobcond, &jobmutex);
+	    continue;
+	}
+	hostptr = nexthostptr;
+	hostptr->readingflag = 1;
+	if ((datasetptr=hostptr->freeptr) != NULL) {
+	    hostptr->freeptr = datasetptr->nextptr;
+	}
+	pthread_mutex_unlock(&jobmutex);
+
+	if (datasetptr == NULL && (datasetptr=calloc(1, sizeof(Dataset))) == NULL) {
+	    err_exit("parse_hosts: calloc for '%s' failed, aborting!", hostptr->ifp->filename);
 	}
-	metricptr->numdevices++;
+	moreflag = read_host_data_set(hostptr->ifp, datasetptr, hostptr->firstclassidx,
+							    hostptr->numhostclasses);
+
+	pthread_mutex_lock(&jobmutex);
+	queue_host_data_set(hostptr, datasetptr, moreflag);
+	hostptr->readingflag = 0;
+	pthread_cond_broadcast(&jobcond);
     }
+    pthread_mutex_unlock(&jobmutex);
+    return NULL;
 }
 
 
 /*******************************************************************************
-Classes have metric(s) and metrics have device(s). initialize_classes loops
-through the classes, skips to data for the current class, and calls add_device
-for each device beloging to that class. Array classes really do have devices!
-The data for each array class metric's device(s) is stored in that metric's
-devicetbl[n]. Vector class metrics do NOT really have any devices, but they
-still have data - it's stored in devicetbl[0] (for each metric of that vector
-class).
+--fleet: return the next (parsed) data set of a host, or NULL if there are no
+more. Without worker threads, it is read now.
 *******************************************************************************/
-void initialize_classes() {
-    char inputline[MAXINPUTLINELEN], *argtbl[MAXNUMMETRICS+1], datastanza[MAXDATSTZLEN+1];
-    Class	*classptr;
-    int		classidx, numargs, metricidx;
-
-    for (classidx=0; classidx<numclasses; classidx++) {	/* loop thru classes */
-	classptr = classtbl+classidx;
-
-	/* read a data line for this data stanza */
-	sprintf(datastanza, "%s%c", classptr->classname, STANZATERMCHAR);
-	skip_to_stanza(datastanza, inputline, 1);
-
-	if (classptr->classtype == VECTORCLASS) {	/* vector (single-row) class */
-	    /* 1 input file line: 1 "device" per metric!!! */
-	    if (fgets(inputline, MAXINPUTLINELEN, inputfileptr)) {
-		inputlinectr++;
-		if ((numargs=parse_input_line(inputline, argtbl, MAXNUMMETRICS)) == 
-							classptr->nummetrics) {
-		    for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
-			add_device(classptr->metrictbl+metricidx, NODEVICENAME);
-		    }
-		} else {
-		    fprintf(stderr, "Bad input file line starting '%s' at line %d\n",
-							    inputline, inputlinectr);
-		    fprintf(stderr, "%d vector metrics required, found %d, aborting\n",
-						    classptr->nummetrics, numargs);
-		    exit(1);
-		}
-	    }
-	} else {					/* array (multi-row) class */
-	    /* N input file line(s): N device(s) per metric!!! */
-	    while (fgets(inputline, MAXINPUTLINELEN, inputfileptr)) {
-		inputlinectr++;
-		if ((numargs=parse_input_line(inputline, argtbl, MAXNUMMETRICS+1)) == 
-							classptr->nummetrics+1) {
-		    for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
-			add_device(classptr->metrictbl+metricidx, argtbl[0]);
-		    }
-		} else if (numargs == 0) {
-		    break;
-		} else {
-		    fprintf(stderr, "Bad input file line starting '%s' at line %d\n",
-							inputline, inputlinectr);
-		    fprintf(stderr, "%d array metrics required, found %d, aborting\n",
-						    classptr->nummetrics, numargs-1);
-		    exit(1);
-		}
+Dataset* next_host_data_set(Host *hostptr, int threadedflag) {
+    Dataset	*datasetptr;
+
+    if (!threadedflag) {
+	if (hostptr->headptr == NULL && !hostptr->doneflag) {
+	    if ((datasetptr=hostptr->freeptr) != NULL) {
+		hostptr->freeptr = datasetptr->nextptr;
+	    } else if ((datasetptr=calloc(1, sizeof(Dataset))) == NULL) {
+		err_exit("next_host_data_set: calloc failed, aborting!");
 	    }
+	    queue_host_data_set(hostptr, datasetptr, read_host_data_set(hostptr->ifp,
+		    datasetptr, hostptr->firstclassidx, hostptr->numhostclasses));
 	}
+	return hostptr->headptr;
     }
-    if (inputfileptr != stdin) {
-	rewind(inputfileptr);
-	inputlinectr = 0;
+    pthread_mutex_lock(&jobmutex);
+    while (hostptr->headptr == NULL && !hostptr->doneflag) {
+	pthread_cond_wait(&jobcond, &jobmutex);
     }
+    datasetptr = hostptr->headptr;
+    pthread_mutex_unlock(&jobmutex);
+    return datasetptr;
 }
 
 
 /*******************************************************************************
-Duplicate metric names (even if they are in different classes) are forbidden.
-Abort if any are found.
+--fleet: remove the (processed) data set at the head of a host's queue.
 *******************************************************************************/
-void check_metric_names() {
-    Class	*class1ptr, *class2ptr;
-    Metric	*metric1ptr, *metric2ptr;
-    int		class1idx, class2idx, metric1idx, metric2idx;
-
-    for (class1idx=0; class1idx<numclasses; class1idx++) {
-	class1ptr = classtbl+class1idx;
-	for (metric1idx=0; metric1idx<class1ptr->nummetrics; metric1idx++) {
-	    metric1ptr=class1ptr->metrictbl+metric1idx;
-	    for (class2idx=0; class2idx<numclasses; class2idx++) {
-		class2ptr = classtbl+class2idx;
-		for (metric2idx=0; metric2idx<class2ptr->nummetrics; metric2idx++) {
-		    metric2ptr=class2ptr->metrictbl+metric2idx;
-		    if ((class1idx != class2idx || metric1idx != metric2idx) &&
-			!strcmp(metric1ptr->metricname, metric2ptr->metricname)) {
-			fprintf(stderr, "Duplicate metric '%s', aborting\n",
-							    metric1ptr->metricname);
-			exit(1);
-		    }
-		}
-	    }
-	}
+void release_host_data_set(Host *hostptr, int threadedflag) {
+    Dataset	*datasetptr;
+
+    if (threadedflag) {
+	pthread_mutex_lock(&jobmutex);
+    }
+    datasetptr = hostptr->headptr;
+    hostptr->headptr = datasetptr->nextptr;
+    hostptr->numqueued--;
+    datasetptr->nextptr = hostptr->freeptr;
+    hostptr->freeptr = datasetptr;
+    if (threadedflag) {
+	pthread_cond_broadcast(&jobcond);
+	pthread_mutex_unlock(&jobmutex);
     }
 }
 
 
 /*******************************************************************************
-Read and parse a configuration file, which may contain maximum scale values for
-metrics (e.g., cpu_us 100.0) and/or paramtbl vales (e.g., singlefiledelimiter '|').
-Anything after the comment character ('#') is ignored.
+--fleet: zero the values (and sample flags) of a host that has no data set in a
+frame - like the rows missing from a data set, they are output as 0.
 *******************************************************************************/
-void read_configfile() {
-    char	inputline[MAXINPUTLINELEN], *argtbl[2];
-    char	metric_device_name[MAXMETDEVNAMELEN];
+void clear_host_values(Host *hostptr) {
     Class	*classptr;
-    Metric	*metricptr;
-    Device	*deviceptr;
-    Param	*paramptr;
-    int		numargs, classidx, metricidx, deviceidx, paramidx;
-    int		legalparamflag;
-    FILE	*configfileptr;
+    int		classidx;
 
-    if ((configfileptr=fopen(configfilename, "r")) == NULL) {
-	err_exit("Could not open configuration file '%s', aborting!", configfilename);
+    for (classidx=hostptr->firstclassidx;
+		classidx<hostptr->firstclassidx+hostptr->numhostclasses; classidx++) {
+	classptr = classtbl+classidx;
+	if (classptr->valuetbl != NULL) {
+	    memset(classptr->valuetbl, 0,
+		(size_t)count*classptr->nummetrics*classptr->maxdevices*sizeof(double));
+	    memset(classptr->sampleflagtbl, 0, (size_t)count*classptr->maxdevices);
+	}
     }
+}
 
-    while (fgets(inputline, MAXINPUTLINELEN, configfileptr)) {
-	if ((numargs=parse_input_line(inputline, argtbl, 2)) == 2) {
-	    legalparamflag = 0;
-
-	    /* if a metric or a metric_device line has a scale value, grab it */
-	    for (classidx=0; classidx<numclasses; classidx++) {	/* classes */
-		classptr = classtbl+classidx;
-
-		if (classptr->classtype == VECTORCLASS) { /* single-row vector class */
-		    for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
-			metricptr=classptr->metrictbl+metricidx;
-			if (!strcmp(argtbl[0], metricptr->metricname)) {
-			    deviceptr=metricptr->devicetbl;
-			    deviceptr->scale = atof(argtbl[1]);
-			    legalparamflag = 1;
-			}
-		    }
-		} else {				/* multi-row array class */
-		    for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
-			metricptr=classptr->metrictbl+metricidx;
-
-			if (!strcmp(argtbl[0], metricptr->metricname)) {
-			    for (deviceidx=0; deviceidx<metricptr->numdevices;
-									deviceidx++) {
-				deviceptr=metricptr->devicetbl+deviceidx;
-				deviceptr->scale = atof(argtbl[1]);
-			    }
-			    legalparamflag = 1;
-			} else {
-			    for (deviceidx=0; deviceidx<metricptr->numdevices;
-									deviceidx++) {
-				deviceptr=metricptr->devicetbl+deviceidx;
-				sprintf(metric_device_name, "%s%s%s",
-					metricptr->metricname,
-					paramtbl[METDEVSEPARATORIDX].value.string,
-					deviceptr->devicename);
-				if (!strcmp(argtbl[0], metric_device_name)) {
-				    deviceptr->scale = atof(argtbl[1]);
-				    legalparamflag = 1;
-				    break;
-				}
-			    }
-			}
-		    }
-		}
-	    }
 
-	    /* Overwrite any paramtbl value with value(s) set in the config file */
-	    for (paramidx=0; paramidx<(int)NUMCONFIGPARAMS; paramidx++) {
-		paramptr = paramtbl+paramidx;
-		if (!strcmp(argtbl[0], paramptr->paramname)) {
-		    switch(paramptr->type) {
-			case CHAR:    paramptr->value.character = *argtbl[1]; break;
-			case FLTPNT:  paramptr->value.fltpnt    = atof(argtbl[1]); break;
-			case INTEGER: paramptr->value.longint   = atoi(argtbl[1]); break;
-			case STRING:
-			    paramptr->value.string = (char*)malloc(strlen(argtbl[1]));
-			    strcpy(paramptr->value.string, argtbl[1]);
-			    break;
-			default:
-			    fprintf(stderr, "SNARK: read_configfile\n");
-			    exit(1);
-			    break;
-		    }
+/*******************************************************************************
+--fleet: read the hosts' input files (in parallel, with numjobs > 1 worker
+threads) and merge them, aligned on frames: the earliest (next) data set of all
+the hosts, and those of the other hosts that are less than count*interval
+seconds after it, are output as one data set, at the time of the earliest. (So
+each host has at most one data set in a frame, and the frames follow the hosts'
+DATEs, which drift a little.) Returns the timestamp of the last frame.
+*******************************************************************************/
+time_t read_hosts(int numjobs, char *singlefilename, Outputfile **singlefileptrptr,
+							    char *multifiledirname) {
+    pthread_t	*threadtbl = NULL;
+    Host	*hostptr;
+    Dataset	*datasetptr;
+    Inputfile	*newdevicesifp;
+    time_t	frametimestamp = 0, mintimestamp;
+    long	framesecs = (long)count*interval;
+    int		hostidx, threadidx, numnewdevices, numhostnewdevices;
+    int		numthreads = numjobs > 1 ? MIN(numjobs, numhosts) : 0;
+    unsigned	linectr;
+
+    if (numthreads > 0 && (threadtbl=calloc(numthreads, sizeof(pthread_t))) == NULL) {
+	err_exit("read_hosts: calloc failed, aborting!");
+    }
+    for (threadidx=0; threadidx<numthreads; threadidx++) {
+	if ((errno=pthread_create(threadtbl+threadidx, NULL, parse_hosts, NULL)) != 0) {
+	    err_exit("Could not create thread %d, aborting!", threadidx);
+	}
+    }
 
-		    legalparamflag = 1;
-		    break;
-		}
+    while (1) {
+	start_phase(PARSEPHASE);
+	mintimestamp = 0;
+	for (hostidx=0; hostidx<numhosts; hostidx++) {
+	    if ((datasetptr=next_host_data_set(hosttbl+hostidx, numthreads > 0)) != NULL &&
+			    (mintimestamp == 0 || datasetptr->timestamp < mintimestamp)) {
+		mintimestamp = datasetptr->timestamp;
 	    }
-
-	    if (legalparamflag == 0) {
-		fprintf(stderr, "Ignoring unknown configuraton file parameter '%s'\n", argtbl[0]);
+	}
+	if (mintimestamp == 0) {
+	    break;
+	}
+	frametimestamp = mintimestamp;
+
+	numnewdevices = 0;
+	newdevicesifp = hosttbl->ifp;
+	linectr = 0;
+	for (hostidx=0; hostidx<numhosts; hostidx++) {
+	    hostptr = hosttbl+hostidx;
+	    if ((datasetptr=hostptr->headptr) != NULL &&
+			    datasetptr->timestamp < frametimestamp+framesecs) {
+		numhostnewdevices = store_data_set(hostptr->ifp->filename, datasetptr);
+		if (numhostnewdevices > 0 && numnewdevices == 0) {
+		    newdevicesifp = hostptr->ifp;
+		    linectr = datasetptr->endlinectr;
+		}
+		numnewdevices += numhostnewdevices;
+		release_host_data_set(hostptr, numthreads > 0);
+	    } else {
+		clear_host_values(hostptr);
 	    }
-	} else if (numargs != 0) {
-	    fprintf(stderr, "Bad configuration file line starting '%s'\n", argtbl[0]);
 	}
+	output_data_set(frametimestamp, numnewdevices, newdevicesifp->filename, linectr,
+			    singlefilename, singlefileptrptr, multifiledirname);
     }
-    fclose(configfileptr);
 
-    if (*paramtbl[TIMEZONEIDX].value.string != '\0') {
-	setenv("TZ", paramtbl[TIMEZONEIDX].value.string, 1);
-	tzset();
+    for (threadidx=0; threadidx<numthreads; threadidx++) {
+	pthread_join(threadtbl[threadidx], NULL);
+    }
+    for (hostidx=0; hostidx<numhosts; hostidx++) {
+	hostptr = hosttbl+hostidx;
+	while ((datasetptr=hostptr->freeptr) != NULL) {
+	    hostptr->freeptr = datasetptr->nextptr;
+	    free_data_set(datasetptr);
+	    free(datasetptr);
+	}
+	close_inputfile(hostptr->ifp);
     }
+    free(threadtbl);
+    return frametimestamp;
 }
 
 
 /*******************************************************************************
-Read and process a vector class stanza (of input file data), and update data
-values, e.g., number, max, sum for both the metric and the device.
+The --incremental state file records where (the input file and offset) the next
+run resumes reading, the statistics of all the metrics and devices so far, and
+which devices have single file columns and multiple files. It is (re)written,
+via a temporary file, at the end of each run:
+    STATE:
+    'inputfile' offset linectr timestamp firsttimestamp
+
+    METRICS:
+    class metric number min max sum mean m2 abovectr	(for each metric)
+
+    DEVICES:
+    class metric 'device' number min max sum mean m2 abovectr positive negative
+			zeroctr singlefileflag multifileflag singlefilevalue multifilevalue
+where (the sketch stores) positive and negative are minkey:counter,counter,...
+read_statefile reads the STATE stanza (before any input file is opened), and
+restore_state_devices the rest, once the classes and metrics are known. The
+state file must not exist for the first run.
 *******************************************************************************/
-void read_vector_stanza(char* inputfilename, Class *classptr) {
-    char	inputline[MAXINPUTLINELEN], *argtbl[MAXNUMMETRICS];
-    Metric	*metricptr;
-    Device	*deviceptr;
-    double	value;
-    int		numargs, metricidx;
-    int		rowidx = 0;
-
-    while (fgets(inputline, MAXINPUTLINELEN, inputfileptr)) {
-	inputlinectr++;
-	if ((numargs=parse_input_line(inputline, argtbl, MAXNUMMETRICS)) ==
-							classptr->nummetrics) {
-	    if (rowidx >= classptr->startrow) {
-		for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
-		    value = atof(argtbl[metricidx]);
-		    metricptr = classptr->metrictbl+metricidx;
-		    metricptr->number++;
-		    metricptr->max = MAX(metricptr->max, value);
-		    metricptr->sum += value;
-		    /* This _is_ required, at least for now! */ 
-		    deviceptr = metricptr->devicetbl;
-		    deviceptr->number++;
-		    deviceptr->max = MAX(metricptr->max, value);
-		    deviceptr->sum += value;
-		    *(deviceptr->valuetbl+rowidx) = value;
-		    /* This _is_ required, at least for now! */ 
-		}
-	    }
-	} else if (numargs == 0) {
-	    break;
-	} else {
-	    fprintf(stderr, "File %s line %d vector class %s: bad data starting '%s'\n",
-		    inputfilename, inputlinectr, classptr->classname, inputline);
+void read_statefile(char *statefilename) {
+    Inputfile	*ifp;
+    char	*lineptr, *lineendptr;
+    Token	argtbl[NUMSTATEARGS];
+
+    if ((statefileptr=calloc(1, sizeof(Statefile))) == NULL) {
+	err_exit("read_statefile: calloc failed, aborting!");
+    }
+    statefileptr->filename = statefilename;
+    if ((ifp=open_inputfile(statefilename)) == NULL) {
+	if (errno != ENOENT) {
+	    err_exit("Could not open state file '%s', aborting!", statefilename);
 	}
-	rowidx++;
+	return;					/* the first run */
     }
-    if (rowidx != count) {
-	fprintf(stderr, "File %s line %d vector class %s: expected %d rows, not %d\n",
-			inputfilename, inputlinectr, classptr->classname, count, rowidx);
+
+    skip_to_stanza(ifp, STATESTR, 1);
+    if ((lineptr=get_input_line(ifp, &lineendptr)) == NULL ||
+	    parse_input_line(lineptr, lineendptr, argtbl, NUMSTATEARGS) != NUMSTATEARGS) {
+	fprintf(stderr, "Bad state file '%s' line %d, aborting!\n", statefilename,
+								    ifp->linectr);
+	exit(1);
+    }
+    if ((statefileptr->inputfilename=malloc(argtbl[0].len+1)) == NULL) {
+	err_exit("read_statefile: malloc failed, aborting!");
     }
+    token_copy(statefileptr->inputfilename, argtbl, argtbl[0].len);
+    statefileptr->offset	 = token_to_long(argtbl+1);
+    statefileptr->linectr	 = token_to_long(argtbl+2);
+    statefileptr->timestamp	 = token_to_long(argtbl+3);
+    statefileptr->firsttimestamp = token_to_long(argtbl+4);
+    statefileptr->resumeflag	 = 1;
+    close_inputfile(ifp);
 }
 
+Metric* find_state_metric(Token argtbl[], Class **classptrptr) {
+    Metricentry	*metricentryptr;
+    int		metricentryidx;
 
-/*******************************************************************************
-Read and process an array class stanza (of input file data), and update data
-values, e.g., number, max, sum for both the metric and the device.
-*******************************************************************************/
-void read_array_stanza(char* inputfilename, Class *classptr) {
-    char	inputline[MAXINPUTLINELEN], *argtbl[MAXNUMMETRICS+1];
+    if ((metricentryidx=find_name(&metricnameindex, argtbl[1].ptr, argtbl[1].len)) < 0) {
+	return NULL;
+    }
+    metricentryptr = metricentrytbl+metricentryidx;
+    if (!token_equals(argtbl, metricentryptr->classptr->classname)) {
+	return NULL;
+    }
+    *classptrptr = metricentryptr->classptr;
+    return metricentryptr->metricptr;
+}
+
+void restore_sketch_store(Sketchstore *storeptr, Token *tokenptr) {
+    char	*ptr = tokenptr->ptr, *endptr = tokenptr->ptr+tokenptr->len;
+    int		key;
+    unsigned	number;
+
+    key = strtol(ptr, &ptr, 10);
+    while (ptr < endptr && (*ptr == ':' || *ptr == ',')) {
+	if ((number=strtoul(ptr+1, &ptr, 10)) > 0) {
+	    add_to_sketch_store(storeptr, key, number);
+	}
+	key++;
+    }
+}
+
+void restore_state_devices() {
+    Inputfile	*ifp;
+    char	*lineptr, *lineendptr;
+    Token	argtbl[NUMDEVICESTATEARGS];
+    Class	*classptr;
+    Metric	*metricptr;
     Device	*deviceptr;
-    double	value;
-    int		numargs, metricidx, deviceidx;
-    Metric	*metricptr = NULL;
-    int		rowidx = 0;
-
-    while (fgets(inputline, MAXINPUTLINELEN, inputfileptr)) {
-	inputlinectr++;
-	if ((numargs=parse_input_line(inputline, argtbl, MAXNUMMETRICS+1)) ==
-							classptr->nummetrics+1) {
-	    for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
-		metricptr = classptr->metrictbl+metricidx;
-		if (rowidx/metricptr->numdevices >= classptr->startrow) {
-		    value = atof(argtbl[metricidx+1]);
-		    metricptr->number++;
-		    metricptr->max = MAX(metricptr->max, value);
-		    metricptr->sum += value;
-		    deviceidx = rowidx % metricptr->numdevices;
-		    deviceptr = metricptr->devicetbl+deviceidx;
-		    deviceptr->number++;
-		    deviceptr->max = MAX(deviceptr->max, value);
-		    deviceptr->sum += value;
-		    *(deviceptr->valuetbl+(rowidx/metricptr->numdevices)) = value;
-		    /* integer division!!! ^^^^^^/^^^^^^^^^^^^^^^^^^^^^ */
-		} else {
-		    break;
-		}
-	    }
-	} else if (numargs == 0) {
+    int		numargs, deviceidx;
+
+    if ((ifp=open_inputfile(statefileptr->filename)) == NULL) {
+	err_exit("Could not open state file '%s', aborting!", statefileptr->filename);
+    }
+
+    skip_to_stanza(ifp, METRICSSTR, 1);
+    while ((lineptr=get_input_line(ifp, &lineendptr)) != NULL &&
+	    (numargs=parse_input_line(lineptr, lineendptr, argtbl, NUMMETRICSTATEARGS)) > 0) {
+	if (numargs != NUMMETRICSTATEARGS ||
+				(metricptr=find_state_metric(argtbl, &classptr)) == NULL) {
 	    break;
-	} else {
-	    fprintf(stderr, "File %s line %d array class %s: bad data starting '%s'\n",
-		    inputfilename, inputlinectr, classptr->classname, inputline);
 	}
-	rowidx++;
+	metricptr->number = token_to_long(argtbl+2);
+	token_to_value(argtbl+3, &metricptr->min);
+	token_to_value(argtbl+4, &metricptr->max);
+	token_to_value(argtbl+5, &metricptr->sum);
+	token_to_value(argtbl+6, &metricptr->mean);
+	token_to_value(argtbl+7, &metricptr->m2);
+	metricptr->abovectr = token_to_long(argtbl+8);
     }
-    if (rowidx != count*metricptr->numdevices) {
-	fprintf(stderr, "File %s line %d array class %s: expected %d rows, not %d\n",
-				    inputfilename, inputlinectr, classptr->classname,
-				    count*metricptr->numdevices, rowidx);
+    if (lineptr != NULL && numargs > 0) {
+	fprintf(stderr, "Bad state file '%s' line %d (not for these input files?), aborting!\n",
+						    statefileptr->filename, ifp->linectr);
+	exit(1);
+    }
+
+    skip_to_stanza(ifp, DEVICESSTR, 1);
+    while ((lineptr=get_input_line(ifp, &lineendptr)) != NULL &&
+	    (numargs=parse_input_line(lineptr, lineendptr, argtbl, NUMDEVICESTATEARGS)) > 0) {
+	if (numargs < NUMDEVICESTATEARGS-2 ||		/* (no --sparse values: NAN) */
+				(metricptr=find_state_metric(argtbl, &classptr)) == NULL) {
+	    break;
+	}
+	if ((deviceidx=find_device(classptr, argtbl[2].ptr, argtbl[2].len, 0)) < 0) {
+	    if (classptr->classtype == VECTORCLASS) {
+		break;
+	    }
+	    deviceidx = add_device(classptr, argtbl[2].ptr, argtbl[2].len);
+	}
+	deviceptr = metricptr->devicetbl+deviceidx;
+	deviceptr->number = token_to_long(argtbl+3);
+	token_to_value(argtbl+4, &deviceptr->min);
+	token_to_value(argtbl+5, &deviceptr->max);
+	token_to_value(argtbl+6, &deviceptr->sum);
+	token_to_value(argtbl+7, &deviceptr->mean);
+	token_to_value(argtbl+8, &deviceptr->m2);
+	deviceptr->abovectr	  = token_to_long(argtbl+9);
+	restore_sketch_store(&deviceptr->sketch.positive, argtbl+10);
+	restore_sketch_store(&deviceptr->sketch.negative, argtbl+11);
+	deviceptr->sketch.zeroctr = token_to_long(argtbl+12);
+	deviceptr->singlefileflag = token_to_long(argtbl+13);
+	deviceptr->appendflag	  = token_to_long(argtbl+14);
+	if (numargs == NUMDEVICESTATEARGS) {	/* --sparse: the last values written */
+	    token_to_value(argtbl+15, &deviceptr->singlefilevalue);
+	    token_to_value(argtbl+16, &deviceptr->multifilevalue);
+	}
     }
+    if (lineptr != NULL && numargs > 0) {
+	fprintf(stderr, "Bad state file '%s' line %d (not for these input files?), aborting!\n",
+						    statefileptr->filename, ifp->linectr);
+	exit(1);
+    }
+    close_inputfile(ifp);
 }
 
+void write_sketch_store(FILE *fileptr, Sketchstore *storeptr) {
+    int		idx;
 
-/*******************************************************************************
-Write the header (first line) to all of the "active" (scale != 0) metric and
-metric_device files using formatting specified by the relevant paramtbl entry.
-*******************************************************************************/
-void output_singlefile_headers(FILE *singlefileptr) {
+    fprintf(fileptr, "%d", storeptr->minkey);
+    for (idx=0; idx<storeptr->numkeys; idx++) {
+	fprintf(fileptr, "%c%u", idx == 0 ? ':' : ',', storeptr->countertbl[idx]);
+    }
+    fputc(' ', fileptr);
+}
+
+void write_statefile() {
+    char	tmpfilename[MAXPATHNAMELEN];
+    FILE	*fileptr;
     Class	*classptr;
     Metric	*metricptr;
     Device	*deviceptr;
     int		classidx, metricidx, deviceidx;
 
-    fprintf(singlefileptr, "Time");
-    for (classidx=0; classidx<numclasses; classidx++) {	/* loop thru classes */
+    snprintf(tmpfilename, MAXPATHNAMELEN, "%s.tmp", statefileptr->filename);
+    if ((fileptr=fopen(tmpfilename, "w")) == NULL) {
+	err_exit("Could not create/open file '%s', aborting!", tmpfilename);
+    }
+    fprintf(fileptr, "# pma --incremental state file - do not edit!\n%s\n", STATESTR);
+    fprintf(fileptr, "%c%s%c %lld %u %ld %ld\n\n", QUOTECHAR, statefileptr->inputfilename,
+			QUOTECHAR, (long long)statefileptr->offset, statefileptr->linectr,
+			(long)statefileptr->timestamp, (long)firsttimestamp);
+
+    fprintf(fileptr, "%s\n", METRICSSTR);
+    for (classidx=0; classidx<numclasses; classidx++) {
 	classptr = classtbl+classidx;
 	for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
 	    metricptr = classptr->metrictbl+metricidx;
+	    fprintf(fileptr, "%s %s %d %.17g %.17g %.17g %.17g %.17g %d\n", classptr->classname,
+		    metricptr->metricname, metricptr->number, metricptr->min, metricptr->max,
+		    metricptr->sum, metricptr->mean, metricptr->m2, metricptr->abovectr);
+	}
+    }
 
-	    if (classptr->classtype == VECTORCLASS) {
-		deviceptr = metricptr->devicetbl;
-		if (deviceptr->scale != 0) {
-		    fprintf(singlefileptr, "%c%s",
-				    paramtbl[SINGFILEDELIMITERIDX].value.character,
-				    metricptr->metricname);
-		}
-	    } else {
-		for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
-		    deviceptr = metricptr->devicetbl+deviceidx;
-		    if (deviceptr->scale != 0) {
-			fprintf(singlefileptr, "%c%s%s%s",
-				    paramtbl[SINGFILEDELIMITERIDX].value.character,
-				    metricptr->metricname,
-				    paramtbl[METDEVSEPARATORIDX].value.string,
-				    deviceptr->devicename);
-		    }
-		}
+    fprintf(fileptr, "\n%s\n", DEVICESSTR);
+    for (classidx=0; classidx<numclasses; classidx++) {
+	classptr = classtbl+classidx;
+	for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	    metricptr = classptr->metrictbl+metricidx;
+	    for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
+		deviceptr = metricptr->devicetbl+deviceidx;
+		fprintf(fileptr, "%s %s %c%s%c %d %.17g %.17g %.17g %.17g %.17g %d ",
+			classptr->classname, metricptr->metricname, QUOTECHAR,
+			deviceptr->devicename, QUOTECHAR, deviceptr->number, deviceptr->min,
+			deviceptr->max, deviceptr->sum, deviceptr->mean, deviceptr->m2,
+			deviceptr->abovectr);
+		write_sketch_store(fileptr, &deviceptr->sketch.positive);
+		write_sketch_store(fileptr, &deviceptr->sketch.negative);
+		fprintf(fileptr, "%u %d %d %.17g %.17g\n", deviceptr->sketch.zeroctr,
+			deviceptr->singlefileflag, deviceptr->appendflag,
+			deviceptr->singlefilevalue, deviceptr->multifilevalue);
 	    }
 	}
     }
-    fprintf(singlefileptr, "\n");
+    if (fclose(fileptr) != 0 || rename(tmpfilename, statefileptr->filename) != 0) {
+	err_exit("Could not write state file '%s', aborting!", statefileptr->filename);
+    }
 }
 
 
 /*******************************************************************************
-Write the data for all of the current stanzas for all active (scale != 0)
-metrics and metric_devices to a single file.
+--follow: wait (at most FOLLOWPOLLSECS) for the input file to be written to, or
+for a signal. (inotify is used if it is available, otherwise it just sleeps.)
 *******************************************************************************/
-void output_singlefile_body(FILE *singlefileptr, time_t timestamp) {
-    Class	*classptr;
-    Metric	*metricptr;
-    Device	*deviceptr;
-    int		rowidx, classidx, metricidx, deviceidx;
-    char	timestampstr[MAXTMSTPSTRLEN];
-    struct tm	*timestampstructptr;
-    time_t	rowtimestamp;
-    double	*valueptr;
+void wait_for_input(Inputfile *ifp) {
+#ifdef __linux__
+    static int		inotifyfd = -2;
+    struct pollfd	pollfdbuf;
+    char		eventbuf[4096];
+
+    if (inotifyfd == -2 && (inotifyfd=inotify_init()) >= 0 &&
+			inotify_add_watch(inotifyfd, ifp->filename, IN_MODIFY) < 0) {
+	close(inotifyfd);
+	inotifyfd = -1;
+    }
+    if (inotifyfd >= 0) {
+	pollfdbuf.fd     = inotifyfd;
+	pollfdbuf.events = POLLIN;
+	if (poll(&pollfdbuf, 1, FOLLOWPOLLSECS*1000) > 0 &&
+			read(inotifyfd, eventbuf, sizeof(eventbuf)) < 0 && errno != EINTR) {
+	    err_exit("Could not read inotify events for '%s', aborting!", ifp->filename);
+	}
+	return;
+    }
+#endif
+    sleep(FOLLOWPOLLSECS);
+}
 
-    for (rowidx=0; rowidx<count; rowidx++) {
-	rowtimestamp = timestamp+(rowidx+1)*interval;
-					    /* NOT UTC!!! the collector timezone!!! */
-	timestampstructptr = localtime(&rowtimestamp);
-	strftime(timestampstr, MAXTMSTPSTRLEN,
-			paramtbl[SINGFILEDATEFMTIDX].value.string, timestampstructptr);
-	fprintf(singlefileptr, "%s", timestampstr);
+void stop_following(int signum) {
+    (void)signum;
+    stopflag = 1;
+}
 
-	for (classidx=0; classidx<numclasses; classidx++) {	/* loop thru classes */
-	    classptr = classtbl+classidx;
 
-	    for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
-		metricptr = classptr->metrictbl+metricidx;
+/*******************************************************************************
+--follow: like tail -f, process (and output) the data sets of the input file as
+they are appended to it. At EOF, a data set that is not complete yet is re-read
+(from its start) once more has been written. The outputs (and the --incremental
+state file) are brought up to date every time. Returns the timestamp of the
+last data set processed (0 if none) after a SIGINT or SIGTERM.
+*******************************************************************************/
+time_t follow_inputfile(Inputfile *ifp, char *singlefilename, Outputfile **singlefileptrptr,
+							    char *multifiledirname) {
+    Dataset	dataset;
+    time_t	lasttimestamp = 0;
 
-		if (classptr->classtype == VECTORCLASS) {
-		    deviceptr = metricptr->devicetbl;
-		    if (deviceptr->scale != 0) {
-			valueptr=deviceptr->valuetbl;
-			if (rowidx >= classptr->startrow) {
-			    fprintf(singlefileptr, "%c%.1f",
-				paramtbl[SINGFILEDELIMITERIDX].value.character,
-				fullscale / deviceptr->scale * valueptr[rowidx]);
-			} else {
-			    fprintf(singlefileptr, "%c",
-				    paramtbl[SINGFILEDELIMITERIDX].value.character);
-			}
-		    }
-		} else {
-		    for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
-			deviceptr = metricptr->devicetbl+deviceidx;
-			if (deviceptr->scale != 0) {
-			    valueptr=deviceptr->valuetbl;
-			    if (rowidx >= classptr->startrow) {
-				fprintf(singlefileptr, "%c%.1f",
-				    paramtbl[SINGFILEDELIMITERIDX].value.character,
-				    fullscale / deviceptr->scale * valueptr[rowidx]);
-			    } else {
-				fprintf(singlefileptr, "%c",
-				    paramtbl[SINGFILEDELIMITERIDX].value.character);
-			    }
-			}
-		    }
-		}
+    memset(&dataset, 0, sizeof(Dataset));
+    while (!stopflag) {
+	start_phase(PARSEPHASE);
+	while (read_data_set(ifp, &dataset) && dataset.completeflag) {
+	    process_data_set(ifp->filename, &dataset, singlefilename, singlefileptrptr,
+							    multifiledirname);
+	    lasttimestamp = dataset.timestamp;
+	    start_phase(PARSEPHASE);
+	}
+	discard_data_set_messages(&dataset);
+	if (!seek_inputfile(ifp, dataset.startoffset, dataset.startlinectr)) {
+	    fprintf(stderr, "E: Input file '%s' has been truncated, stopping\n",
+								ifp->filename);
+	    break;
+	}
+	if (!firstdatasetflag) {
+	    flush_output_files(*singlefileptrptr);
+	    if (statefileptr != NULL) {
+		write_statefile();
 	    }
 	}
-	fprintf(singlefileptr, "\n");
+	wait_for_input(ifp);
     }
+    free_data_set(&dataset);
+    return lasttimestamp;
 }
 
 
 /*******************************************************************************
-Open one multi file output file. (It will be truncated if it already exists!!!)
+--serve socket_name: answer queries about the data on a Unix socket, while the
+input files are read (and the last one followed, as for --follow). The rows
+that are output (of the active - scale != 0 - metrics and metric_devices) are
+kept in memory by store_serve_rows, as are the (whole run) statistics. A request
+is an HTTP GET (e.g., curl --unix-socket socket_name 'http://pma/names'), or just
+its target on a line (e.g., echo /names | nc -U socket_name), which is answered
+without the HTTP headers:
+  /names[?format=csv|json]
+	each stored series (metric or metric_device), its number of samples, min,
+	max, mean and (approximate) median, 95th and 99th percentiles (unscaled).
+  /series?name=glob[&name=glob ...][&from=timestamp][&to=timestamp]
+			[&bucket=seconds][&aggregate=mean|max|min][&format=csv|json|binary]
+	the rows (from and to are epoch seconds, inclusive) of the series whose
+	names match a glob, and, with bucket, one row (of the aggregate of the
+	samples) per bucket, timed as --bucket does. csv: Time (epoch seconds)
+	and the values (scaled, like the single file - empty if there isn't one),
+	json: {"names":[...],"rows":[[time,value,...],...]} (null if there isn't
+	one), binary: the -f binary format, with all the rows in one block.
+One thread answers the requests, one at a time. servemutex is only locked while
+a response's rows are copied from the store, so the input files are still read.
 *******************************************************************************/
-FILE* open_multifile(char* filerelpath) {
-    FILE	*fileptr;
+void open_serve_socket() {
+    struct sockaddr_un	addr;
+    struct stat		statbuf;
+    int			fd;
 
-    if ((fileptr=fopen(filerelpath, "w")) == NULL) {
-	err_exit("Could not create/open file '%s', aborting!", filerelpath);
+    if (strlen(servesocketname) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "Socket name '%s' is too long, aborting!\n", servesocketname);
+	exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, servesocketname);
+
+    if (lstat(servesocketname, &statbuf) == 0 && S_ISSOCK(statbuf.st_mode)) {
+	if ((fd=socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
+			connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+	    fprintf(stderr, "Socket '%s' is being served (by another pma), aborting!\n",
+								servesocketname);
+	    exit(1);
+	}
+	if (fd >= 0) {
+	    close(fd);
+	}
+	unlink(servesocketname);		/* (left by a server that has stopped) */
+    }
+    if ((servesocketfd=socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+		bind(servesocketfd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+		listen(servesocketfd, SERVEBACKLOG) != 0) {
+	err_exit("Could not create socket '%.80s', aborting!", servesocketname);
     }
-    return fileptr;
 }
 
 
 /*******************************************************************************
-If the multifiledirname directory does not exist, create it. Then open a multi
-output file for each metric (and metric_device) whose scale is not zero. If the
-file already exists, truncate it.
+Decode (in place) a URL encoded query value: %XX is the character XX (hex), and
++ is a space.
 *******************************************************************************/
-void prepare_multi_output_files(char *multifiledirname) {
-    char	filerelpath[MAXPATHNAMELEN], formatstr[MAXFORMATSTRLEN];
-    char	metric_device_name[MAXMETDEVNAMELEN];
-    struct stat	statbuf;
-    Class	*classptr;
-    Metric	*metricptr;
-    Device	*deviceptr;
-    int		classidx, metricidx, deviceidx;
-
-    if (multifiledirname == NULL) {
-	return;
-    }
-
-    if (stat(multifiledirname, &statbuf) != 0) {	/* if multifiledirname does not exist, */
-	if (mkdir(multifiledirname, MULTIDIRMODE) != 0) {	/* create it */
-	    err_exit("Could not create/open directory '%s', aborting!", multifiledirname);
+char* decode_query_value(char *valuestr) {
+    char	*fromptr, *toptr, hexstr[3];
+
+    for (fromptr=toptr=valuestr; *fromptr != '\0'; fromptr++, toptr++) {
+	if (*fromptr == '%' && isxdigit((unsigned char)fromptr[1]) &&
+				    isxdigit((unsigned char)fromptr[2])) {
+	    hexstr[0] = fromptr[1];
+	    hexstr[1] = fromptr[2];
+	    hexstr[2] = '\0';
+	    *toptr = (char)strtol(hexstr, NULL, 16);
+	    fromptr += 2;
+	} else {
+	    *toptr = *fromptr == '+' ? ' ' : *fromptr;
 	}
-	stat(multifiledirname, &statbuf);		/* and get it's details */
     }
+    *toptr = '\0';
+    return valuestr;
+}
 
-    if ((statbuf.st_mode&S_IFMT) != S_IFDIR || (statbuf.st_mode&S_IWUSR) == 0) {
-	fprintf(stderr, "'%s' is not a writable directory, aborting\n", multifiledirname);
-	exit(1);
+
+/* a device's (approximate) q quantile, within its min and max (NAN: no samples) */
+double serve_quantile(Device *deviceptr, double q) {
+    if (deviceptr->number == 0) {
+	return NAN;
     }
+    return MIN(deviceptr->max, MAX(deviceptr->min,
+			sketch_quantile(&deviceptr->sketch, deviceptr->number, q)));
+}
 
-    for (classidx=0; classidx<numclasses; classidx++) {	/* loop through the classes */
+
+/*******************************************************************************
+Copy (with servemutex locked) the stored series whose names match one of the
+globs - or all of them (numnames 0) - and their statistics, to a table (which
+is returned, with the number of series in *numseriesptr). A series' names point
+to those of its class, metric and device, which are never freed.
+*******************************************************************************/
+Serveseries* select_serve_series(char **nametbl, int numnames, int *numseriesptr) {
+    Serveseries	*seriestbl = NULL, *seriesptr;
+    Class	*classptr;
+    Metric	*metricptr;
+    Device	*deviceptr;
+    char	namestr[MAXPATHNAMELEN];
+    int		classidx, metricidx, deviceidx, maxseries = 0;
+
+    *numseriesptr = 0;
+    for (classidx=0; classidx<numclasses; classidx++) {
 	classptr = classtbl+classidx;
 	for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
-	    metricptr=classptr->metrictbl+metricidx;
-	    if (classptr->classtype == VECTORCLASS) {
-		deviceptr = metricptr->devicetbl;
-		if (deviceptr->scale != 0) {
-		    sprintf(filerelpath, "%s/%s", multifiledirname, metricptr->metricname);
-		    deviceptr->fileptr = open_multifile(filerelpath);
-
-		    sprintf(formatstr, "%s\n", paramtbl[MULTIFILEHEADERFMTIDX].value.string);
-		    fprintf(deviceptr->fileptr, formatstr, metricptr->metricname,
-									deviceptr->scale);
+	    metricptr = classptr->metrictbl+metricidx;
+	    for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
+		deviceptr = metricptr->devicetbl+deviceidx;
+		if (deviceptr->servevaluetbl == NULL) {
+		    continue;
 		}
-	    } else {
-		for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
-		    deviceptr = metricptr->devicetbl+deviceidx;
-		    if (deviceptr->scale != 0) {
-			sprintf(filerelpath, "%s/%s%s%s", multifiledirname, metricptr->metricname,
-				    paramtbl[METDEVSEPARATORIDX].value.string,
-				    deviceptr->devicename);
-			deviceptr->fileptr = open_multifile(filerelpath);
-			sprintf(metric_device_name, "%s%s%s", metricptr->metricname,
-				paramtbl[METDEVSEPARATORIDX].value.string, deviceptr->devicename);
-			sprintf(formatstr, "%s\n", paramtbl[MULTIFILEHEADERFMTIDX].value.string);
-			fprintf(deviceptr->fileptr, formatstr, metric_device_name,
-									deviceptr->scale);
+		if (classptr->classtype == VECTORCLASS) {
+		    snprintf(namestr, MAXPATHNAMELEN, "%s", metricptr->metricname);
+		} else {
+		    snprintf(namestr, MAXPATHNAMELEN, "%s%s%s", metricptr->metricname,
+				paramtbl[METDEVSEPARATORIDX].value.string,
+				deviceptr->devicename);
+		}
+		if (numnames > 0 && !match_pattern(nametbl, numnames, namestr)) {
+		    continue;
+		}
+		if (*numseriesptr == maxseries) {
+		    maxseries = MAX(MINNUMDEVICES, 2*maxseries);
+		    if ((seriestbl=realloc(seriestbl, maxseries*sizeof(Serveseries))) == NULL) {
+			err_exit("select_serve_series: realloc failed, aborting!");
 		    }
 		}
+		seriesptr = seriestbl+(*numseriesptr)++;
+		if ((seriesptr->name=strdup(namestr)) == NULL) {
+		    err_exit("select_serve_series: strdup failed, aborting!");
+		}
+		seriesptr->classname  = classptr->classname;
+		seriesptr->metricname = metricptr->metricname;
+		seriesptr->devicename = classptr->classtype == VECTORCLASS ? "" :
+							    deviceptr->devicename;
+		seriesptr->scale      = deviceptr->scale;
+		seriesptr->deviceptr  = deviceptr;
+		seriesptr->number     = deviceptr->number;
+		seriesptr->min	      = deviceptr->number > 0 ? deviceptr->min  : NAN;
+		seriesptr->max	      = deviceptr->number > 0 ? deviceptr->max  : NAN;
+		seriesptr->mean	      = deviceptr->number > 0 ? deviceptr->mean : NAN;
+		seriesptr->p50	      = serve_quantile(deviceptr, 0.50);
+		seriesptr->p95	      = serve_quantile(deviceptr, 0.95);
+		seriesptr->p99	      = serve_quantile(deviceptr, 0.99);
 	    }
 	}
     }
-    sprintf(filerelpath, "%s/%s", multifiledirname,
-				    paramtbl[CLOCKTICKSFILENAMEIDX].value.string);
-    clockticksfileptr = open_multifile(filerelpath);
+    return seriestbl;
 }
 
 
 /*******************************************************************************
-Write the data for all of the current stanzas for all active (scale != 0)
-metrics and metric_devices to all the relevant multiple file output files.
+Copy (with servemutex locked) the rows of the stored series from fromtime to
+totime (0: the last one) to timetbl and (row major) valuetbl - one row per
+bucket (of bucket seconds, if it isn't 0), aggregated by function aggregate.
+Returns the number of rows.
 *******************************************************************************/
-void output_multifile_bodies_data(time_t timestamp) {
-    Class	*classptr;
-    Metric	*metricptr;
+int copy_serve_rows(Serveseries seriestbl[], int numseries, time_t fromtime,
+		    time_t totime, int bucket, int aggregate, time_t **timetblptr,
+							    double **valuetblptr) {
+    time_t	*timetbl = NULL, rowtimestamp;
+    double	*valuetbl = NULL, *valueptr = NULL, value;
+    int		*ctrtbl = NULL;
+    int		lowidx = 0, highidx = numserverows, rowidx, seriesidx, numrows = 0;
+    long	bucketidx, lastbucketidx = -1;
     Device	*deviceptr;
-    int		rowidx, classidx, metricidx, deviceidx;
-    char	timestampstr[MAXTMSTPSTRLEN];
-    struct tm	*timestampstructptr;
-    time_t	rowtimestamp;
-    double	*valueptr;
 
-    for (rowidx=0; rowidx<count; rowidx++) {
-	rowtimestamp = timestamp+(rowidx+1)*interval;
-	timestampstructptr = localtime(&rowtimestamp);
-	strftime(timestampstr, MAXTMSTPSTRLEN,
-			paramtbl[MULTIFILEDATEFMTIDX].value.string, timestampstructptr);
-
-	for (classidx=0; classidx<numclasses; classidx++) {	/* loop thru classes */
-	    classptr = classtbl+classidx;
-	    for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
-		metricptr = classptr->metrictbl+metricidx;
+    while (lowidx < highidx) {		/* the first row at or after fromtimestamp */
+	rowidx = lowidx+(highidx-lowidx)/2;
+	if (servetimetbl[rowidx] < fromtime) {
+	    lowidx = rowidx+1;
+	} else {
+	    highidx = rowidx;
+	}
+    }
+    for (highidx=lowidx; highidx<numserverows && (totime == 0 ||
+				    servetimetbl[highidx] <= totime); highidx++) {
+    }
+    if (highidx > lowidx && ((timetbl=malloc((highidx-lowidx)*sizeof(time_t))) == NULL ||
+	    (valuetbl=malloc((size_t)(highidx-lowidx)*numseries*sizeof(double)+1)) == NULL ||
+	    (ctrtbl=malloc(numseries*sizeof(int)+1)) == NULL)) {
+	err_exit("copy_serve_rows: malloc failed, aborting!");
+    }
 
-		if (classptr->classtype == VECTORCLASS) {
-		    deviceptr = metricptr->devicetbl;
-		    if (deviceptr->scale != 0) {
-			valueptr=deviceptr->valuetbl;
-			if (rowidx >= classptr->startrow) {
-			    fprintf(deviceptr->fileptr, "%s%c%.1f\n", timestampstr,
-				paramtbl[MULTIFILEDELIMITERIDX].value.character,
-				fullscale / deviceptr->scale * valueptr[rowidx]);
-			}
-		    }
-		} else {
-		    for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
-			deviceptr = metricptr->devicetbl+deviceidx;
-			if (deviceptr->scale != 0) {
-			    valueptr=deviceptr->valuetbl;
-			    if (rowidx >= classptr->startrow) {
-				fprintf(deviceptr->fileptr, "%s%c%.1f\n", timestampstr,
-				paramtbl[MULTIFILEDELIMITERIDX].value.character,
-				fullscale / deviceptr->scale * valueptr[rowidx]);
-			    }
-			}
-		    }
+    for (rowidx=lowidx; rowidx<highidx; rowidx++) {
+	rowtimestamp = servetimetbl[rowidx];
+	bucketidx = bucket > 0 ? (rowtimestamp-1)/bucket : rowidx;
+	if (bucketidx != lastbucketidx) {		/* a new (output) row */
+	    timetbl[numrows] = bucket > 0 ? (bucketidx+1)*bucket : rowtimestamp;
+	    valueptr = valuetbl+(size_t)numrows*numseries;
+	    for (seriesidx=0; seriesidx<numseries; seriesidx++) {
+		valueptr[seriesidx] = NAN;
+		ctrtbl[seriesidx]   = 0;
+	    }
+	    numrows++;
+	    lastbucketidx = bucketidx;
+	}
+	for (seriesidx=0; seriesidx<numseries; seriesidx++) {
+	    deviceptr = seriestbl[seriesidx].deviceptr;
+	    if (rowidx < deviceptr->servefirstrow ||
+		    isnan(value=deviceptr->servevaluetbl[rowidx-deviceptr->servefirstrow])) {
+		continue;
+	    }
+	    if (ctrtbl[seriesidx]++ == 0) {
+		valueptr[seriesidx] = value;
+	    } else if (aggregate == MEANBUCKET) {
+		valueptr[seriesidx] += value;
+	    } else if (aggregate == MAXBUCKET) {
+		valueptr[seriesidx] = MAX(valueptr[seriesidx], value);
+	    } else {
+		valueptr[seriesidx] = MIN(valueptr[seriesidx], value);
+	    }
+	}
+	if (aggregate == MEANBUCKET && (rowidx+1 == highidx || (bucket > 0 ?
+			(servetimetbl[rowidx+1]-1)/bucket : rowidx+1) != bucketidx)) {
+	    for (seriesidx=0; seriesidx<numseries; seriesidx++) {
+		if (ctrtbl[seriesidx] > 1) {		/* (the end of the bucket) */
+		    valueptr[seriesidx] /= ctrtbl[seriesidx];
 		}
 	    }
 	}
     }
+    free(ctrtbl);
+    *timetblptr  = timetbl;
+    *valuetblptr = valuetbl;
+    return numrows;
 }
 
 
 /*******************************************************************************
-Clockticks is a special "extra" multiple file output file that contains data
-that is useful for visualizing the time scale for graphical utilities that don't
-handle a time axis well (such as xgraph).
+Write (the start of) a response: the HTTP status line and headers, if the
+request was an HTTP one.
 *******************************************************************************/
-void populate_clockticks(time_t lasttimestamp) {
-    char	formatstr[MAXFORMATSTRLEN];
-    time_t	clockticktbl[NUMCLOCKTICKSLEVELS], begtimestamp, endtimestamp, timestamp;
-    struct tm	*timestampstructptr;
-    Param	*paramptr;
-    int		paramidx, levelidx, clockticktime;
-    int		levelctr = 0;
-    time_t	minclocktick = 10*365*24*60*60;	/* insanely unusably large value */
+void put_response_header(Outputfile *ofp, int httpflag, char *statusstr,
+							    char *contenttypestr) {
+    char	headerstr[MAXPATHNAMELEN];
+
+    if (httpflag) {
+	put_string(ofp, headerstr, snprintf(headerstr, MAXPATHNAMELEN,
+		    "HTTP/1.0 %s\r\nContent-Type: %s\r\nConnection: close\r\n\r\n",
+		    statusstr, contenttypestr));
+    }
+}
 
-    for (paramidx=CLOCKTICKSLEV0IDX; paramidx<=CLOCKTICKSLEV7IDX; paramidx++) {
-	paramptr = paramtbl+paramidx;
-	if (paramptr->value.longint > 0) {
-	    clockticktbl[levelctr] = paramptr->value.longint;
-	    minclocktick = MIN(paramptr->value.longint, minclocktick);
+void put_error_response(Outputfile *ofp, int httpflag, char *statusstr, char *messagestr) {
+    put_response_header(ofp, httpflag, statusstr, "text/plain");
+    put_string(ofp, "E: ", 3);
+    put_string(ofp, messagestr, strlen(messagestr));
+    put_char(ofp, '\n');
+}
 
-	    /* ensure all non-zero clocktick levels are multiples of each other */
-	    if (levelctr > 0 && (clockticktbl[levelctr-1] % clockticktbl[levelctr] != 0)) {
-		fprintf(stderr,
-			"clockticks level %d (%ld) is not a multple of level %d (%ld)\n",
-			levelctr-1, clockticktbl[levelctr-1], levelctr, clockticktbl[levelctr]);
-		return;
-	    }
-	    levelctr++;
-	} else {	/* exit at first non-positive value */
-	    break;
+void put_json_string(Outputfile *ofp, char *str) {
+    put_char(ofp, '"');
+    for (; *str != '\0'; str++) {
+	if (*str == '"' || *str == '\\') {
+	    put_char(ofp, '\\');
 	}
+	put_char(ofp, *str);
     }
-    if (levelctr == 0) {
-	fprintf(stderr, "No valid clockticks levels specified!\n");
+    put_char(ofp, '"');
+}
+
+void put_json_value(Outputfile *ofp, double value) {
+    if (isfinite(value)) {
+	put_value(ofp, value);
+    } else {
+	put_string(ofp, "null", 4);
     }
+}
 
-    sprintf(formatstr, "%s\n", paramtbl[MULTIFILEHEADERFMTIDX].value.string);
-    fprintf(clockticksfileptr, formatstr, paramtbl[CLOCKTICKSFILENAMEIDX].value.string,
-									    fullscale);
-    /* Begin the clockticks a bit before the first data, and ... */
-    begtimestamp = firsttimestamp/minclocktick*minclocktick;
-    /* end them a bit after the last data */
-    endtimestamp = ((lasttimestamp+count*interval)/minclocktick+1)*minclocktick;
-
-    for (timestamp=begtimestamp; timestamp<=endtimestamp; timestamp+=minclocktick) {
-	timestampstructptr = localtime(&timestamp);
-	clockticktime = 3600*timestampstructptr->tm_hour + 60*timestampstructptr->tm_min +
-							    timestampstructptr->tm_sec;
-	for (levelidx=0; levelidx<levelctr; levelidx++) {
-	    if (clockticktime % clockticktbl[levelidx] == 0) {
-		strftime(formatstr, MAXTMSTPSTRLEN,
-			paramtbl[MULTIFILEDATEFMTIDX].value.string, timestampstructptr);
-		fprintf(clockticksfileptr, "%s 0\n",  formatstr);
-		fprintf(clockticksfileptr, "%s %d\n", formatstr, 2*(levelidx-levelctr));
-		break;
+void put_long(Outputfile *ofp, long number) {
+    char	numstr[MAXNUMSTRLEN];
+
+    put_string(ofp, numstr, snprintf(numstr, MAXNUMSTRLEN, "%ld", number));
+}
+
+
+/*******************************************************************************
+Write the /names response: each series and its statistics.
+*******************************************************************************/
+void output_serve_names(Outputfile *ofp, int httpflag, int jsonflag,
+					    Serveseries seriestbl[], int numseries) {
+    Serveseries	*seriesptr;
+    double	*statptrtbl[6];
+    char	*statnametbl[6] = { "min", "max", "mean", "p50", "p95", "p99" };
+    int		seriesidx, statidx;
+
+    put_response_header(ofp, httpflag, "200 OK", jsonflag ? "application/json" : "text/csv");
+    if (jsonflag) {
+	put_char(ofp, '[');
+    } else {
+	put_string(ofp, "name,number,min,max,mean,p50,p95,p99\n", 37);
+    }
+    for (seriesidx=0; seriesidx<numseries; seriesidx++) {
+	seriesptr = seriestbl+seriesidx;
+	statptrtbl[0] = &seriesptr->min;
+	statptrtbl[1] = &seriesptr->max;
+	statptrtbl[2] = &seriesptr->mean;
+	statptrtbl[3] = &seriesptr->p50;
+	statptrtbl[4] = &seriesptr->p95;
+	statptrtbl[5] = &seriesptr->p99;
+	if (jsonflag) {
+	    put_string(ofp, seriesidx > 0 ? ",\n{\"name\":" : "\n{\"name\":", seriesidx > 0 ? 10 : 9);
+	    put_json_string(ofp, seriesptr->name);
+	    put_string(ofp, ",\"number\":", 10);
+	    put_long(ofp, seriesptr->number);
+	    for (statidx=0; statidx<6; statidx++) {
+		put_string(ofp, ",\"", 2);
+		put_string(ofp, statnametbl[statidx], strlen(statnametbl[statidx]));
+		put_string(ofp, "\":", 2);
+		put_json_value(ofp, *statptrtbl[statidx]);
+	    }
+	    put_char(ofp, '}');
+	} else {
+	    put_string(ofp, seriesptr->name, strlen(seriesptr->name));
+	    put_char(ofp, ',');
+	    put_long(ofp, seriesptr->number);
+	    for (statidx=0; statidx<6; statidx++) {
+		put_char(ofp, ',');
+		if (!isnan(*statptrtbl[statidx])) {
+		    put_value(ofp, *statptrtbl[statidx]);
+		}
 	    }
+	    put_char(ofp, '\n');
 	}
     }
+    if (jsonflag) {
+	put_string(ofp, "\n]\n", 3);
+    }
 }
 
 
 /*******************************************************************************
-Open the single file output file, if one has been specified.
+Write the /series response: numrows rows (timetbl and the row major valuetbl)
+of the series, in format csv, json or binary (see output_binary_headers).
 *******************************************************************************/
-FILE* prepare_single_output_file(char *singlefilename) {
-    FILE	*singlefileptr = NULL;
+void output_serve_series(Outputfile *ofp, int httpflag, int format, int bucket,
+		    Serveseries seriestbl[], int numseries, time_t timetbl[],
+					    double valuetbl[], int numrows) {
+    Serveseries	*seriesptr;
+    double	value, multiplier;
+    int		rowidx, seriesidx;
+    uint32_t	uint32tbl[4];
+    int64_t	int64value;
+
+    if (format == BINARYFORMAT) {
+	put_response_header(ofp, httpflag, "200 OK", "application/octet-stream");
+	uint32tbl[0] = BINARYVERSION;
+	uint32tbl[1] = BINARYBYTEORDER;
+	uint32tbl[2] = numseries;
+	uint32tbl[3] = numrows;
+	int64value   = bucket > 0 ? bucket : bucketsecs > 0 ? bucketsecs : interval;
+	put_string(ofp, BINARYMAGIC, 8);
+	put_string(ofp, (char*)uint32tbl, sizeof(uint32tbl));
+	put_string(ofp, (char*)&int64value, sizeof(int64value));
+	put_string(ofp, (char*)&fullscale, sizeof(fullscale));
+	for (seriesidx=0; seriesidx<numseries; seriesidx++) {
+	    seriesptr = seriestbl+seriesidx;
+	    put_binary_name(ofp, seriesptr->classname);
+	    put_binary_name(ofp, seriesptr->metricname);
+	    put_binary_name(ofp, seriesptr->devicename);
+	    put_string(ofp, (char*)&seriesptr->scale, sizeof(double));
+	}
+	for (rowidx=0; rowidx<numrows; rowidx++) {
+	    int64value = timetbl[rowidx];
+	    put_string(ofp, (char*)&int64value, sizeof(int64value));
+	}
+	for (seriesidx=0; seriesidx<numseries; seriesidx++) {
+	    for (rowidx=0; rowidx<numrows; rowidx++) {
+		put_string(ofp, (char*)(valuetbl+(size_t)rowidx*numseries+seriesidx),
+								sizeof(double));
+	    }
+	}
+	return;
+    }
 
-    if (singlefilename != NULL) { /* will be truncated if it already exists!!! */
-	if ((singlefileptr=fopen(singlefilename, "w")) == NULL) {
-	    err_exit("Could not open single output file '%s', aborting!", singlefilename);
-	} else {
-	    output_singlefile_headers(singlefileptr);
+    if (format == JSONFORMAT) {
+	put_response_header(ofp, httpflag, "200 OK", "application/json");
+	put_string(ofp, "{\"names\":[", 10);
+	for (seriesidx=0; seriesidx<numseries; seriesidx++) {
+	    if (seriesidx > 0) {
+		put_char(ofp, ',');
+	    }
+	    put_json_string(ofp, seriestbl[seriesidx].name);
 	}
+	put_string(ofp, "],\n\"rows\":[", 11);
+    } else {
+	put_response_header(ofp, httpflag, "200 OK", "text/csv");
+	put_string(ofp, "Time", 4);
+	for (seriesidx=0; seriesidx<numseries; seriesidx++) {
+	    put_char(ofp, ',');
+	    put_string(ofp, seriestbl[seriesidx].name, strlen(seriestbl[seriesidx].name));
+	}
+	put_char(ofp, '\n');
+    }
+    for (rowidx=0; rowidx<numrows; rowidx++) {
+	if (format == JSONFORMAT) {
+	    put_string(ofp, rowidx > 0 ? ",\n[" : "\n[", rowidx > 0 ? 3 : 2);
+	}
+	put_long(ofp, (long)timetbl[rowidx]);
+	for (seriesidx=0; seriesidx<numseries; seriesidx++) {
+	    put_char(ofp, ',');
+	    multiplier = fullscale / seriestbl[seriesidx].scale;
+	    value = valuetbl[(size_t)rowidx*numseries+seriesidx];
+	    if (format == JSONFORMAT) {
+		put_json_value(ofp, multiplier*value);
+	    } else if (!isnan(value)) {
+		put_value(ofp, multiplier*value);
+	    }
+	}
+	put_char(ofp, format == JSONFORMAT ? ']' : '\n');
+    }
+    if (format == JSONFORMAT) {
+	put_string(ofp, "\n]}\n", 4);
     }
-    return singlefileptr;
 }
 
 
 /*******************************************************************************
-Read an input data file data stanza and output it in the single file and/or
-multiple file formats.
+Read a request from a client (its first line: "GET target HTTP/1.x", or just the
+target), and answer it.
 *******************************************************************************/
-time_t read_inputfile(char *inputfilename, char *singlefilename, FILE *singlefileptr, char *multifiledirname) {
-    char	inputline[MAXINPUTLINELEN], datastanza[MAXDATSTZLEN+1];
-    char	*argtbl[NUMDATEARGS];
-    Class	*classptr;
-    int		numargs, classidx;
-    time_t	timestamp = 0;;
+void answer_request(int fd) {
+    char	requeststr[MAXREQUESTLEN+1], *targetptr, *queryptr, *paramptr;
+    char	*valueptr, *endptr;
+    char	*nametbl[MAXSERVENAMES];
+    Outputfile	outputfile;
+    Serveseries	*seriestbl;
+    time_t	*timetbl = NULL, fromtime = 0, totime = 0;
+    double	*valuetbl = NULL;
+    ssize_t	numread;
+    size_t	len = 0;
+    int		httpflag, seriesflag, format = CSVFORMAT, aggregate = bucketfunction;
+    int		numnames = 0, numseries, numrows = 0, bucket = 0, seriesidx;
+    char	*errorstr = NULL;
+
+    while (len < MAXREQUESTLEN && memchr(requeststr, '\n', len) == NULL) {
+	if ((numread=recv(fd, requeststr+len, MAXREQUESTLEN-len, 0)) < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (numread <= 0) {
+	    break;
+	}
+	len += numread;
+    }
+    requeststr[len] = '\0';
+    requeststr[strcspn(requeststr, "\r\n")] = '\0';
+
+    memset(&outputfile, 0, sizeof(Outputfile));
+    outputfile.filename   = "(client)";
+    outputfile.fd         = fd;
+    outputfile.socketflag = 1;
+    outputfile.bufsize    = SERVEOUTBUFSIZE;
+    if ((outputfile.bufptr=malloc(SERVEOUTBUFSIZE)) == NULL) {
+	err_exit("answer_request: malloc failed, aborting!");
+    }
 
-    inputlinectr = 0;
-    while (1) {
-	skip_to_stanza(DATESTR, inputline, 0);
-	if (fgets(inputline, MAXINPUTLINELEN, inputfileptr)) {
-	    inputlinectr++;
+    if ((httpflag=!strncmp(requeststr, "GET ", 4))) {
+	targetptr = requeststr+4;
+	targetptr[strcspn(targetptr, " ")] = '\0';
+    } else {
+	targetptr = requeststr;
+    }
+    if ((queryptr=strchr(targetptr, '?')) != NULL) {
+	*queryptr++ = '\0';
+    }
+    if (!(seriesflag=!strcmp(targetptr, "/series")) && strcmp(targetptr, "/names")) {
+	put_error_response(&outputfile, httpflag, "404 Not Found",
+					    "unknown target (not /names or /series)");
+	flush_outputfile(&outputfile);
+	free(outputfile.bufptr);
+	return;
+    }
 
-	    if ((numargs=parse_input_line(inputline, argtbl, NUMDATEARGS)) == NUMDATEARGS) {
-		timestamp = atol(argtbl[TIMESTAMPIDX]);
-	    } else {
-		fprintf(stderr, "read_inputfile: date error at input file %s line %d: %s",
-						inputfilename, inputlinectr, inputline);
+    while (queryptr != NULL && *queryptr != '\0') {
+	paramptr = queryptr;
+	if ((queryptr=strchr(queryptr, '&')) != NULL) {
+	    *queryptr++ = '\0';
+	}
+	if ((valueptr=strchr(paramptr, '=')) == NULL) {
+	    errorstr = "bad query parameter (not name=value)";
+	    break;
+	}
+	*valueptr++ = '\0';
+	decode_query_value(valueptr);
+	if (!strcmp(paramptr, "name") && numnames < MAXSERVENAMES) {
+	    nametbl[numnames++] = valueptr;
+	} else if (!strcmp(paramptr, "from") || !strcmp(paramptr, "to")) {
+	    *(*paramptr == 'f' ? &fromtime : &totime) = strtol(valueptr, &endptr, 10);
+	    if (*endptr != '\0' || endptr == valueptr) {
+		errorstr = "bad from or to timestamp";
+	    }
+	} else if (!strcmp(paramptr, "bucket")) {
+	    if ((bucket=strtol(valueptr, &endptr, 10)) < 0 || *endptr != '\0') {
+		errorstr = "bad bucket seconds";
 	    }
+	} else if (!strcmp(paramptr, "aggregate")) {
+	    aggregate = !strcmp(valueptr, "mean") ? MEANBUCKET : !strcmp(valueptr, "max") ?
+			MAXBUCKET : !strcmp(valueptr, "min") ? MINBUCKET : -1;
+	    errorstr = aggregate < 0 ? "unknown aggregate (not mean, max or min)" : errorstr;
+	} else if (!strcmp(paramptr, "format")) {
+	    format = !strcmp(valueptr, "csv") ? CSVFORMAT : !strcmp(valueptr, "binary") ?
+			BINARYFORMAT : !strcmp(valueptr, "json") ? JSONFORMAT : -1;
+	    errorstr = format < 0 || (!seriesflag && format == BINARYFORMAT) ?
+			"unknown format (not csv, json or binary)" : errorstr;
+	} else {
+	    errorstr = "unknown query parameter";
+	}
+    }
+    if (errorstr == NULL && seriesflag && numnames == 0) {
+	errorstr = "no series name (name=glob)";
+    }
+    if (errorstr != NULL) {
+	put_error_response(&outputfile, httpflag, "400 Bad Request", errorstr);
+	flush_outputfile(&outputfile);
+	free(outputfile.bufptr);
+	return;
+    }
 
-	    for (classidx=0; classidx<numclasses; classidx++) {
-		classptr = classtbl+classidx;
-		sprintf(datastanza, "%s%c", classptr->classname, STANZATERMCHAR);
-		skip_to_stanza(datastanza, inputline, 0);
+    pthread_mutex_lock(&servemutex);
+    if (numserverows == 0) {
+	pthread_mutex_unlock(&servemutex);
+	put_error_response(&outputfile, httpflag, "503 Service Unavailable",
+						    "no data (yet)");
+	flush_outputfile(&outputfile);
+	free(outputfile.bufptr);
+	return;
+    }
+    seriestbl = select_serve_series(nametbl, numnames, &numseries);
+    if (seriesflag) {
+	numrows = copy_serve_rows(seriestbl, numseries, fromtime, totime, bucket,
+					    aggregate, &timetbl, &valuetbl);
+    }
+    pthread_mutex_unlock(&servemutex);
+
+    if (seriesflag) {
+	output_serve_series(&outputfile, httpflag, format, bucket, seriestbl, numseries,
+						    timetbl, valuetbl, numrows);
+    } else {
+	output_serve_names(&outputfile, httpflag, format == JSONFORMAT, seriestbl,
+								numseries);
+    }
+    flush_outputfile(&outputfile);
 
-		if (classptr->classtype == VECTORCLASS) {
-		    read_vector_stanza(inputfilename, classptr);
-		} else {
-		    read_array_stanza(inputfilename, classptr);
-		}
-	    }
-	    if (singlefilename != NULL) {
-		output_singlefile_body(singlefileptr, timestamp);
-	    }
-	    if (multifiledirname != NULL) {
-		output_multifile_bodies_data(timestamp);
+    for (seriesidx=0; seriesidx<numseries; seriesidx++) {
+	free(seriestbl[seriesidx].name);
+    }
+    free(seriestbl);
+    free(timetbl);
+    free(valuetbl);
+    free(outputfile.bufptr);
+}
+
+
+/*******************************************************************************
+The --serve thread: accept (and answer) requests, until pma exits.
+*******************************************************************************/
+void* serve_requests(void *argptr) {
+    struct timeval	timeout = { SERVETIMEOUTSECS, 0 };
+    sigset_t		sigset;
+    int			fd;
+
+    (void)argptr;
+    sigemptyset(&sigset);		/* (stop_following wakes the main thread) */
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+    while (1) {
+	if ((fd=accept(servesocketfd, NULL, NULL)) < 0) {
+	    if (errno != EINTR && errno != ECONNABORTED) {
+		perror("W: --serve accept failed");
+		sleep(1);
 	    }
-	} else {
-	    break;
+	    continue;
 	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	answer_request(fd);
+	close(fd);
     }
-    return timestamp;
+    return NULL;
 }
 
 
@@ -1213,7 +5990,7 @@ Output the data summary (maximum, average, and count) for all the metrics and
 all metric_device entries (even if their scale value is 0).
 *******************************************************************************/
 void output_data_values_summary() {
-    char	metric_device_name[MAXMETDEVNAMELEN];
+    char	*metric_device_name;
     Class	*classptr;
     Metric	*metricptr;
     Device	*deviceptr;
@@ -1237,9 +6014,7 @@ void output_data_values_summary() {
 		for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
 		    deviceptr=metricptr->devicetbl+deviceidx;
 
-		    sprintf(metric_device_name, "%s%s%s", metricptr->metricname,
-				    paramtbl[METDEVSEPARATORIDX].value.string,
-				    deviceptr->devicename);
+		    metric_device_name = format_metric_device_name(metricptr, deviceptr->devicename);
 
 		    printf("## %-18s %18.1f ## %18.1f %13d\n", metric_device_name,
 				deviceptr->max, deviceptr->sum/deviceptr->number,
@@ -1252,6 +6027,74 @@ void output_data_values_summary() {
 }
 
 
+/*******************************************************************************
+Output (-dd) the (whole run) statistics for all the metrics and all metric_device
+entries: the min, the (approximate, to SKETCHACCURACY) median, 95th and 99th
+percentiles, the standard deviation, and the percentage of the values above the
+threshold (in fullscale units). An array class metric's sketch is the merge of
+its devices' sketches.
+*******************************************************************************/
+void output_statistics_line(char *prefix, char *name, int number, double min,
+		    double m2, int abovectr, Sketch *sketchptr, int thresholdflag) {
+    if (number == 0) {
+	printf("%-2s %-18s %14s\n", prefix, name, "-");
+	return;
+    }
+    printf("%-2s %-18s %14.1f %14.1f %14.1f %14.1f %14.1f ", prefix, name, min,
+		    sketch_quantile(sketchptr, number, 0.50),
+		    sketch_quantile(sketchptr, number, 0.95),
+		    sketch_quantile(sketchptr, number, 0.99), sqrt(m2/number));
+    if (thresholdflag) {
+	printf("%8.1f\n", 100.0*abovectr/number);
+    } else {
+	printf("%8s\n", "-");
+    }
+}
+
+void output_data_values_statistics() {
+    char	*metric_device_name;
+    Class	*classptr;
+    Metric	*metricptr;
+    Device	*deviceptr;
+    Sketch	sketch;
+    int		classidx, metricidx, deviceidx;
+
+    printf("### Statistics ################ Min ########## P50 ########## P95 ##########"
+		    " P99 ####### Stddev # %%Above\n");
+    for (classidx=0; classidx<numclasses; classidx++) {	/* loop thru classes */
+	classptr = classtbl+classidx;
+	for (metricidx=0; metricidx<classptr->nummetrics; metricidx++) {
+	    metricptr=classptr->metrictbl+metricidx;
+
+	    if (classptr->classtype == VECTORCLASS) {
+		deviceptr = metricptr->devicetbl;
+		output_statistics_line("#", metricptr->metricname, metricptr->number,
+			    metricptr->min, metricptr->m2, metricptr->abovectr,
+			    &deviceptr->sketch, deviceptr->scale > 0);
+	    } else {
+		memset(&sketch, 0, sizeof(Sketch));
+		for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
+		    merge_sketch(&sketch, &metricptr->devicetbl[deviceidx].sketch);
+		}
+		output_statistics_line("#", metricptr->metricname, metricptr->number,
+			    metricptr->min, metricptr->m2, metricptr->abovectr, &sketch, 1);
+		free_sketch(&sketch);
+
+		for (deviceidx=0; deviceidx<metricptr->numdevices; deviceidx++) {
+		    deviceptr=metricptr->devicetbl+deviceidx;
+
+		    metric_device_name = format_metric_device_name(metricptr, deviceptr->devicename);
+		    output_statistics_line("##", metric_device_name, deviceptr->number,
+			    deviceptr->min, deviceptr->m2, deviceptr->abovectr,
+			    &deviceptr->sketch, deviceptr->scale > 0);
+		}
+	    }
+	}
+    }
+    fflush(stdout);
+}
+
+
 /*******************************************************************************
 Output the contents of paramtbl to stdout.
 *******************************************************************************/
@@ -1305,26 +6148,55 @@ specified, all but the last one (of each) is ignored.
 *******************************************************************************/
 int main(int argc, char *argv[]) {
     int		optionchar, optionidx;
-    FILE	*singlefileptr;
+    Inputfile	*inputfileptr;
+    Outputfile	*singlefileptr	  = NULL;
     char	*singlefilename   = NULL;
     char	*multifiledirname = NULL;
-    time_t	lasttimestamp = 0;
+    char	*statefilename    = NULL;
+    time_t	lasttimestamp = 0, timestamp;
+    char	*suffixptr;
+    long	peakkbytes;
     int		firstfileflag = 1;
+    int		numjobs = 1;
+    int		buildindexflag = 0;
+    int		fleetflag = 0;
+    pthread_t	servethread;
+    struct rlimit rlimitbuf;
+    struct sigaction sigactionbuf;
     static struct option long_options[] = {
 	{"configurationfile",  required_argument, 0,  'c' },
 	{"singlefile",         required_argument, 0,  's' },
+	{"format",             required_argument, 0,  'f' },
 	{"multifiledirectory", required_argument, 0,  'm' },
+	{"sparse",             no_argument,       0,  'z' },
+	{"jobs",               required_argument, 0,  'j' },
+	{"fleet",              no_argument,       0,  'H' },
+	{"from",               required_argument, 0,  't' },
+	{"to",                 required_argument, 0,  'u' },
+	{"build-index",        no_argument,       0,  'x' },
+	{"include",            required_argument, 0,  'I' },
+	{"exclude",            required_argument, 0,  'X' },
+	{"incremental",        required_argument, 0,  'i' },
+	{"follow",             no_argument,       0,  'F' },
+	{"serve",              required_argument, 0,  'D' },
+	{"bucket",             required_argument, 0,  'b' },
+	{"aggregate",          required_argument, 0,  'a' },
+	{"max-memory",         required_argument, 0,  'M' },
+	{"stats",              optional_argument, 0,  'T' },
+	{"timing",             no_argument,       0,  'T' },
 	{"datavalues",         no_argument,       0,  'd' },
 	{"parameters",         no_argument,       0,  'p' },
+	{"strict",             no_argument,       0,  'S' },
 	{"verbose",            no_argument,       0,  'v' },
 	{"help",               no_argument,       0,  'h' },
 	{0,                    0,                 0,  0   },
     };
 
     setlocale(LC_ALL, getenv("LANG"));
+    decimalpointchar = *localeconv()->decimal_point;
 
     while (1) {
-	optionchar = getopt_long(argc, argv, "c:s:m:dpvh", long_options, &optionidx);
+	optionchar = getopt_long(argc, argv, "c:s:f:m:zj:Ht:u:xI:X:i:FD:b:a:M:T::dpSvh", long_options, &optionidx);
 	if (optionchar == -1) {
 	    break;
 	}
@@ -1332,63 +6204,288 @@ int main(int argc, char *argv[]) {
 	switch (optionchar) {
 	    case 'c': configfilename   = optarg;		break; 
 	    case 's': singlefilename   = optarg;		break; 
+	    case 'f':
+		if (!strcmp(optarg, "csv")) {
+		    singlefileformat = CSVFORMAT;
+		} else if (!strcmp(optarg, "binary")) {
+		    singlefileformat = BINARYFORMAT;
+		} else {
+		    fprintf(stderr, "Unknown format '%s'\n", optarg);
+		    display_usage_message(argv[0]);
+		    exit(1);
+		}
+		break;
 	    case 'm': multifiledirname = optarg;		break; 
-	    case 'd': datavaluesflag   = 1;			break; 
+	    case 'z': sparseflag       = 1;			break;
+	    case 'j': numjobs          = atoi(optarg);		break; 
+	    case 't':
+	    case 'u':
+		timestamp = strtol(optarg, &suffixptr, 10);
+		if (*suffixptr != '\0' || suffixptr == optarg || timestamp <= 0) {
+		    fprintf(stderr, "Bad timestamp '%s'\n", optarg);
+		    display_usage_message(argv[0]);
+		    exit(1);
+		}
+		*(optionchar == 't' ? &fromtimestamp : &totimestamp) = timestamp;
+		break;
+	    case 'H': fleetflag        = 1;			break;
+	    case 'x': buildindexflag   = 1;			break;
+	    case 'I': add_pattern(&includetbl, &numincludes, optarg);	break;
+	    case 'X': add_pattern(&excludetbl, &numexcludes, optarg);	break;
+	    case 'i': statefilename    = optarg;		break; 
+	    case 'F': followflag       = 1;			break; 
+	    case 'D': servesocketname  = optarg;
+		      followflag       = 1;			break;
+	    case 'b': bucketsecs       = atoi(optarg);		break; 
+	    case 'M':
+		maxmemory = strtoul(optarg, &suffixptr, 10);
+		switch (*suffixptr) {
+		    case 'G': case 'g': maxmemory *= 1024;	/* falls through */
+		    case 'M': case 'm': maxmemory *= 1024;	/* falls through */
+		    case 'K': case 'k': maxmemory *= 1024;	suffixptr++; break;
+		}
+		if (*suffixptr != '\0' || maxmemory == 0) {
+		    fprintf(stderr, "Bad memory size '%s'\n", optarg);
+		    display_usage_message(argv[0]);
+		    exit(1);
+		}
+		break;
+	    case 'a':
+		if (!strcmp(optarg, "mean")) {
+		    bucketfunction = MEANBUCKET;
+		} else if (!strcmp(optarg, "max")) {
+		    bucketfunction = MAXBUCKET;
+		} else if (!strcmp(optarg, "min")) {
+		    bucketfunction = MINBUCKET;
+		} else {
+		    fprintf(stderr, "Unknown aggregate function '%s'\n", optarg);
+		    display_usage_message(argv[0]);
+		    exit(1);
+		}
+		break;
+	    case 'T':
+		if (optarg == NULL || !strcmp(optarg, "text")) {
+		    statsformat = TEXTSTATS;
+		} else if (!strcmp(optarg, "json")) {
+		    statsformat = JSONSTATS;
+		} else {
+		    fprintf(stderr, "Unknown stats format '%s'\n", optarg);
+		    display_usage_message(argv[0]);
+		    exit(1);
+		}
+		break;
+	    case 'd': datavaluesflag++;				break; 
 	    case 'p': parametersflag   = 1;			break; 
+	    case 'S': strictflag       = 1;			break; 
 	    case 'v': verbosity++;				break; 
 	    case 'h':
 	    case '?': display_usage_message(argv[0]); exit(0);	break; 
 	}
     }
 
-    if (optind >= argc) {
+    if (optind >= argc || numjobs < 1 || bucketsecs < 0) {
 	display_usage_message(argv[0]);
 	exit(1);
     }
 
+    if (buildindexflag) {
+	while (optind < argc) {
+	    build_date_index(argv[optind++]);
+	}
+	exit(0);
+    }
+
     if (singlefilename == NULL && multifiledirname == NULL) {
 	fprintf(stderr, "W: no output file has been specfied!\n");
     }
 
+    phasestarttime    = clock_seconds(CLOCK_MONOTONIC);
+    phasecpustarttime = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+
+    if (getrlimit(RLIMIT_NOFILE, &rlimitbuf) == 0 && rlimitbuf.rlim_cur != RLIM_INFINITY) {
+	maxopenoutputfiles = (int)MIN(rlimitbuf.rlim_cur, INT_MAX) - OUTPUTFDRESERVE - numjobs;
+    } else {
+	maxopenoutputfiles = INT_MAX;
+    }
+
+    if (followflag) {
+	if (!strcmp(argv[argc-1], STDINFILENAME)) {
+	    fprintf(stderr, "%s (stdin) can't be followed, aborting!\n", STDINFILENAME);
+	    exit(1);
+	}
+	memset(&sigactionbuf, 0, sizeof(sigactionbuf));
+	sigactionbuf.sa_handler = stop_following;	/* (no SA_RESTART: wake up now) */
+	sigemptyset(&sigactionbuf.sa_mask);
+	sigaction(SIGINT,  &sigactionbuf, NULL);
+	sigaction(SIGTERM, &sigactionbuf, NULL);
+    }
+
+    if (bucketsecs > 0 && statefilename != NULL) {
+	fprintf(stderr, "-b|--bucket and -i|--incremental can't be used together, aborting!\n");
+	exit(1);
+    }
+
+    if (fleetflag && (statefilename != NULL || followflag)) {
+	fprintf(stderr, "-H|--fleet can't be used with -i|--incremental or -F|--follow, %s\n",
+								    "aborting!");
+	exit(1);
+    }
+
+    if ((fromtimestamp > 0 || totimestamp > 0) && statefilename != NULL) {
+	fprintf(stderr, "-t|--from and -u|--to can't be used with -i|--incremental, %s\n",
+								    "aborting!");
+	exit(1);
+    }
+    if (totimestamp > 0 && (followflag || totimestamp < fromtimestamp)) {
+	fprintf(stderr, "-u|--to can't be used with -F|--follow, or be before -t|--from, %s\n",
+								    "aborting!");
+	exit(1);
+    }
+
+    if (servesocketname != NULL) {
+	open_serve_socket();
+	if ((errno=pthread_create(&servethread, NULL, serve_requests, NULL)) != 0) {
+	    err_exit("pthread_create failed, aborting!");
+	}
+    }
+
+    if (statefilename != NULL) {
+	read_statefile(statefilename);
+    }
+
+    if (fleetflag) {			/* (all the input files at once) */
+	initialize_parameters();
+	open_hosts(argv+optind, argc-optind);
+	optind = argc;
+	firstfileflag = 0;
+	lasttimestamp = read_hosts(numjobs, singlefilename, &singlefileptr, multifiledirname);
+    }
+
     while (optind < argc) {
+	if (statefileptr != NULL && !strcmp(argv[optind], STDINFILENAME)) {
+	    fprintf(stderr, "%s (stdin) can't be read incrementally, aborting!\n",
+								STDINFILENAME);
+	    exit(1);
+	}
+	if (statefileptr != NULL && statefileptr->resumeflag && firstfileflag &&
+			    strcmp(argv[optind], statefileptr->inputfilename)) {
+	    if (verbosity > 1) {
+		fprintf(stderr, "i: Skipping (already processed) input file '%s'\n",
+								    argv[optind]);
+	    }
+	    optind++;
+	    continue;
+	}
 	if (verbosity > 1) {
 	    fprintf(stderr, "i: Processing input file '%s'\n", argv[optind]);
 	}
 
-	if (!strcmp(argv[optind], STDINFILENAME)) {
-	    inputfileptr = stdin;
-	    if (firstfileflag && verbosity > 0) {
-		fprintf(stderr,
-		"i: First data set skipped when using %s (stdin) as the FIRST input file\n", 
-										STDINFILENAME);
-	    }
-	} else if ((inputfileptr=fopen(argv[optind], "r")) == NULL) {
+	if ((inputfileptr=open_inputfile(argv[optind])) == NULL) {
 	    fprintf(stderr, "E: Could not open input file '%s', skipping\n", argv[optind]);
 	    optind++;
 	    continue;
 	}
+	inputfilectr++;
 
 	if (firstfileflag) {
 	    initialize_parameters();
-	    initialize_time_values();
-	    initialize_metadata();
-	    initialize_timestamp();
-	    initialize_classes();	/* rewinds non-stdin files */
-	    if (configfilename != NULL) {
-		read_configfile();	/* optionally sets TZ  */
+	    initialize_time_values(inputfileptr, NULL);
+	    if (bucketsecs > 0 && bucketsecs % interval != 0) {
+		fprintf(stderr, "Bucket seconds %d must be a multiple of the interval %d, %s\n",
+						    bucketsecs, interval, "aborting!");
+		exit(1);
 	    }
+	    initialize_metadata(inputfileptr, NULL);
 	    check_metric_names();
-	    singlefileptr = prepare_single_output_file(singlefilename);
-	    prepare_multi_output_files(multifiledirname);
 	    firstfileflag = 0;
+
+	    if (statefileptr != NULL && statefileptr->resumeflag) {
+		restore_state_devices();
+		if (!seek_inputfile(inputfileptr, statefileptr->offset,
+						    statefileptr->linectr)) {
+		    fprintf(stderr, "Input file '%s' is shorter than state file '%s' %s\n",
+				    inputfileptr->filename, statefileptr->filename,
+				    "says (remove it to start again), aborting!");
+		    exit(1);
+		}
+		firsttimestamp = statefileptr->firsttimestamp;
+		initialize_outputs(singlefilename, &singlefileptr, multifiledirname);
+		start_clockticks_thread(statefileptr->timestamp);
+		firstdatasetflag = 0;
+	    }
+
+	    if (numjobs > 1 && optind < argc-followflag) {	/* and the others (not followed) */
+		lasttimestamp = read_inputfiles_in_parallel(argv+optind, argc-optind-followflag,
+				inputfileptr, numjobs, singlefilename, &singlefileptr,
+				multifiledirname);
+		if (!followflag) {
+		    break;
+		}
+		optind = argc-1;
+		if ((inputfileptr=open_inputfile(argv[optind])) == NULL) {
+		    fprintf(stderr, "E: Could not open input file '%s', skipping\n", argv[optind]);
+		    break;
+		}
+		inputfilectr++;
+	    }
+	}
+	if (followflag && optind == argc-1) {
+	    if ((timestamp=follow_inputfile(inputfileptr, singlefilename, &singlefileptr,
+						    multifiledirname)) != 0) {
+		lasttimestamp = timestamp;
+	    }
+	} else if ((timestamp=read_inputfile(inputfileptr, singlefilename, &singlefileptr,
+						    multifiledirname)) != 0) {
+	    lasttimestamp = timestamp;		/* (--from/--to: 0 if none were read) */
 	}
-	lasttimestamp = read_inputfile(argv[optind], singlefilename, singlefileptr, multifiledirname);
-	fclose(inputfileptr);
+	close_inputfile(inputfileptr);
 	optind++;
     }
 
-    if (multifiledirname != NULL && clockticksfileptr != NULL) {
-	populate_clockticks(lasttimestamp);
+    if (statefileptr != NULL && statefileptr->resumeflag && firstfileflag) {
+	fprintf(stderr, "Input file '%s' (of state file '%s') not found, aborting!\n",
+			    statefileptr->inputfilename, statefileptr->filename);
+	exit(1);
+    }
+
+    if (firstdatasetflag && statefileptr != NULL && statefileptr->inputfilename != NULL) {
+	fprintf(stderr, "W: No complete data set (yet) in input file '%s'\n",
+						    statefileptr->inputfilename);
+	exit(0);
+    }
+
+    if (firstdatasetflag && (fromtimestamp > 0 || totimestamp > 0)) {
+	fprintf(stderr, "No data sets in the -t|--from to -u|--to range, aborting!\n");
+	exit(1);
+    }
+    if (firstdatasetflag) {
+	fprintf(stderr, "Data file stanza '%s' not found, aborting!\n", DATESTR);
+	exit(1);
+    }
+
+    if (badvaluectr > 0) {
+	fprintf(stderr, "W: %d malformed data value(s) were not used\n", badvaluectr);
+    }
+
+    start_phase(CLOSEPHASE);
+    if (statefileptr != NULL) {
+	lasttimestamp = statefileptr->timestamp;
+    }
+    update_clockticks_thread(lasttimestamp, 1);
+    pthread_mutex_lock(&servemutex);
+    output_bucket(singlefileptr, multifiledirname);
+    pthread_mutex_unlock(&servemutex);
+    close_output_files(singlefileptr);
+    if (statefileptr != NULL) {
+	write_statefile();
+    }
+    if (clockticksthreadflag) {
+	start_phase(CLOCKTICKSPHASE);		/* (the wait for the rest of it) */
+	pthread_join(clockticksthread, NULL);
+	phasecpusecstbl[CLOCKTICKSPHASE] += clocktickscpusecs;
+    }
+    if (statsformat != NOSTATS) {
+	output_stats();
     }
 
     if (parametersflag != 0) {
@@ -1398,5 +6495,20 @@ int main(int argc, char *argv[]) {
     if (datavaluesflag != 0) {
 	output_data_values_summary();
     }
+    if (datavaluesflag > 1) {
+	output_data_values_statistics();
+    }
+
+    peakkbytes = peak_memory_kbytes();
+    if (verbosity > 0) {
+	fprintf(stderr, "i: Peak memory use (maximum RSS) %ld KB\n", peakkbytes);
+    }
+    if (maxmemory > 0 && (size_t)peakkbytes*1024 > maxmemory) {
+	fprintf(stderr, "W: Peak memory use %ld KB exceeded --max-memory %lu KB\n",
+					    peakkbytes, (unsigned long)(maxmemory/1024));
+    }
+    if (servesocketname != NULL) {
+	unlink(servesocketname);
+    }
     exit(0);
 }
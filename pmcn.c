@@ -0,0 +1,775 @@
+/*******************************************************************************
+********************************************************************************
+
+    pmcn: a native (Linux) Performance Monitor Collector - collects the same
+    performance data as pmc, in the same log file format, for pma.
+
+    Copyright (C) 2016-2022 James S. Crook
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+********************************************************************************
+*******************************************************************************/
+
+/*******************************************************************************
+pmcn: (Performance Monitor Collector, Native) - this C program - is a drop-in
+replacement for pmc (the shell script) on Linux. Instead of running vmstat,
+iostat and sar -n DEV (and sed, date, cat, ...) for each data set, it reads
+/proc/stat, /proc/meminfo, /proc/vmstat, /proc/diskstats and /proc/net/dev
+directly (the files are opened once, and re-read with pread), computes the same
+VM, IO and NET metrics as pmc's config_Linux, and writes each data set (DATE:
+and the VM:, IO: and NET: stanzas) to the log file with a single write.
+
+The rows are the same as pmc's: the first VM and IO rows are the averages since
+boot (like the first vmstat and iostat reports), the others are for each
+interval, and the NET rows are for each interval.
+*******************************************************************************/
+
+#define PROGVERSIONSTR	"0.0.4"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MAXPATHLEN	1024
+#define MAXNAMELEN	64
+#define MAXCPUFIELDS	8
+#define INITBUFSIZE	65536
+
+#define USAGEMSGFMT	"usage: %s [OPTION ...] -o outputfilepattern                  [defaults:]\n\
+  WHERE:\n\
+    -o outfilepattern   output log file strftime pattern/name   none (required!)\n\
+  OPTIONs are:\n\
+    -f first_hour       first hour to collect data              %d\n\
+    -l last_hour        last hour to collect data               %d\n\
+    -c count            count    parameter                      %d\n\
+    -i interval         interval parameter                      %d\n\
+    -d disk/disk_list   disk or 'disk1 ... diskN' to INclude    none (all disks)\n\
+    -x day/day_list     week day or 'day1 ... dayN' to EXclude  none\n\
+    -n data_sets        stop after this many data sets          none (forever)\n\
+    -V                  Do NOT collect the VM  (vmstat)  data    collect data\n\
+    -I                  Do NOT collect the IO  (iostat)  data    collect data\n\
+    -N                  Do NOT collect the NET (sar -n)  data    collect data\n\
+    -v                  display the version of %s\n\
+    -h                  display this usage message\n\
+\n\
+  e.g.:\n\
+    %s -o logfile\n\
+    %s -f 9 -l 17 -d sda -d sdb -x Sat -x Sun -o logfile\n\
+\n\
+    For a new date-stamped log file each day:\n\
+      %s [OPTION ...] -o $(hostname)_%%Y%%m%%d.pmc\n"
+
+#define VMMETRICS	"r b swpd free buff cache si so bi bo in cs cpu_us cpu_sy cpu_id cpu_wa st"
+#define IOMETRICS	"tps kBrdps kBwtps kBrd kBwt"
+#define NETMETRICS	"rxpkps txpkps rxkBps txkBps rxcmps txcmps rxmctps"
+
+#define SECTORSIZE	512
+
+
+/*******************************************************************************
+A text buffer (that grows as needed). Each data set is built in one of these
+and then written to the log file with a single write.
+*******************************************************************************/
+typedef struct {
+    char	*str;
+    size_t	len;
+    size_t	size;
+} Textbuf;
+
+/*******************************************************************************
+A /proc file, read (from the start) into a (growing) buffer by read_procfile.
+*******************************************************************************/
+typedef struct {
+    const char	*filename;
+    int		fd;
+    char	*buf;
+    size_t	bufsize;
+} Procfile;
+
+typedef struct {
+    char		name[MAXNAMELEN];
+    unsigned long long	rdios, wrios, rdsectors, wrsectors;
+} Diskstat;
+
+typedef struct {
+    char		name[MAXNAMELEN];
+    unsigned long long	rxbytes, rxpackets, rxcompressed, rxmulticast;
+    unsigned long long	txbytes, txpackets, txcompressed;
+} Netstat;
+
+/*******************************************************************************
+One sample (snapshot) of all the counters, taken at the start of the data set
+and at the end of each interval.
+*******************************************************************************/
+typedef struct {
+    double		uptime;
+    unsigned long long	cputbl[MAXCPUFIELDS];	/* user nice system idle iowait irq softirq steal */
+    unsigned long long	intr, ctxt;
+    long		running, blocked;
+    unsigned long long	swaptotal, swapfree, memfree, buffers, cached, sreclaimable;
+    unsigned long long	pswpin, pswpout, pgpgin, pgpgout;
+    Diskstat		*disktbl;
+    int			numdisks, maxdisks;
+    Netstat		*nettbl;
+    int			numnets, maxnets;
+} Sample;
+
+
+char		*progname;
+int		firsthour = 0, lasthour = 23, count = 12, interval = 10, maxdatasets = 0;
+int		vmflag = 1, ioflag = 1, netflag = 1;
+char		disklist[MAXPATHLEN] = "", excludedays[MAXPATHLEN] = "";
+char		*outfilepattern = NULL;
+long		pagesize;
+
+Procfile	statfile	= { "/proc/stat",	-1, NULL, 0 };
+Procfile	meminfofile	= { "/proc/meminfo",	-1, NULL, 0 };
+Procfile	vmstatfile	= { "/proc/vmstat",	-1, NULL, 0 };
+Procfile	diskstatsfile	= { "/proc/diskstats",	-1, NULL, 0 };
+Procfile	netdevfile	= { "/proc/net/dev",	-1, NULL, 0 };
+Procfile	uptimefile	= { "/proc/uptime",	-1, NULL, 0 };
+
+char		(*iodevicetbl)[MAXNAMELEN] = NULL;	/* the IO devices of this data set */
+int		numiodevices = 0;
+Textbuf		datasetbuf, vmbuf, iobuf, netbuf;
+
+
+/*******************************************************************************
+Display the error message (and the errno message), and exit.
+*******************************************************************************/
+void err_exit(const char *formatstr, ...) {
+    char	msgstr[MAXPATHLEN*2];
+    va_list	argptr;
+
+    va_start (argptr, formatstr);
+    vsnprintf (msgstr, sizeof(msgstr), formatstr, argptr);
+    va_end (argptr);
+    perror(msgstr);
+    exit(1);
+}
+
+
+/*******************************************************************************
+Append the (printf) formatted text to the text buffer, doubling its size as
+needed.
+*******************************************************************************/
+void add_text(Textbuf *tbp, const char *formatstr, ...) {
+    va_list	argptr;
+    int		len;
+
+    for (;;) {
+	va_start (argptr, formatstr);
+	len = vsnprintf(tbp->str+tbp->len, tbp->size-tbp->len, formatstr, argptr);
+	va_end (argptr);
+	if (len < 0) {
+	    err_exit("Could not format the output text, aborting!");
+	}
+	if (tbp->len + len < tbp->size) {
+	    tbp->len += len;
+	    return;
+	}
+	tbp->size = tbp->size ? tbp->size*2 : INITBUFSIZE;
+	if ((tbp->str = realloc(tbp->str, tbp->size)) == NULL) {
+	    err_exit("Could not realloc the output text buffer (%ld bytes), aborting!",
+								(long)tbp->size);
+	}
+    }
+}
+
+
+/*******************************************************************************
+Append the text buffer src to dst.
+*******************************************************************************/
+void add_textbuf(Textbuf *dst, const Textbuf *src) {
+    if (src->len > 0) {
+	add_text(dst, "%.*s", (int)src->len, src->str);
+    }
+}
+
+
+/*******************************************************************************
+Open the /proc file (once - it is re-read from the start for each sample).
+*******************************************************************************/
+void open_procfile(Procfile *pfp) {
+    if ((pfp->fd = open(pfp->filename, O_RDONLY)) < 0) {
+	err_exit("Could not open '%s', aborting!", pfp->filename);
+    }
+}
+
+
+/*******************************************************************************
+Read the whole /proc file (from the start) into its buffer - which is doubled
+until the file fits - and return it as a null terminated string.
+*******************************************************************************/
+char* read_procfile(Procfile *pfp) {
+    ssize_t	len;
+
+    for (;;) {
+	if (pfp->bufsize == 0 || (len = pread(pfp->fd, pfp->buf, pfp->bufsize, 0)) >=
+							    (ssize_t)pfp->bufsize) {
+	    pfp->bufsize = pfp->bufsize ? pfp->bufsize*2 : INITBUFSIZE;
+	    if ((pfp->buf = realloc(pfp->buf, pfp->bufsize)) == NULL) {
+		err_exit("Could not realloc the buffer for '%s' (%ld bytes), aborting!",
+						    pfp->filename, (long)pfp->bufsize);
+	    }
+	} else if (len < 0) {
+	    err_exit("Could not read '%s', aborting!", pfp->filename);
+	} else {
+	    pfp->buf[len] = '\0';
+	    return pfp->buf;
+	}
+    }
+}
+
+
+/*******************************************************************************
+Return the value (the number after the name) of the "name value" (or
+"name: value kB") line in the text, or 0 if there is no such line.
+*******************************************************************************/
+unsigned long long find_value(const char *text, const char *name) {
+    const char	*lineptr;
+    size_t	namelen = strlen(name);
+
+    for (lineptr = text; lineptr != NULL && *lineptr != '\0'; ) {
+	if (strncmp(lineptr, name, namelen) == 0 &&
+			(lineptr[namelen] == ' ' || lineptr[namelen] == ':')) {
+	    lineptr += namelen;
+	    if (*lineptr == ':') {
+		lineptr++;
+	    }
+	    return strtoull(lineptr, NULL, 10);
+	}
+	if ((lineptr = strchr(lineptr, '\n')) != NULL) {
+	    lineptr++;
+	}
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+Is the (whole word) name in the space separated list?
+*******************************************************************************/
+int in_list(const char *list, const char *name) {
+    const char	*ptr;
+    size_t	namelen = strlen(name);
+
+    for (ptr = list; (ptr = strstr(ptr, name)) != NULL; ptr += namelen) {
+	if ((ptr == list || ptr[-1] == ' ') && (ptr[namelen] == ' ' || ptr[namelen] == '\0')) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+Is the /proc/diskstats device a whole disk (i.e., in /sys/block), not a
+partition? These are the devices iostat reports by default.
+*******************************************************************************/
+int is_whole_disk(const char *name) {
+    char	pathname[MAXPATHLEN];
+    struct stat	statbuf;
+
+    snprintf(pathname, sizeof(pathname), "/sys/block/%s", name);
+    return stat(pathname, &statbuf) == 0;
+}
+
+
+/*******************************************************************************
+Read /proc/diskstats into the sample's disk table.
+*******************************************************************************/
+void read_diskstats(Sample *sp) {
+    char		*lineptr, *nextptr;
+    Diskstat		*dsp;
+    unsigned long long	rdmerges, rdticks, wrmerges;
+
+    sp->numdisks = 0;
+    for (lineptr = read_procfile(&diskstatsfile); *lineptr != '\0'; lineptr = nextptr) {
+	if ((nextptr = strchr(lineptr, '\n')) == NULL) {
+	    nextptr = lineptr + strlen(lineptr);
+	} else {
+	    *nextptr++ = '\0';
+	}
+	if (sp->numdisks == sp->maxdisks) {
+	    sp->maxdisks = sp->maxdisks ? sp->maxdisks*2 : 16;
+	    if ((sp->disktbl = realloc(sp->disktbl, sp->maxdisks*sizeof(Diskstat))) == NULL) {
+		err_exit("Could not realloc the disk table (%d disks), aborting!",
+								sp->maxdisks);
+	    }
+	}
+	dsp = &sp->disktbl[sp->numdisks];
+	if (sscanf(lineptr, "%*u %*u %63s %llu %llu %llu %llu %llu %llu %llu", dsp->name,
+		    &dsp->rdios, &rdmerges, &dsp->rdsectors, &rdticks, &dsp->wrios,
+		    &wrmerges, &dsp->wrsectors) == 8) {
+	    sp->numdisks++;
+	}
+    }
+}
+
+
+/*******************************************************************************
+Read /proc/net/dev (after its two header lines) into the sample's interface
+table.
+*******************************************************************************/
+void read_netdev(Sample *sp) {
+    char		*lineptr, *nextptr, *colonptr;
+    Netstat		*nsp;
+    unsigned long long	rxerrs, rxdrop, rxfifo, rxframe, txerrs, txdrop, txfifo, txcolls, txcarrier;
+    int			linenum = 0;
+
+    sp->numnets = 0;
+    for (lineptr = read_procfile(&netdevfile); *lineptr != '\0'; lineptr = nextptr) {
+	if ((nextptr = strchr(lineptr, '\n')) == NULL) {
+	    nextptr = lineptr + strlen(lineptr);
+	} else {
+	    *nextptr++ = '\0';
+	}
+	if (++linenum <= 2 || (colonptr = strchr(lineptr, ':')) == NULL) {
+	    continue;
+	}
+	if (sp->numnets == sp->maxnets) {
+	    sp->maxnets = sp->maxnets ? sp->maxnets*2 : 16;
+	    if ((sp->nettbl = realloc(sp->nettbl, sp->maxnets*sizeof(Netstat))) == NULL) {
+		err_exit("Could not realloc the interface table (%d interfaces), aborting!",
+								sp->maxnets);
+	    }
+	}
+	nsp = &sp->nettbl[sp->numnets];
+	*colonptr = '\0';
+	while (*lineptr == ' ') {
+	    lineptr++;
+	}
+	snprintf(nsp->name, MAXNAMELEN, "%s", lineptr);
+	if (sscanf(colonptr+1, "%llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+		&nsp->rxbytes, &nsp->rxpackets, &rxerrs, &rxdrop, &rxfifo, &rxframe,
+		&nsp->rxcompressed, &nsp->rxmulticast, &nsp->txbytes, &nsp->txpackets,
+		&txerrs, &txdrop, &txfifo, &txcolls, &txcarrier, &nsp->txcompressed) == 16) {
+	    sp->numnets++;
+	}
+    }
+}
+
+
+/*******************************************************************************
+Take a sample of all the (enabled classes') counters.
+*******************************************************************************/
+void take_sample(Sample *sp) {
+    char	*text, *ptr;
+    int		idx;
+
+    sp->uptime = strtod(read_procfile(&uptimefile), NULL);
+
+    if (vmflag) {
+	text = read_procfile(&statfile);
+	if (strncmp(text, "cpu ", 4) == 0) {
+	    for (ptr = text+4, idx=0; idx<MAXCPUFIELDS; idx++) {
+		sp->cputbl[idx] = strtoull(ptr, &ptr, 10);
+	    }
+	}
+	sp->intr    = find_value(text, "intr");
+	sp->ctxt    = find_value(text, "ctxt");
+	sp->running = (long)find_value(text, "procs_running");
+	sp->blocked = (long)find_value(text, "procs_blocked");
+
+	text = read_procfile(&meminfofile);
+	sp->swaptotal    = find_value(text, "SwapTotal");
+	sp->swapfree     = find_value(text, "SwapFree");
+	sp->memfree      = find_value(text, "MemFree");
+	sp->buffers      = find_value(text, "Buffers");
+	sp->cached       = find_value(text, "Cached");
+	sp->sreclaimable = find_value(text, "SReclaimable");
+
+	text = read_procfile(&vmstatfile);
+	sp->pswpin  = find_value(text, "pswpin");
+	sp->pswpout = find_value(text, "pswpout");
+	sp->pgpgin  = find_value(text, "pgpgin");
+	sp->pgpgout = find_value(text, "pgpgout");
+    }
+    if (ioflag) {
+	read_diskstats(sp);
+    }
+    if (netflag) {
+	read_netdev(sp);
+    }
+}
+
+
+/*******************************************************************************
+Return the counter difference, per second (rounded, as vmstat does).
+*******************************************************************************/
+unsigned long long per_second(unsigned long long newctr, unsigned long long oldctr, double secs) {
+    return secs > 0 ? (unsigned long long)((newctr - oldctr) / secs + 0.5) : 0;
+}
+
+
+/*******************************************************************************
+Append a VM (vmstat) row for the interval from oldsp (NULL: boot) to newsp.
+*******************************************************************************/
+void output_vm_row(const Sample *oldsp, const Sample *newsp) {
+    static const Sample	bootsample;
+    unsigned long long	cpudelta[MAXCPUFIELDS], cputotal = 0, half;
+    double		secs;
+    int			idx;
+
+    if (oldsp == NULL) {
+	oldsp = &bootsample;
+    }
+    secs = newsp->uptime - oldsp->uptime;
+    for (idx=0; idx<MAXCPUFIELDS; idx++) {
+	cpudelta[idx] = newsp->cputbl[idx] - oldsp->cputbl[idx];
+	cputotal += cpudelta[idx];
+    }
+    if (cputotal == 0) {
+	cputotal = 1;
+    }
+    half = cputotal/2;
+
+    add_text(&vmbuf, "%2ld %2ld %6llu %6llu %6llu %6llu %4llu %4llu %5llu %5llu %4llu %4llu"
+		    " %2llu %2llu %2llu %2llu %2llu\n",
+		newsp->running, newsp->blocked, newsp->swaptotal - newsp->swapfree,
+		newsp->memfree, newsp->buffers, newsp->cached + newsp->sreclaimable,
+		per_second(newsp->pswpin,  oldsp->pswpin,  secs)*pagesize/1024,
+		per_second(newsp->pswpout, oldsp->pswpout, secs)*pagesize/1024,
+		per_second(newsp->pgpgin,  oldsp->pgpgin,  secs),
+		per_second(newsp->pgpgout, oldsp->pgpgout, secs),
+		per_second(newsp->intr, oldsp->intr, secs),
+		per_second(newsp->ctxt, oldsp->ctxt, secs),
+		(100*(cpudelta[0]+cpudelta[1]) + half) / cputotal,		/* user nice */
+		(100*(cpudelta[2]+cpudelta[5]+cpudelta[6]) + half) / cputotal,	/* system irq softirq */
+		(100*cpudelta[3] + half) / cputotal,				/* idle */
+		(100*cpudelta[4] + half) / cputotal,				/* iowait */
+		(100*cpudelta[7] + half) / cputotal);				/* steal */
+}
+
+
+/*******************************************************************************
+Choose the IO devices for this data set (so that each IO row has the same
+devices): the -d disks, or every whole disk that has been used since boot.
+*******************************************************************************/
+void choose_io_devices(const Sample *sp) {
+    int		idx;
+
+    if ((iodevicetbl = realloc(iodevicetbl, (sp->numdisks+1)*MAXNAMELEN)) == NULL) {
+	err_exit("Could not realloc the IO device table (%d devices), aborting!",
+								sp->numdisks+1);
+    }
+    for (numiodevices=idx=0; idx<sp->numdisks; idx++) {
+	if (disklist[0] != '\0' ? in_list(disklist, sp->disktbl[idx].name) :
+		    (sp->disktbl[idx].rdios + sp->disktbl[idx].wrios > 0 &&
+					    is_whole_disk(sp->disktbl[idx].name))) {
+	    strcpy(iodevicetbl[numiodevices++], sp->disktbl[idx].name);
+	}
+    }
+}
+
+
+/*******************************************************************************
+Return the named device's entry in the sample's disk table (the index is
+tried first) - or an entry of zeroes for a device that has gone.
+*******************************************************************************/
+const Diskstat* find_disk(const Sample *sp, const char *name, int guessidx) {
+    static const Diskstat	nodisk;
+    int				idx;
+
+    if (guessidx < sp->numdisks && strcmp(sp->disktbl[guessidx].name, name) == 0) {
+	return &sp->disktbl[guessidx];
+    }
+    for (idx=0; idx<sp->numdisks; idx++) {
+	if (strcmp(sp->disktbl[idx].name, name) == 0) {
+	    return &sp->disktbl[idx];
+	}
+    }
+    return &nodisk;
+}
+
+
+/*******************************************************************************
+Append the IO (iostat) rows for the interval from oldsp (NULL: boot) to newsp.
+*******************************************************************************/
+void output_io_rows(const Sample *oldsp, const Sample *newsp) {
+    static const Diskstat	bootdisk;
+    const Diskstat		*olddsp, *newdsp;
+    double			secs, rdkb, wrkb;
+    int				idx;
+
+    secs = newsp->uptime - (oldsp ? oldsp->uptime : 0.0);
+    if (secs <= 0) {
+	secs = 1;
+    }
+    for (idx=0; idx<numiodevices; idx++) {
+	newdsp = find_disk(newsp, iodevicetbl[idx], idx);
+	olddsp = oldsp ? find_disk(oldsp, iodevicetbl[idx], idx) : &bootdisk;
+	rdkb = (double)(newdsp->rdsectors - olddsp->rdsectors) * SECTORSIZE / 1024;
+	wrkb = (double)(newdsp->wrsectors - olddsp->wrsectors) * SECTORSIZE / 1024;
+	add_text(&iobuf, "%-13s %8.2f %12.2f %12.2f %10.0f %10.0f\n", iodevicetbl[idx],
+		(newdsp->rdios + newdsp->wrios - olddsp->rdios - olddsp->wrios) / secs,
+		rdkb / secs, wrkb / secs, rdkb, wrkb);
+    }
+}
+
+
+/*******************************************************************************
+Append the NET (sar -n DEV) rows for the interval from oldsp to newsp.
+*******************************************************************************/
+void output_net_rows(const Sample *oldsp, const Sample *newsp) {
+    const Netstat	*oldnsp, *newnsp;
+    double		secs;
+    int			idx, oldidx;
+
+    if ((secs = newsp->uptime - oldsp->uptime) <= 0) {
+	secs = 1;
+    }
+    for (idx=0; idx<newsp->numnets; idx++) {
+	newnsp = &newsp->nettbl[idx];
+	oldnsp = newnsp;	/* a new interface: no change */
+	for (oldidx=0; oldidx<oldsp->numnets; oldidx++) {
+	    if (strcmp(oldsp->nettbl[(oldidx+idx)%oldsp->numnets].name, newnsp->name) == 0) {
+		oldnsp = &oldsp->nettbl[(oldidx+idx)%oldsp->numnets];
+		break;
+	    }
+	}
+	add_text(&netbuf, "%-9s %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n", newnsp->name,
+		(newnsp->rxpackets - oldnsp->rxpackets) / secs,
+		(newnsp->txpackets - oldnsp->txpackets) / secs,
+		(newnsp->rxbytes - oldnsp->rxbytes) / 1024.0 / secs,
+		(newnsp->txbytes - oldnsp->txbytes) / 1024.0 / secs,
+		(newnsp->rxcompressed - oldnsp->rxcompressed) / secs,
+		(newnsp->txcompressed - oldnsp->txcompressed) / secs,
+		(newnsp->rxmulticast - oldnsp->rxmulticast) / secs);
+    }
+}
+
+
+/*******************************************************************************
+Sleep until (monotonic) time starttime + secs.
+*******************************************************************************/
+void sleep_until(const struct timespec *starttime, int secs) {
+    struct timespec	waketime = *starttime;
+
+    waketime.tv_sec += secs;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &waketime, NULL) == EINTR) {
+	;
+    }
+}
+
+
+/*******************************************************************************
+Collect one data set (count samples of interval seconds) into datasetbuf:
+the VM and IO rows are since boot then count-1 intervals, the NET rows are
+count intervals (as vmstat, iostat and sar -n DEV report them).
+*******************************************************************************/
+void collect_data_set(Sample *sampletbl) {
+    struct timespec	starttime;
+    char		datestr[MAXPATHLEN];
+    time_t		timestamp;
+    Sample		*oldsp, *newsp;
+    int			idx;
+
+    vmbuf.len = iobuf.len = netbuf.len = 0;
+    timestamp = time(NULL);
+    strftime(datestr, sizeof(datestr), "%c %z", localtime(&timestamp));
+    clock_gettime(CLOCK_MONOTONIC, &starttime);
+
+    take_sample(&sampletbl[0]);
+    if (vmflag) {
+	output_vm_row(NULL, &sampletbl[0]);
+    }
+    if (ioflag) {
+	choose_io_devices(&sampletbl[0]);
+	output_io_rows(NULL, &sampletbl[0]);
+    }
+    for (idx=1; idx<=count; idx++) {
+	oldsp = &sampletbl[(idx-1)%2];
+	newsp = &sampletbl[idx%2];
+	sleep_until(&starttime, idx*interval);
+	take_sample(newsp);
+	if (idx < count) {
+	    if (vmflag) {
+		output_vm_row(oldsp, newsp);
+	    }
+	    if (ioflag) {
+		output_io_rows(oldsp, newsp);
+	    }
+	}
+	if (netflag) {
+	    output_net_rows(oldsp, newsp);
+	}
+    }
+
+    add_text(&datasetbuf, "DATE:\n%ld # %s\n\n", (long)timestamp, datestr);
+    if (vmflag) {
+	add_text(&datasetbuf, "VM:\n");
+	add_textbuf(&datasetbuf, &vmbuf);
+	add_text(&datasetbuf, "\n");
+    }
+    if (ioflag) {
+	add_text(&datasetbuf, "IO:\n");
+	add_textbuf(&datasetbuf, &iobuf);
+	add_text(&datasetbuf, "\n");
+    }
+    if (netflag) {
+	add_text(&datasetbuf, "NET:\n");
+	add_textbuf(&datasetbuf, &netbuf);
+	add_text(&datasetbuf, "\n");
+    }
+}
+
+
+/*******************************************************************************
+Append the TIME_VALUES: and METADATA: stanzas (of a new log file) to datasetbuf.
+*******************************************************************************/
+void add_header(void) {
+    char	hostname[MAXPATHLEN] = "";
+
+    gethostname(hostname, sizeof(hostname)-1);
+    add_text(&datasetbuf, "TIME_VALUES:\n%d %d # h=%s f=%d l=%d x='%s' d='%s'\n\n",
+		    count, interval, hostname, firsthour, lasthour, excludedays, disklist);
+    add_text(&datasetbuf, "METADATA:\n");
+    if (vmflag) {
+	add_text(&datasetbuf, "VM  V 2 %s\n", VMMETRICS);
+    }
+    if (ioflag) {
+	add_text(&datasetbuf, "IO  A 2 %s\n", IOMETRICS);
+    }
+    if (netflag) {
+	add_text(&datasetbuf, "NET A 1 %s\n", NETMETRICS);
+    }
+    add_text(&datasetbuf, "\n");
+}
+
+
+/*******************************************************************************
+Write datasetbuf (one data set, and the header of a new file) to the log file,
+with a single (appending) write.
+*******************************************************************************/
+void write_data_set(const char *outfilename) {
+    int		fd;
+
+    if ((fd = open(outfilename, O_WRONLY|O_CREAT|O_APPEND, 0644)) < 0) {
+	err_exit("Could not open output file '%s', aborting!", outfilename);
+    }
+    if (write(fd, datasetbuf.str, datasetbuf.len) != (ssize_t)datasetbuf.len) {
+	err_exit("Could not write to output file '%s', aborting!", outfilename);
+    }
+    close(fd);
+}
+
+
+/*******************************************************************************
+Append the space separated option argument to the list.
+*******************************************************************************/
+void add_to_list(char *list, const char *arg) {
+    size_t	len = strlen(list);
+
+    snprintf(list+len, MAXPATHLEN-len, "%s%s", len ? " " : "", arg);
+}
+
+
+/*******************************************************************************
+*******************************************************************************/
+int main(int argc, char *argv[]) {
+    char	outfilename[MAXPATHLEN], prevoutfilename[MAXPATHLEN] = "", daystr[8];
+    Sample	sampletbl[2];
+    time_t	now;
+    struct tm	*tmptr;
+    int		option, sleepsecs, datasetctr = 0;
+
+    progname = argv[0];
+    while ((option = getopt(argc, argv, "o:f:l:c:i:d:x:n:VINvh")) != -1) {
+	switch (option) {
+	    case 'o': outfilepattern = optarg;			break;
+	    case 'f': firsthour	 = atoi(optarg);		break;
+	    case 'l': lasthour	 = atoi(optarg);		break;
+	    case 'c': count	 = atoi(optarg);		break;
+	    case 'i': interval	 = atoi(optarg);		break;
+	    case 'd': add_to_list(disklist, optarg);		break;
+	    case 'x': add_to_list(excludedays, optarg);		break;
+	    case 'n': maxdatasets = atoi(optarg);		break;
+	    case 'V': vmflag  = 0;				break;
+	    case 'I': ioflag  = 0;				break;
+	    case 'N': netflag = 0;				break;
+	    case 'v': printf("%s: version %s\n", progname, PROGVERSIONSTR); exit(0);
+	    case 'h': printf(USAGEMSGFMT, progname, firsthour, lasthour, count, interval,
+				    progname, progname, progname, progname);
+		      exit(0);
+	    default:  fprintf(stderr, USAGEMSGFMT, progname, firsthour, lasthour, count,
+				    interval, progname, progname, progname, progname);
+		      exit(1);
+	}
+    }
+    if (outfilepattern == NULL || optind != argc || firsthour < 0 || firsthour > 23 ||
+		lasthour < 0 || lasthour > 23 || firsthour > lasthour || count < 1 ||
+		interval < 1 || maxdatasets < 0 || vmflag+ioflag+netflag == 0) {
+	fprintf(stderr, USAGEMSGFMT, progname, firsthour, lasthour, count, interval,
+				    progname, progname, progname, progname);
+	exit(1);
+    }
+
+    pagesize = sysconf(_SC_PAGESIZE);
+    memset(sampletbl, 0, sizeof(sampletbl));
+    open_procfile(&uptimefile);
+    if (vmflag) {
+	open_procfile(&statfile);
+	open_procfile(&meminfofile);
+	open_procfile(&vmstatfile);
+    }
+    if (ioflag) {
+	open_procfile(&diskstatsfile);
+    }
+    if (netflag) {
+	open_procfile(&netdevfile);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    while (maxdatasets == 0 || datasetctr < maxdatasets) {
+	now = time(NULL);
+	tmptr = localtime(&now);
+	strftime(daystr, sizeof(daystr), "%a", tmptr);
+	if (in_list(excludedays, daystr)) {		/* sleep until just after midnight */
+	    sleepsecs = (23-tmptr->tm_hour)*3600 + (60-tmptr->tm_min)*60;
+	} else if (tmptr->tm_hour < firsthour || tmptr->tm_hour > lasthour) {
+	    sleepsecs = (((24+firsthour-tmptr->tm_hour)%24-1)*3600 + (60-tmptr->tm_min)*60);
+	} else {
+	    if (strftime(outfilename, sizeof(outfilename), outfilepattern, tmptr) == 0) {
+		fprintf(stderr, "%s: output file pattern '%s' is empty or too long!\n",
+							    progname, outfilepattern);
+		exit(1);
+	    }
+	    datasetbuf.len = 0;
+	    if (strcmp(outfilename, prevoutfilename) != 0) {
+		add_header();
+		strcpy(prevoutfilename, outfilename);
+	    }
+	    collect_data_set(sampletbl);
+	    write_data_set(outfilename);
+	    datasetctr++;
+	    continue;
+	}
+	now = time(NULL);
+	printf("%s: %s sleeping for %d s\n", progname, strtok(ctime(&now), "\n"), sleepsecs);
+	fflush(stdout);
+	sleep(sleepsecs);
+    }
+    return 0;
+}